@@ -0,0 +1,456 @@
+/* arcs-bench: generate a synthetic linked-read data set at a given scale
+ * and time the stages of ARCS on it one at a time.
+ *
+ * The contigs are random sequences laid end to end as one genome. Each
+ * barcode is a molecule at a random place in the genome, and its read
+ * pairs are drawn uniformly from the molecule and written, already
+ * aligned, to a SAM or BAM file with the mates of a pair together.
+ * Molecules that span two contigs link their ends, as in real data.
+ *
+ * The stages are the functions runArcs calls: getContigKmers, to read
+ * the contig sizes and, as for --reads, to k-merize the contig ends,
+ * readBAM, pairContigs, createGraph and writeGraph. Each is reported
+ * with its wall time, throughput and the peak and current resident set
+ * size.
+ */
+
+#define ARCS_NO_MAIN 1
+#include "Arcs_work.cpp"
+#include "BgzfWriter.hpp"
+#include <chrono>
+#include <random>
+
+#define BENCH_PROGRAM "arcs-bench"
+
+static const char BENCH_USAGE_MESSAGE[] =
+"Usage: " BENCH_PROGRAM " [options]\n"
+"Generate synthetic contigs and barcoded read alignments, then run each stage of " PROGRAM " on them and\n"
+"report its time, throughput and memory.\n"
+"   -n  Number of contigs (default: 1000)\n"
+"   -L  Mean contig length; lengths are uniform in [L/2, 3L/2] (default: 20000)\n"
+"   -B  Number of barcodes (default: 5000)\n"
+"   -R  Mean number of read pairs per barcode (default: 50)\n"
+"   -D  Distribution of read pairs per barcode: fixed (every barcode has -R) or exp (geometric with mean -R)\n"
+"       (default: fixed)\n"
+"   -M  Molecule length (default: 50000)\n"
+"   -o  Prefix of the generated files: <prefix>.fa, <prefix>.sam or .bam and <prefix>_original.gv\n"
+"       (default: arcs_bench)\n"
+"   -S  Random seed (default: 1)\n"
+"   -t  Number of threads (default: 1)\n"
+"   --bam  Write the alignments as BAM rather than SAM\n"
+"   --keep  Keep the generated files\n"
+"   -c, -e, -g, -k, -l, -m, -r, -z  As for " PROGRAM ", with its defaults except -m (default: 1-100000)\n";
+
+/* Length of the reads and of the fragments of a pair */
+static const int BENCH_READ_LEN = 100;
+static const int BENCH_INSERT = 350;
+
+struct BenchParams {
+    int contigs;
+    int contigLen;
+    int barcodes;
+    int pairs;
+    bool expPairs;
+    int moleculeLen;
+    std::string prefix;
+    unsigned seed;
+    bool bam;
+    bool keep;
+
+    BenchParams() : contigs(1000), contigLen(20000), barcodes(5000), pairs(50), expPairs(false),
+        moleculeLen(50000), prefix("arcs_bench"), seed(1), bam(false), keep(false) {}
+};
+
+static BenchParams bench;
+
+/* Times one stage and prints it as a row of the report */
+class StageTimer {
+  public:
+    explicit StageTimer(const char* name) : m_name(name), m_start(std::chrono::steady_clock::now()) {}
+
+    /* End the stage, which processed n items of the named unit */
+    void done(size_t n, const char* unit) {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+        printf("%-14s %12zu %-9s %10.3f %14.0f %12.1f %12.1f\n", m_name, n, unit, secs,
+            secs > 0 ? n / secs : 0.0, ARCS::peakRSS() / 1048576.0, ARCS::currentRSS() / 1048576.0);
+        fflush(stdout);
+    }
+
+    static void header() {
+        printf("%-14s %12s %-9s %10s %14s %12s %12s\n", "stage", "items", "unit", "seconds",
+            "items/s", "peak RSS MB", "RSS MB");
+    }
+
+  private:
+    const char* m_name;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+/* BAM bin of an alignment in [beg, end), 0-based (SAMv1 section 5.3) */
+static int bamBin(int beg, int end) {
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+/* Writes the generated alignments as SAM or BAM */
+class AlignmentWriter {
+  public:
+    AlignmentWriter(const std::string& path, bool bam, const std::vector<std::string>& names, const std::vector<int>& lengths)
+        : m_sam(NULL), m_bam(NULL) {
+        /* The mates of a pair are together, but the file is not sorted */
+        std::string text = "@HD\tVN:1.6\tSO:unknown\tGO:query\n";
+        for (size_t i = 0; i < names.size(); ++i) {
+            std::ostringstream sq;
+            sq << "@SQ\tSN:" << names[i] << "\tLN:" << lengths[i] << "\n";
+            text += sq.str();
+        }
+        if (!bam) {
+            m_sam = fopen(path.c_str(), "w");
+            if (m_sam != NULL)
+                fputs(text.c_str(), m_sam);
+            return;
+        }
+        m_bam = new BgzfWriter(path);
+        m_bam->write("BAM\1", 4);
+        m_bam->write32(text.size());
+        m_bam->write(text.data(), text.size());
+        m_bam->write32(names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            m_bam->write32(names[i].size() + 1);
+            m_bam->write(names[i].c_str(), names[i].size() + 1);
+            m_bam->write32(lengths[i]);
+        }
+    }
+
+    ~AlignmentWriter() { delete m_bam; }
+
+    bool good() const { return m_sam != NULL || m_bam != NULL; }
+
+    /* Write one read of a pair with the sequence seq (BENCH_READ_LEN bp); pos is 0-based */
+    void add(const std::string& name, int flag, int ref, const std::string& refName, int pos, int matePos, int tlen, const char* seq) {
+        if (m_sam != NULL) {
+            fprintf(m_sam, "%s\t%d\t%s\t%d\t60\t%dM\t=\t%d\t%d\t%.*s\t*\tNM:i:0\n", name.c_str(), flag, refName.c_str(),
+                pos + 1, BENCH_READ_LEN, matePos + 1, tlen, BENCH_READ_LEN, seq);
+            return;
+        }
+        std::vector<uint8_t>& r = m_rec;
+        r.clear();
+        put32(ref);
+        put32(pos);
+        r.push_back(name.size() + 1);
+        r.push_back(60);
+        put16(bamBin(pos, pos + BENCH_READ_LEN));
+        put16(1);
+        put16(flag);
+        put32(BENCH_READ_LEN);
+        put32(ref);
+        put32(matePos);
+        put32(tlen);
+        r.insert(r.end(), name.c_str(), name.c_str() + name.size() + 1);
+        put32(BENCH_READ_LEN << 4 | BAM_CMATCH);
+        for (int i = 0; i < BENCH_READ_LEN; i += 2)
+            r.push_back(baseCode(seq[i]) << 4 | (i + 1 < BENCH_READ_LEN ? baseCode(seq[i + 1]) : 0));
+        r.insert(r.end(), BENCH_READ_LEN, 0xff);
+        const uint8_t nm[4] = { 'N', 'M', 'C', 0 };
+        r.insert(r.end(), nm, nm + 4);
+        m_bam->write32(r.size());
+        m_bam->write(r.data(), r.size());
+    }
+
+    bool close() {
+        bool ok = true;
+        if (m_sam != NULL)
+            ok = fclose(m_sam) == 0;
+        if (m_bam != NULL)
+            ok = m_bam->close();
+        m_sam = NULL;
+        return ok;
+    }
+
+  private:
+    /* 4-bit BAM code of a base */
+    static uint8_t baseCode(char c) {
+        switch (c) {
+            case 'A': return 1;
+            case 'C': return 2;
+            case 'G': return 4;
+            case 'T': return 8;
+            default: return 15;
+        }
+    }
+
+    void put16(uint16_t v) { m_rec.push_back(uint8_t(v)); m_rec.push_back(uint8_t(v >> 8)); }
+    void put32(uint32_t v) { put16(uint16_t(v)); put16(uint16_t(v >> 16)); }
+
+    FILE* m_sam;
+    BgzfWriter* m_bam;
+    std::vector<uint8_t> m_rec;
+};
+
+/* Random barcode sequence of index i */
+std::string benchBarcode(size_t i) {
+    static const char bases[] = "ACGT";
+    std::string b(16, 'A');
+    for (int j = 15; j >= 0; --j, i >>= 2)
+        b[j] = bases[i & 3];
+    return b;
+}
+
+/*
+ * Write the contigs to <prefix>.fa and the alignments to <prefix>.sam
+ * or .bam. Returns the number of alignment records written.
+ */
+size_t generateData(const std::string& fastaFile, const std::string& alnFile) {
+    std::mt19937_64 rng(bench.seed);
+    static const char bases[] = "ACGT";
+
+    /* Contigs, laid end to end from offset 0 */
+    std::vector<std::string> names(bench.contigs);
+    std::vector<int> lengths(bench.contigs);
+    std::vector<int64_t> offsets(bench.contigs + 1, 0);
+    std::uniform_int_distribution<int> lengthDist(std::max(bench.contigLen / 2, 1), bench.contigLen * 3 / 2);
+    FILE* fa = fopen(fastaFile.c_str(), "w");
+    if (fa == NULL) {
+        std::cerr << "Could not write " << fastaFile << ". --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+    std::string seq;
+    for (int i = 0; i < bench.contigs; ++i) {
+        std::ostringstream name;
+        name << "contig" << i;
+        names[i] = name.str();
+        lengths[i] = lengthDist(rng);
+        offsets[i + 1] = offsets[i] + lengths[i];
+        seq.resize(lengths[i]);
+        for (int j = 0; j < lengths[i]; ++j)
+            seq[j] = bases[rng() & 3];
+        fprintf(fa, ">%s\n", names[i].c_str());
+        for (int j = 0; j < lengths[i]; j += 80)
+            fprintf(fa, "%.*s\n", std::min(80, lengths[i] - j), seq.data() + j);
+    }
+    if (fclose(fa) != 0) {
+        std::cerr << "Could not write " << fastaFile << ". --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    /* Reads carry a random sequence; ARCS only looks at their alignment */
+    std::string readSeq(BENCH_READ_LEN, 'A');
+    for (int j = 0; j < BENCH_READ_LEN; ++j)
+        readSeq[j] = bases[rng() & 3];
+
+    AlignmentWriter out(alnFile, bench.bam, names, lengths);
+    if (!out.good()) {
+        std::cerr << "Could not write " << alnFile << ". --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+    int64_t genome = offsets.back();
+    int64_t molecule = std::min<int64_t>(bench.moleculeLen, genome);
+    std::uniform_int_distribution<int64_t> startDist(0, genome - molecule);
+    std::uniform_int_distribution<int64_t> pairDist(0, std::max<int64_t>(molecule - BENCH_INSERT, 0));
+    std::geometric_distribution<int> expDist(1.0 / (bench.pairs + 1));
+    size_t nRecords = 0;
+    for (int b = 0; b < bench.barcodes; ++b) {
+        std::string barcode = benchBarcode(b);
+        int64_t start = startDist(rng);
+        int nPairs = bench.expPairs ? std::max(expDist(rng), 1) : bench.pairs;
+        for (int p = 0; p < nPairs; ++p) {
+            int64_t x = start + pairDist(rng);
+            int ref = std::upper_bound(offsets.begin(), offsets.end(), x) - offsets.begin() - 1;
+            int pos = x - offsets[ref];
+            /* Pairs that would run off the end of the contig are lost */
+            if (pos + BENCH_INSERT > lengths[ref])
+                continue;
+            int matePos = pos + BENCH_INSERT - BENCH_READ_LEN;
+            std::ostringstream name;
+            name << "r" << b << "." << p << "_" << barcode;
+            out.add(name.str(), 99, ref, names[ref], pos, matePos, BENCH_INSERT, readSeq.data());
+            out.add(name.str(), 147, ref, names[ref], matePos, pos, -BENCH_INSERT, readSeq.data());
+            nRecords += 2;
+        }
+    }
+    if (!out.close()) {
+        std::cerr << "Could not write " << alnFile << ". --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+    return nRecords;
+}
+
+/* Run the stages of ARCS on the generated files */
+void runStages(const std::string& fastaFile, const std::string& alnFile, const std::string& graphFile) {
+    StageTimer::header();
+
+    ARCS::ContigTable contigs;
+    ARCS::ContigKMap kmap;
+    ARCS::LongContigKMap longKmap;
+    size_t bp = 0;
+    {
+        StageTimer t("readContigs");
+        getContigKmers(fastaFile, kmap, params.k_value, params.k_shift, contigs, false);
+        for (size_t i = 0; i < contigs.size(); ++i)
+            bp += contigs.lengths[i];
+        t.done(bp, "bp");
+    }
+
+    ARCS::IndexMap imap;
+    ARCS::IndexMultMap indexMultMap;
+    {
+        StageTimer t("readBAM");
+        /* Every record read, barcoded or not, is added to the records counter */
+        uint64_t before = metrics.counter("records");
+        readBAM(alnFile, imap, indexMultMap, contigs);
+        t.done(metrics.counter("records") - before, "records");
+    }
+
+    SignificanceTable sig(params.error_percent, params.binomial);
+    ARCS::PairMap pmap;
+    {
+        StageTimer t("pairContigs");
+        pairContigs(IndexMapBarcodes(imap, indexMultMap), pmap, sig);
+        t.done(imap.size(), "barcodes");
+    }
+
+    ARCS::CompactGraph g;
+    {
+        StageTimer t("createGraph");
+        createGraph(pmap, contigs.size(), g, params.min_links, sig);
+        t.done(pmap.size(), "pairs");
+    }
+
+    {
+        StageTimer t("writeGraph");
+        writeGraph(graphFile, g, contigs);
+        t.done(g.edges.size(), "edges");
+    }
+
+    /* Last, so that the k-mers do not count toward the peak memory of the other stages */
+    {
+        StageTimer t("getContigKmers");
+        ARCS::ContigTable kmerContigs;
+        if (params.k_value <= 32)
+            getContigKmers(fastaFile, kmap, params.k_value, params.k_shift, kmerContigs, true);
+        else
+            getContigKmers(fastaFile, longKmap, params.k_value, params.k_shift, kmerContigs, true);
+        t.done(bp, "bp");
+    }
+}
+
+static const char bench_shortopts[] = "n:L:B:R:D:M:o:S:t:c:e:g:k:l:m:r:z:";
+
+enum { OPT_BENCH_BAM = 1, OPT_BENCH_KEEP, OPT_BENCH_HELP };
+
+static const struct option bench_longopts[] = {
+    {"bam", no_argument, NULL, OPT_BENCH_BAM},
+    {"keep", no_argument, NULL, OPT_BENCH_KEEP},
+    {"help", no_argument, NULL, OPT_BENCH_HELP},
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char** argv) {
+
+    params.min_mult = 1;
+    params.max_mult = 100000;
+
+    for (int c; (c = getopt_long(argc, argv, bench_shortopts, bench_longopts, NULL)) != -1;) {
+        std::istringstream arg(optarg != NULL ? optarg : "");
+        switch (c) {
+            case '?':
+                std::cerr << "Try " << BENCH_PROGRAM << " --help for more information.\n";
+                exit(EXIT_FAILURE);
+            case 'n':
+                arg >> bench.contigs; break;
+            case 'L':
+                arg >> bench.contigLen; break;
+            case 'B':
+                arg >> bench.barcodes; break;
+            case 'R':
+                arg >> bench.pairs; break;
+            case 'D': {
+                std::string dist;
+                arg >> dist;
+                if (dist != "fixed" && dist != "exp")
+                    arg.setstate(std::ios::failbit);
+                bench.expPairs = dist == "exp";
+                }
+                break;
+            case 'M':
+                arg >> bench.moleculeLen; break;
+            case 'o':
+                arg >> bench.prefix; break;
+            case 'S':
+                arg >> bench.seed; break;
+            case 't':
+                arg >> params.threads; break;
+            case 'c':
+                arg >> params.min_reads; break;
+            case 'e':
+                arg >> params.end_length; break;
+            case 'g':
+                arg >> params.k_shift; break;
+            case 'k':
+                arg >> params.k_value; break;
+            case 'l':
+                arg >> params.min_links; break;
+            case 'm': {
+                char dash = 0;
+                arg >> params.min_mult >> dash >> params.max_mult;
+                if (dash != '-')
+                    arg.setstate(std::ios::failbit);
+                }
+                break;
+            case 'r':
+                arg >> params.error_percent; break;
+            case 'z':
+                arg >> params.min_size; break;
+            case OPT_BENCH_BAM:
+                bench.bam = true; break;
+            case OPT_BENCH_KEEP:
+                bench.keep = true; break;
+            case OPT_BENCH_HELP:
+                std::cout << BENCH_USAGE_MESSAGE;
+                exit(EXIT_SUCCESS);
+        }
+        if (optarg != NULL && (!arg.eof() || arg.fail())) {
+            std::cerr << BENCH_PROGRAM ": invalid option: `-" << (char)c << optarg << "'\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (bench.contigs < 1 || bench.contigLen < 2 * BENCH_INSERT || bench.barcodes < 0 || bench.pairs < 1
+            || bench.moleculeLen < BENCH_INSERT) {
+        std::cerr << "-n and -R must be at least 1, -B at least 0, -L at least " << 2 * BENCH_INSERT << " and -M at least "
+            << BENCH_INSERT << ". Exiting... \n";
+        exit(EXIT_FAILURE);
+    }
+    if (params.k_value < 1 || params.k_value > 64 || params.k_shift < 1 || params.threads < 1) {
+        std::cerr << "-k must be between 1 and 64, and -g and -t at least 1. Exiting... \n";
+        exit(EXIT_FAILURE);
+    }
+#if _OPENMP
+    omp_set_num_threads(params.threads);
+#endif
+    params.base_name = bench.prefix;
+
+    std::string fastaFile = bench.prefix + ".fa";
+    std::string alnFile = bench.prefix + (bench.bam ? ".bam" : ".sam");
+    std::string graphFile = bench.prefix + "_original.gv";
+
+    std::cout << "Generating " << bench.contigs << " contigs and " << bench.barcodes << " barcodes of "
+        << (bench.expPairs ? "on average " : "") << bench.pairs << " read pairs in " << alnFile << "..." << std::endl;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t records = generateData(fastaFile, alnFile);
+    std::cout << "Wrote " << records << " records in "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s\n" << std::endl;
+
+    runStages(fastaFile, alnFile, graphFile);
+
+    if (!bench.keep) {
+        remove(fastaFile.c_str());
+        remove(alnFile.c_str());
+        remove(graphFile.c_str());
+    }
+    return 0;
+}
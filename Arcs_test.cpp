@@ -0,0 +1,1881 @@
+/* arcs-test: checks of arcs against the libraries whose output it
+ * reproduces and against the simpler code paths it replaced; run by
+ * make check.
+ *
+ * Each check function reports its failures on stderr and returns their
+ * number. Files are written to the current directory and removed.
+ */
+
+#define ARCS_NO_MAIN 1
+#include "Arcs_work.cpp"
+#include "BgzfWriter.hpp"
+#include <random>
+
+/* Report a failed check of a value that should equal want */
+template <typename T>
+bool expectEqual(const char* what, const std::string& where, const T& got, const T& want) {
+    if (got == want)
+        return true;
+    std::cerr << where << ": " << what << " is " << got << ", expected " << want << "\n";
+    return false;
+}
+
+/* Report a failed check of cond */
+bool expect(bool cond, const std::string& what) {
+    if (!cond)
+        std::cerr << what << "\n";
+    return cond;
+}
+
+/* The contents of the file at path */
+std::vector<uint8_t> readFileBytes(const std::string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void writeFileBytes(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+/*
+ * escapeDotString must quote the vertex IDs of the graph file as
+ * boost::write_graphviz does: against boost::escape_dot_string for
+ * every string of up to two bytes and for a list of longer ones.
+ */
+
+int checkEscapeDotString() {
+    static const char* const ids[] = {
+        "contig1", "_a1", "A_b9", "1a", "a-b", "a.b", "a b", "a\"b",
+        "42", "-7", "5.", "-5.25", ".5", "-.5", "-.55", "--1", "1.2.3", "+1",
+        "a\351", "\351x", "\3511", "1\351", "-\351", "-.\351", "\303\251t\303\251",
+    };
+    std::vector<std::string> all(ids, ids + sizeof ids / sizeof *ids);
+    all.push_back("");
+    for (int c = 0; c < 256; ++c) {
+        all.push_back(std::string(1, char(c)));
+        for (int d = 0; d < 256; ++d)
+            all.push_back(std::string(1, char(c)) + char(d));
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < all.size(); ++i) {
+        std::string got = escapeDotString(all[i]), want = boost::escape_dot_string(all[i]);
+        if (got != want) {
+            std::cerr << "escapeDotString(" << all[i] << ") = " << got << ", boost gives " << want << "\n";
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+/*
+ * decodeAlignment must give the same ReadAlignment for a BAM record
+ * as decodeSamLine gives for the SAM line it was encoded from.
+ */
+
+/* A SAM line and the BAM type to store its integer tags as */
+struct TestRead {
+    const char* sam;
+    char intType;
+};
+
+static const char* const TEST_REFS[] = { "ctg1", "ctg2" };
+static const int TEST_REF_LENGTH = 5000;
+
+#define SEQ50 "ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTAC"
+#define QUAL50 "IIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIIII"
+
+static const TestRead TEST_READS[] = {
+    { "r1_ACGTACGT\t99\tctg1\t101\t60\t50M\t=\t301\t250\t" SEQ50 "\t*\tNM:i:2", 'C' },
+    { "r1_ACGTACGT\t147\tctg1\t301\t60\t10S30M2I8M\t=\t101\t-250\t" SEQ50 "\t" QUAL50 "\tXS:Z:abc\tXB:B:s,1,-2,3\tNM:i:3", 's' },
+    { "r2_GGGG\t83\tctg2\t5\t1\t20M3D30M\t=\t200\t245\t" SEQ50 "\t*\tAS:f:1.5\tNM:i:1", 'c' },
+    { "r3_TTTTAAAA\t163\tctg2\t1000\t37\t25M1X24M\t=\t800\t-250\t" SEQ50 "\t*\tRG:Z:x\tXA:A:y\tNM:i:300", 'S' },
+    { "r4\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*", 'i' },
+    { "r5_ACGTN\t99\tctg1\t1\t60\t50M\t=\t100\t149\t" SEQ50 "\t*\tNM:i:0", 'I' },
+    { "r6_ACGT\t99\tctg1\t7\t60\t48=2X\t=\t100\t143\t" SEQ50 "\t*\tHI:i:1\tNM:i:2", 'i' },
+    { "r7_ACGT\t99\tctg1\t9\t60\t50M\t=\t100\t141\t*\t*\tNM:i:1", 'C' },
+};
+
+/* Encodes the SAM lines of TestReads as BAM records */
+class BamRecordEncoder {
+  public:
+    /* Encode read, whose reference names are in refs, into m_rec */
+    const std::vector<uint8_t>& encode(const TestRead& read, const std::vector<std::string>& refs) {
+        std::vector<std::string> f;
+        std::istringstream line(read.sam);
+        for (std::string field; std::getline(line, field, '\t');)
+            f.push_back(field);
+
+        std::vector<uint32_t> cigar;
+        for (size_t i = 0, len = 0; f[5] != "*" && i < f[5].size(); ++i) {
+            if (isdigit(f[5][i])) {
+                len = len * 10 + (f[5][i] - '0');
+                continue;
+            }
+            cigar.push_back(len << 4 | std::string("MIDNSHP=X").find(f[5][i]));
+            len = 0;
+        }
+        std::string seq = f[9] == "*" ? "" : f[9];
+
+        m_rec.clear();
+        put(refID(f[2], refs), 4);
+        put(atoi(f[3].c_str()) - 1, 4);
+        put(f[0].size() + 1, 1);
+        put(atoi(f[4].c_str()), 1);
+        put(4680, 2);
+        put(cigar.size(), 2);
+        put(atoi(f[1].c_str()), 2);
+        put(seq.size(), 4);
+        put(f[6] == "=" ? refID(f[2], refs) : refID(f[6], refs), 4);
+        put(atoi(f[7].c_str()) - 1, 4);
+        put(atoi(f[8].c_str()), 4);
+        m_rec.insert(m_rec.end(), f[0].c_str(), f[0].c_str() + f[0].size() + 1);
+        for (size_t i = 0; i < cigar.size(); ++i)
+            put(cigar[i], 4);
+        for (size_t i = 0; i < seq.size(); i += 2)
+            put(baseCode(seq[i]) << 4 | (i + 1 < seq.size() ? baseCode(seq[i + 1]) : 0), 1);
+        for (size_t i = 0; i < seq.size(); ++i)
+            put(f[10] == "*" ? 0xff : f[10][i] - 33, 1);
+        for (size_t i = 11; i < f.size(); ++i)
+            putTag(f[i], read.intType);
+        return m_rec;
+    }
+
+  private:
+    static int refID(const std::string& name, const std::vector<std::string>& refs) {
+        std::vector<std::string>::const_iterator it = std::find(refs.begin(), refs.end(), name);
+        return it == refs.end() ? -1 : it - refs.begin();
+    }
+
+    static uint8_t baseCode(char c) {
+        return std::string("=ACMGRSVTWYHKDBN").find(c);
+    }
+
+    void put(uint32_t v, int bytes) {
+        for (int i = 0; i < bytes; ++i)
+            m_rec.push_back(uint8_t(v >> (8 * i)));
+    }
+
+    /* Integer width of a BAM aux type */
+    static int width(char type) {
+        return type == 'c' || type == 'C' ? 1 : type == 's' || type == 'S' ? 2 : 4;
+    }
+
+    void putTag(const std::string& tag, char intType) {
+        m_rec.push_back(tag[0]);
+        m_rec.push_back(tag[1]);
+        char type = tag[3];
+        std::string value = tag.substr(5);
+        switch (type) {
+            case 'i':
+                m_rec.push_back(intType);
+                put(atoi(value.c_str()), width(intType));
+                break;
+            case 'f': {
+                m_rec.push_back('f');
+                float x = atof(value.c_str());
+                uint32_t bits;
+                memcpy(&bits, &x, 4);
+                put(bits, 4);
+                break;
+            }
+            case 'B': {
+                m_rec.push_back('B');
+                m_rec.push_back(value[0]);
+                std::vector<int> items;
+                std::istringstream in(value.substr(2));
+                for (std::string item; std::getline(in, item, ',');)
+                    items.push_back(atoi(item.c_str()));
+                put(items.size(), 4);
+                for (size_t i = 0; i < items.size(); ++i)
+                    put(items[i], width(value[0]));
+                break;
+            }
+            default:
+                m_rec.push_back(type);
+                if (type == 'A')
+                    m_rec.push_back(value[0]);
+                else
+                    m_rec.insert(m_rec.end(), value.c_str(), value.c_str() + value.size() + 1);
+        }
+    }
+
+    std::vector<uint8_t> m_rec;
+};
+
+/* Write a BAM file of reads, with the header in a block of its own */
+void writeTestBam(const std::string& path, const TestRead* reads, size_t n) {
+    std::vector<std::string> refs(TEST_REFS, TEST_REFS + 2);
+    std::string text = "@HD\tVN:1.6\tSO:unsorted\n";
+    BgzfWriter out(path);
+    out.write("BAM\1", 4);
+    out.write32(text.size());
+    out.write(text.data(), text.size());
+    out.write32(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i) {
+        out.write32(refs[i].size() + 1);
+        out.write(refs[i].c_str(), refs[i].size() + 1);
+        out.write32(TEST_REF_LENGTH);
+    }
+    out.endBlock();
+    BamRecordEncoder encoder;
+    for (size_t i = 0; i < n; ++i) {
+        const std::vector<uint8_t>& rec = encoder.encode(reads[i], refs);
+        out.write32(rec.size());
+        out.write(rec.data(), rec.size());
+    }
+    out.close();
+}
+
+/* Compare the decoded BAM record i with its SAM line */
+int compareAlignment(size_t i, const ARCS::ReadAlignment& bam, const ARCS::ReadAlignment& sam) {
+    std::ostringstream where;
+    where << "BAM record " << i << " (" << sam.readName << ")";
+    ReadPairState st;
+    int failed = 0;
+    failed += !expectEqual("read name", where.str(), bam.readName, sam.readName);
+    failed += !expectEqual("barcode", where.str(), parseIndex(bam.readName, st), parseIndex(sam.readName, st));
+    failed += !expectEqual("flag", where.str(), bam.flag, sam.flag);
+    failed += !expectEqual("contig", where.str(), bam.contig, sam.contig);
+    failed += !expectEqual("pos", where.str(), bam.pos, sam.pos);
+    failed += !expectEqual("mapq", where.str(), bam.mapq, sam.mapq);
+    failed += !expectEqual("hasSeq", where.str(), bam.hasSeq, sam.hasSeq);
+    failed += !expectEqual("identity", where.str(), bam.si, sam.si);
+    return failed;
+}
+
+int checkBamDecoding() {
+    static const char* const path = "arcs-test.bam";
+    const size_t nReads = sizeof TEST_READS / sizeof *TEST_READS;
+    writeTestBam(path, TEST_READS, nReads);
+
+    /* ctg0 is not in the BAM header, so contig IDs differ from reference IDs */
+    ARCS::ContigTable contigs;
+    contigs.add("ctg0", TEST_REF_LENGTH);
+    for (size_t i = 0; i < 2; ++i)
+        contigs.add(TEST_REFS[i], TEST_REF_LENGTH);
+
+    std::vector<ARCS::ReadAlignment> sam(nReads);
+    std::string scafName;
+    for (size_t i = 0; i < nReads; ++i)
+        decodeSamLine(TEST_READS[i].sam, strlen(TEST_READS[i].sam), contigs, scafName, sam[i]);
+
+    int failed = 0;
+    failed += !expect(BamReader::isBam(path), "arcs-test.bam is not recognised as BAM");
+
+    /* One record at a time */
+    {
+        BamReader in(path);
+        failed += !expect(in.good(), "Cannot read the header of arcs-test.bam");
+        std::vector<uint32_t> refContigs;
+        for (size_t i = 0; i < in.refNames().size(); ++i)
+            refContigs.push_back(contigs.find(in.refNames()[i]));
+        BamRecord rec;
+        ARCS::ReadAlignment aln;
+        size_t n = 0;
+        for (; in.next(rec); ++n) {
+            if (n < nReads) {
+                decodeAlignment(rec, refContigs, aln);
+                failed += compareAlignment(n, aln, sam[n]);
+            }
+        }
+        failed += !expectEqual("records read by next()", path, n, nReads);
+        failed += !expect(in.good(), "next() fails at the end of arcs-test.bam");
+    }
+
+    /* In batches of blocks, as the pipeline of readBAM reads them */
+    {
+        BamReader in(path);
+        std::vector<BgzfBlock> blocks(4);
+        std::vector<BamRecord> recs;
+        size_t n = 0, nBlocks;
+        do {
+            nBlocks = in.readBlocks(blocks);
+            for (size_t b = 0; b < nBlocks; ++b)
+                failed += !expect(blocks[b].inflate(), "Cannot inflate a block of arcs-test.bam");
+            n += in.splitRecords(blocks, nBlocks, recs);
+        } while (nBlocks > 0 && in.good());
+        failed += !expectEqual("records read by splitRecords()", path, n, nReads);
+        failed += !expect(in.good(), "splitRecords() fails at the end of arcs-test.bam");
+    }
+
+    remove(path);
+    return failed;
+}
+
+/*
+ * Integers of a SAM line that do not fit in an int are rejected: each
+ * of these lines would pass the filters if its field wrapped to 32 bits.
+ */
+int checkSamIntegers() {
+    static const char* const lines[] = {
+        "r1_ACGT\t4294967395\tctg1\t101\t60\t50M\t=\t301\t250\t" SEQ50 "\t*\tNM:i:0",
+        "r1_ACGT\t99\tctg1\t101\t4294967356\t50M\t=\t301\t250\t" SEQ50 "\t*\tNM:i:0",
+        "r1_ACGT\t99\tctg1\t101\t60\t50M\t=\t301\t250\t" SEQ50 "\t*\tNM:i:4294967296",
+        "r1_ACGT\t99\tctg1\t101\t60\t4294967346M\t=\t301\t250\t" SEQ50 "\t*\tNM:i:0",
+        "r1_ACGT\t99\tctg1\t101\t60\t99999999999999999999999999999999999999M\t=\t301\t250\t" SEQ50 "\t*\tNM:i:0",
+    };
+    ARCS::ContigTable contigs;
+    contigs.add("ctg1", TEST_REF_LENGTH);
+    std::string scafName;
+    ARCS::ReadAlignment aln;
+    int failed = 0;
+    for (size_t i = 0; i < sizeof lines / sizeof *lines; ++i) {
+        decodeSamLine(lines[i], strlen(lines[i]), contigs, scafName, aln);
+        if (filterRead(aln.hasSeq, aln.flag, aln.mapq, aln.si) == PASS_FILTERS) {
+            std::cerr << "SAM line " << i << " with an integer that does not fit in an int passes the filters\n";
+            ++failed;
+        }
+    }
+
+    static const char* const ints[] = { "2147483647", "-2147483648", "2147483648", "-2147483649", "12x", "-", "" };
+    static const int values[] = { INT_MAX, INT_MIN, 0, 0, 12, 0, 0 };
+    static const bool fits[] = { true, true, false, false, true, true, true };
+    for (size_t i = 0; i < sizeof ints / sizeof *ints; ++i) {
+        int value = -1;
+        bool ok = parseInt(ints[i], ints[i] + strlen(ints[i]), value);
+        failed += !expectEqual("parseInt", std::string("\"") + ints[i] + "\"", value, values[i]);
+        failed += !expectEqual("parseInt fits", std::string("\"") + ints[i] + "\"", ok, fits[i]);
+    }
+    return failed;
+}
+
+/* A record with a negative l_seq, or a BGZF block that is cut short or too large, is rejected */
+int checkCorruptBam() {
+    static const char* const path = "arcs-test.bam";
+    const size_t nReads = sizeof TEST_READS / sizeof *TEST_READS;
+    int failed = 0;
+
+    /* Reads the records of path one at a time and in batches; both must fail */
+    struct ReadFails {
+        static int check(const char* path, const char* what) {
+            int failed = 0;
+            {
+                BamReader in(path);
+                BamRecord rec;
+                while (in.next(rec)) {}
+                failed += !expect(!in.good(), std::string("next() accepts ") + what);
+            }
+            {
+                BamReader in(path);
+                std::vector<BgzfBlock> blocks(4);
+                std::vector<BamRecord> recs;
+                size_t nBlocks;
+                do {
+                    nBlocks = in.readBlocks(blocks);
+                    for (size_t b = 0; b < nBlocks; ++b)
+                        blocks[b].inflate();
+                    in.splitRecords(blocks, nBlocks, recs);
+                } while (nBlocks > 0 && in.good());
+                failed += !expect(!in.good(), std::string("readBlocks() and splitRecords() accept ") + what);
+            }
+            return failed;
+        }
+    };
+
+    writeTestBam(path, TEST_READS, nReads);
+    const std::vector<uint8_t> good = readFileBytes(path);
+    /* The header block, then the block of the records, then the EOF block */
+    size_t headerBlock = bamLe16(&good[16]) + 1;
+    size_t recordBlock = bamLe16(&good[headerBlock + 16]) + 1;
+
+    /* Cut the trailer of the block of the records short */
+    std::vector<uint8_t> bad(good.begin(), good.begin() + headerBlock + recordBlock - 3);
+    writeFileBytes(path, bad);
+    failed += ReadFails::check(path, "a truncated BGZF block");
+
+    /* A 1 GiB ISIZE in the trailer of the block of the records */
+    bad = good;
+    bad[headerBlock + recordBlock - 1] = 0x40;
+    writeFileBytes(path, bad);
+    failed += ReadFails::check(path, "a BGZF block with a 1 GiB ISIZE");
+
+    BgzfBlock block;
+    block.isize = 1u << 30;
+    failed += !expect(!block.inflate() && block.udata.capacity() == 0, "inflate() allocates a block with a 1 GiB ISIZE");
+
+    /* l_seq of -1 in the first record */
+    TestRead negSeq[] = { TEST_READS[0] };
+    writeTestBam(path, negSeq, 1);
+    std::vector<uint8_t> data;
+    {
+        BamReader in(path);
+        BamRecord rec;
+        failed += !expect(in.next(rec), "Cannot read the record of arcs-test.bam");
+        data = rec.data;
+    }
+    for (int i = 16; i < 20; ++i)
+        data[i] = 0xff;
+    {
+        std::vector<std::string> refs(TEST_REFS, TEST_REFS + 2);
+        std::string text = "@HD\tVN:1.6\tSO:unsorted\n";
+        BgzfWriter out(path);
+        out.write("BAM\1", 4);
+        out.write32(text.size());
+        out.write(text.data(), text.size());
+        out.write32(0);
+        out.write32(data.size());
+        out.write(data.data(), data.size());
+    }
+    failed += ReadFails::check(path, "a record with a negative l_seq");
+
+    /* Header lengths of 4 GiB: l_text, n_ref and l_name must fail at the end of the file, not allocate */
+    for (int field = 0; field < 3; ++field) {
+        {
+            BgzfWriter out(path);
+            out.write("BAM\1", 4);
+            out.write32(field == 0 ? 0xffffffff : 0);
+            out.write32(field == 1 ? 0xffffffff : 1);
+            out.write32(field == 2 ? 0xffffffff : 5);
+            out.write("ctg1", 5);
+            out.write32(TEST_REF_LENGTH);
+        }
+        BamReader in(path);
+        failed += !expect(!in.good(), std::string("BamReader accepts a header with a 4 GiB ")
+            + (field == 0 ? "l_text" : field == 1 ? "n_ref" : "l_name"));
+    }
+
+    /* Index counts of 2^31 - 1, in an index of one reference with one bin of one chunk */
+    static const char* const indexPath = "arcs-test.bam.bai";
+    static const char* const countNames[] = { "n_ref", "n_bin", "n_chunk", "n_intv" };
+    for (int field = 0; field < 4; ++field) {
+        uint32_t counts[4] = { 1, 1, 1, 0 };
+        counts[field] = INT32_MAX;
+        std::vector<uint8_t> bai;
+        auto put32 = [&](uint32_t v) {
+            for (int i = 0; i < 4; ++i)
+                bai.push_back(uint8_t(v >> (8 * i)));
+        };
+        bai.insert(bai.end(), "BAI\1", "BAI\1" + 4);
+        put32(counts[0]);
+        put32(counts[1]);
+        put32(4681);
+        put32(counts[2]);
+        bai.resize(bai.size() + 16);
+        put32(counts[3]);
+        writeFileBytes(indexPath, bai);
+        BamIndex index;
+        failed += !expect(!index.load(path), std::string("BamIndex accepts an index with an ") + countNames[field] + " of 2^31 - 1");
+    }
+    remove(indexPath);
+
+    remove(path);
+    return failed;
+}
+
+/*
+ * An index written by saveIndex and read back by IndexFile must give
+ * the contig table, end counts and multiplicities that were saved.
+ */
+
+/* The end counts of imap, by barcode */
+std::map<ARCS::Barcode, std::vector<std::array<int, 3>>> endCounts(const ARCS::IndexMap& imap) {
+    std::map<ARCS::Barcode, std::vector<std::array<int, 3>>> counts;
+    for (size_t i = 0; i < imap.size(); ++i)
+        for (size_t j = 0; j < imap.ends[i].size(); ++j) {
+            const ARCS::EndCount& e = imap.ends[i][j];
+            std::array<int, 3> c = {{ int(e.contig), e.head, e.tail }};
+            counts[imap.barcodes[i]].push_back(c);
+        }
+    return counts;
+}
+
+int checkIndexFile() {
+    static const char* const path = "arcs-test.idx";
+    int failed = 0;
+
+    ARCS::ContigTable contigs;
+    contigs.add("ctg1", 1000);
+    contigs.add("scaffold_2", 2500);
+    contigs.add("", 700);
+    contigs.add("ctg4", 12345);
+
+    /* Barcodes with end counts and a multiplicity, with only a multiplicity and with only end counts */
+    ARCS::IndexMap imap;
+    ARCS::IndexMultMap indexMultMap;
+    countEnd(imap, 0x1b, 0, true);
+    countEnd(imap, 0x1b, 3, false);
+    countEnd(imap, 0x1b, 3, false);
+    countEnd(imap, 0x1b, 1, true);
+    indexMultMap[0x1b] = 7;
+    countEnd(imap, 0x6c, 2, false);
+    indexMultMap[0x6c] = 1;
+    indexMultMap[0x4] = 3;
+    countEnd(imap, 0x12345, 1, true);
+    countEnd(imap, 0x12345, 1, false);
+
+    ARCS::IndexFileHeader options = ARCS::IndexFileHeader();
+    options.seq_id = 97;
+    options.min_size = 400;
+    options.end_length = 30000;
+    failed += !expect(ARCS::saveIndex(path, imap, indexMultMap, contigs, options), "saveIndex fails");
+
+    size_t fileSize = readFileBytes(path).size();
+    {
+        ARCS::IndexFile index(path);
+        failed += !expect(index.good(), "IndexFile rejects the file written by saveIndex");
+        if (index.good()) {
+            const ARCS::IndexFileHeader& hdr = index.header();
+            failed += !expectEqual("seq_id", path, hdr.seq_id, options.seq_id);
+            failed += !expectEqual("min_size", path, hdr.min_size, options.min_size);
+            failed += !expectEqual("end_length", path, hdr.end_length, options.end_length);
+
+            ARCS::ContigTable loaded;
+            index.loadContigs(loaded);
+            failed += !expect(loaded.names == contigs.names && loaded.lengths == contigs.lengths,
+                "The contig table of the index differs from the one saved");
+
+            ARCS::IndexMap loadedMap;
+            ARCS::IndexMultMap loadedMult;
+            for (size_t i = 0; i < index.size(); ++i) {
+                if (i > 0 && index.barcode(i) <= index.barcode(i - 1))
+                    failed += !expect(false, "The barcodes of the index are not sorted");
+                if (index.multiplicity(i) != 0)
+                    loadedMult[index.barcode(i)] = index.multiplicity(i);
+                if (index.begin(i) != index.end(i))
+                    loadedMap[index.barcode(i)].assign(index.begin(i), index.end(i));
+            }
+            failed += !expectEqual("barcodes", path, index.size(), size_t(4));
+            failed += !expect(endCounts(loadedMap) == endCounts(imap), "The end counts of the index differ from those saved");
+            failed += !expect(std::map<ARCS::Barcode, int>(loadedMult.begin(), loadedMult.end())
+                    == std::map<ARCS::Barcode, int>(indexMultMap.begin(), indexMultMap.end()),
+                "The multiplicities of the index differ from those saved");
+        }
+    }
+
+    /* The last array is ends, which may be followed by padding */
+    const std::vector<uint8_t> data = readFileBytes(path);
+    size_t minSize = fileSize - ARCS::indexFilePadding(imap.nEnds * sizeof(ARCS::EndCount));
+    for (size_t n = 0; n < minSize; ++n) {
+        writeFileBytes(path, std::vector<uint8_t>(data.begin(), data.begin() + n));
+        ARCS::IndexFile index(path);
+        if (index.good()) {
+            std::cerr << "IndexFile accepts an index truncated to " << n << " of " << fileSize << " bytes\n";
+            ++failed;
+        }
+    }
+
+    /* Offsets that do not start at 0, decrease, or run past the names or the ends */
+    ARCS::IndexFileHeader hdr;
+    memcpy(&hdr, data.data(), sizeof hdr);
+    const uint64_t sections[] = {
+        sizeof hdr, hdr.nContigs * sizeof(int32_t), (hdr.nContigs + 1) * sizeof(uint64_t), hdr.namesSize,
+        hdr.nBarcodes * sizeof(uint64_t), hdr.nBarcodes * sizeof(int32_t), (hdr.nBarcodes + 1) * sizeof(uint64_t),
+    };
+    size_t starts[7], pos = 0;
+    for (size_t i = 0; i < 7; ++i) {
+        starts[i] = pos;
+        pos += sections[i];
+        pos += ARCS::indexFilePadding(pos);
+    }
+    const size_t nameOffsets = starts[2], endOffsets = starts[6];
+    const struct { size_t at; uint64_t value; const char* what; } corrupt[] = {
+        { nameOffsets, 1, "a first name offset other than 0" },
+        { nameOffsets + 8, hdr.namesSize + 1, "a name offset past the names" },
+        { nameOffsets + 16, 0, "decreasing name offsets" },
+        { endOffsets, 1, "a first end offset other than 0" },
+        { endOffsets + 8, hdr.nEnds + 1, "an end offset past the ends" },
+        { endOffsets + 24, 0, "decreasing end offsets" },
+    };
+    for (size_t i = 0; i < sizeof corrupt / sizeof *corrupt; ++i) {
+        std::vector<uint8_t> bad = data;
+        memcpy(&bad[corrupt[i].at], &corrupt[i].value, sizeof corrupt[i].value);
+        writeFileBytes(path, bad);
+        failed += !expect(!ARCS::IndexFile(path).good(), std::string("IndexFile accepts ") + corrupt[i].what);
+    }
+    writeFileBytes(path, data);
+    failed += !expect(ARCS::IndexFile(path).good(), "IndexFile rejects the index rewritten unchanged");
+
+    remove(path);
+    return failed;
+}
+
+/*
+ * pairContigs must count the same links whether the shards of barcodes
+ * are paired by one thread or by several, and the same links as the
+ * single-threaded pairing by contig name that it replaced.
+ */
+
+static const int PAIR_CONTIGS = 300;
+
+/*
+ * Fill imap and indexMultMap with the end counts of barcodes, each on
+ * up to 30 random contigs, and multiplicities of 0 to 199.
+ */
+void randomIndexMap(ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, int barcodes, unsigned seed) {
+    std::mt19937 rng(seed);
+    for (int b = 0; b < barcodes; ++b) {
+        ARCS::Barcode index = b + 1;
+        int nContigs = 1 + rng() % 30;
+        for (int i = 0; i < nContigs; ++i) {
+            uint32_t contig = rng() % PAIR_CONTIGS;
+            for (int n = rng() % 12; n > 0; --n)
+                countEnd(imap, index, contig, rng() % 4 != 0);
+            for (int n = rng() % 12; n > 0; --n)
+                countEnd(imap, index, contig, false);
+        }
+        if (rng() % 16 != 0)
+            indexMultMap[index] = rng() % 200;
+    }
+}
+
+/* Name of contig ID i; the names sort in another order than the IDs */
+std::string pairContigName(uint32_t i) {
+    std::ostringstream name;
+    name << "contig" << i * 7919 % PAIR_CONTIGS;
+    return name.str();
+}
+
+/* The former headOrTail: whether the reads point to one end, and whether it is the head */
+std::pair<bool, bool> namedHeadOrTail(int head, int tail) {
+    int max = std::max(head, tail);
+    int sum = head + tail;
+    if (sum < params.min_reads || 1 - normalEstimation(max, 0.5, sum) >= params.error_percent)
+        return std::pair<bool, bool>(false, false);
+    return std::pair<bool, bool>(true, max == head);
+}
+
+/*
+ * The former pairContigs: each barcode within the multiplicity bounds
+ * links every two contigs, ordered by name, whose read counts point to
+ * one end. The counts are HH, HT, TH and TT of the first and second name.
+ */
+std::map<std::pair<std::string, std::string>, ARCS::PairCounts> namedPairContigs(
+        const ARCS::IndexMap& imap, const ARCS::IndexMultMap& indexMultMap) {
+    std::map<std::pair<std::string, std::string>, ARCS::PairCounts> pmap;
+    for (size_t b = 0; b < imap.size(); ++b) {
+        ARCS::IndexMultMap::const_iterator m = indexMultMap.find(imap.barcodes[b]);
+        int indexMult = m == indexMultMap.end() ? 0 : m->second;
+        if (indexMult < params.min_mult || indexMult > params.max_mult)
+            continue;
+        std::map<std::string, std::pair<int, int>> scafMap;
+        for (size_t i = 0; i < imap.ends[b].size(); ++i) {
+            const ARCS::EndCount& e = imap.ends[b][i];
+            scafMap[pairContigName(e.contig)] = std::make_pair(e.head, e.tail);
+        }
+        for (auto o = scafMap.begin(); o != scafMap.end(); ++o) {
+            for (auto p = scafMap.begin(); p != scafMap.end(); ++p) {
+                if (!(o->first < p->first))
+                    continue;
+                bool validA, validB, scafAhead, scafBhead;
+                std::tie(validA, scafAhead) = namedHeadOrTail(o->second.first, o->second.second);
+                std::tie(validB, scafBhead) = namedHeadOrTail(p->second.first, p->second.second);
+                if (validA && validB) {
+                    std::pair<std::string, std::string> pair(o->first, p->first);
+                    if (pmap.count(pair) == 0)
+                        pmap[pair].fill(0);
+                    pmap[pair][(!scafAhead << 1) | !scafBhead]++;
+                }
+            }
+        }
+    }
+    return pmap;
+}
+
+/* The link counts of pmap, by key */
+std::map<uint64_t, ARCS::PairCounts> pairCounts(const ARCS::PairMap& pmap) {
+    return std::map<uint64_t, ARCS::PairCounts>(pmap.begin(), pmap.end());
+}
+
+int checkPairContigs() {
+    const ARCS::ArcsParams saved = params;
+    params.min_mult = 20;
+    params.max_mult = 150;
+    params.min_reads = 3;
+    SignificanceTable sig(params.error_percent, params.binomial);
+
+    ARCS::IndexMap imap;
+    ARCS::IndexMultMap indexMultMap;
+    randomIndexMap(imap, indexMultMap, 8 * PAIR_SHARD_SIZE, 11);
+    IndexMapBarcodes barcodes(imap, indexMultMap);
+
+    ARCS::PairMap one;
+    params.threads = 1;
+    pairContigs(barcodes, one, sig);
+    std::map<uint64_t, ARCS::PairCounts> want = pairCounts(one);
+
+    int failed = !expect(want.size() > 1000, "The pairing test has too few pairs of contigs to compare");
+    static const int threads[] = { 2, 4, 7 };
+    for (size_t t = 0; t < sizeof threads / sizeof *threads; ++t) {
+        ARCS::PairMap many;
+        params.threads = threads[t];
+        pairContigs(barcodes, many, sig);
+        std::map<uint64_t, ARCS::PairCounts> got = pairCounts(many);
+        std::ostringstream where;
+        where << "pairContigs with " << threads[t] << " threads";
+        failed += !expectEqual("pairs of contigs", where.str(), got.size(), want.size());
+        size_t differ = 0;
+        for (std::map<uint64_t, ARCS::PairCounts>::const_iterator it = want.begin(); it != want.end(); ++it) {
+            std::map<uint64_t, ARCS::PairCounts>::const_iterator p = got.find(it->first);
+            differ += p == got.end() || p->second != it->second;
+        }
+        failed += !expectEqual("pairs of contigs with other counts than on 1 thread", where.str(), differ, size_t(0));
+    }
+
+    /* By name, HT of the lower ID is TH of the lower name */
+    std::map<std::pair<std::string, std::string>, ARCS::PairCounts> named = namedPairContigs(imap, indexMultMap);
+    failed += !expectEqual("pairs of contigs", "pairContigs by contig name", want.size(), named.size());
+    size_t differ = 0;
+    for (std::map<uint64_t, ARCS::PairCounts>::const_iterator it = want.begin(); it != want.end(); ++it) {
+        std::string a = pairContigName(ARCS::PairMap::first(it->first));
+        std::string b = pairContigName(ARCS::PairMap::second(it->first));
+        ARCS::PairCounts counts = it->second;
+        if (b < a) {
+            std::swap(a, b);
+            std::swap(counts[1], counts[2]);
+        }
+        std::map<std::pair<std::string, std::string>, ARCS::PairCounts>::const_iterator p
+            = named.find(std::make_pair(a, b));
+        differ += p == named.end() || p->second != counts;
+    }
+    failed += !expectEqual("pairs of contigs with other counts than by contig name", "pairContigs", differ, size_t(0));
+    params = saved;
+    return failed;
+}
+
+/* The edges of g, by the contig IDs they join: orientation and weight */
+std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>> graphEdges(const ARCS::CompactGraph& g) {
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>> edges;
+    for (size_t e = 0; e < g.edges.size(); ++e) {
+        const ARCS::CompactGraph::Edge& edge = g.edges[e];
+        edges[std::make_pair(g.ids[edge.u], g.ids[edge.v])] = std::make_pair(edge.prop.orientation, edge.prop.weight);
+    }
+    return edges;
+}
+
+/*
+ * Each graph of sweep mode must be the graph of a separate run with
+ * its -m, -r, -c and -l values.
+ */
+int checkSweepPairContigs() {
+    const ARCS::ArcsParams saved = params;
+    ARCS::IndexMap imap;
+    ARCS::IndexMultMap indexMultMap;
+    randomIndexMap(imap, indexMultMap, 2 * PAIR_SHARD_SIZE, 13);
+    IndexMapBarcodes barcodes(imap, indexMultMap);
+
+    std::vector<std::pair<int, int>> ms;
+    ms.push_back(std::make_pair(20, 150));
+    ms.push_back(std::make_pair(0, 80));
+    ms.push_back(std::make_pair(100, 199));
+    static const float rs[] = { 0.05f, 0.01f, 0.2f };
+    std::vector<SignificanceTable> sigs;
+    for (size_t r = 0; r < 3; ++r)
+        sigs.push_back(SignificanceTable(rs[r], params.binomial));
+    static const int cArray[] = { 5, 1, 3, 8 };
+    std::vector<int> cs(cArray, cArray + 4);
+    static const int ls[] = { 0, 4 };
+
+    params.threads = 3;
+    std::vector<ARCS::PairMap> pmaps(ms.size() * sigs.size() * cs.size());
+    sweepPairContigs(barcodes, pmaps, ms, sigs, cs);
+
+    int failed = 0;
+    for (size_t m = 0; m < ms.size(); ++m) {
+        for (size_t r = 0; r < sigs.size(); ++r) {
+            for (size_t c = 0; c < cs.size(); ++c) {
+                params.min_mult = ms[m].first;
+                params.max_mult = ms[m].second;
+                params.error_percent = rs[r];
+                params.min_reads = cs[c];
+                ARCS::PairMap pmap;
+                pairContigs(barcodes, pmap, sigs[r]);
+
+                const ARCS::PairMap& swept = pmaps[(m * sigs.size() + r) * cs.size() + c];
+                std::ostringstream where;
+                where << "sweep -m " << ms[m].first << "-" << ms[m].second << " -r " << rs[r] << " -c " << cs[c];
+                failed += !expect(pmap.size() > 100, where.str() + ": too few pairs of contigs to compare");
+                failed += !expect(pairCounts(swept) == pairCounts(pmap),
+                        where.str() + " counts other links than pairContigs");
+                for (size_t l = 0; l < 2; ++l) {
+                    ARCS::CompactGraph want, got;
+                    createGraph(pmap, PAIR_CONTIGS, want, ls[l], sigs[r]);
+                    createGraph(swept, PAIR_CONTIGS, got, ls[l], sigs[r]);
+                    std::ostringstream what;
+                    what << where.str() << " -l " << ls[l] << " creates another graph than a separate run";
+                    failed += !expect(got.ids == want.ids && graphEdges(got) == graphEdges(want), what.str());
+                }
+            }
+        }
+    }
+    params = saved;
+    return failed;
+}
+
+/*
+ * With --mem-limit, the barcode and link counts spilled to disk in
+ * many runs must give the same graph as counting them in memory.
+ */
+
+static const int SPILL_CONTIGS = 40;
+static const int SPILL_CONTIG_LENGTH = 4000;
+
+/* Contig i of the spill test */
+std::string spillContig(int i) {
+    std::ostringstream name;
+    name << "c" << i;
+    return name.str();
+}
+
+/*
+ * Write a SAM file of linked reads, each barcode from a molecule that
+ * spans the end of one contig and the head or tail of the next. The
+ * pairs are shuffled so that the reads of a barcode are far apart.
+ */
+void writeSpillSam(const std::string& path) {
+    std::mt19937 rng(7);
+    std::vector<std::string> pairs;
+    std::string seq(100, 'A');
+    for (int b = 0; b < 600; ++b) {
+        std::string barcode(16, 'A');
+        for (int j = 0, x = b; j < 16; ++j, x >>= 2)
+            barcode[j] = "ACGT"[x & 3];
+        int contig = rng() % (SPILL_CONTIGS - 1);
+        /* Ends of the pair: the tail of contig, the head or tail of contig + 1, sometimes a third contig */
+        int ends[3][2] = { { contig, 1 }, { contig + 1, int(rng() % 2) }, { int(rng() % SPILL_CONTIGS), int(rng() % 2) } };
+        int nEnds = rng() % 4 == 0 ? 3 : 2;
+        for (int e = 0; e < nEnds; ++e) {
+            int nPairs = 2 + rng() % 12;
+            for (int p = 0; p < nPairs; ++p) {
+                int pos = ends[e][1] ? SPILL_CONTIG_LENGTH - 900 + rng() % 500 : 1 + rng() % 500;
+                std::ostringstream name, pair;
+                name << "r" << b << "." << e << "." << p << "_" << barcode;
+                pair << name.str() << "\t99\t" << spillContig(ends[e][0]) << "\t" << pos << "\t60\t100M\t=\t" << pos + 250
+                    << "\t350\t" << seq << "\t*\tNM:i:0\n"
+                    << name.str() << "\t147\t" << spillContig(ends[e][0]) << "\t" << pos + 250 << "\t60\t100M\t=\t" << pos
+                    << "\t-350\t" << seq << "\t*\tNM:i:1\n";
+                pairs.push_back(pair.str());
+            }
+        }
+    }
+    std::shuffle(pairs.begin(), pairs.end(), rng);
+    std::ofstream out(path.c_str());
+    for (size_t i = 0; i < pairs.size(); ++i)
+        out << pairs[i];
+}
+
+int checkSpilledGraph() {
+    static const char* const path = "arcs-test.sam";
+    writeSpillSam(path);
+    int failed = 0;
+
+    ARCS::ContigTable contigs;
+    for (int i = 0; i < SPILL_CONTIGS; ++i)
+        contigs.add(spillContig(i), SPILL_CONTIG_LENGTH);
+
+    const ARCS::ArcsParams saved = params;
+    params.base_name = "arcs-test";
+    params.min_mult = 20;
+    params.max_mult = 1000;
+    params.min_reads = 4;
+    SignificanceTable sig(params.error_percent, params.binomial);
+
+    /* In memory */
+    ARCS::CompactGraph inMemory;
+    {
+        ARCS::IndexMap imap;
+        ARCS::IndexMultMap indexMultMap;
+        readBAM(path, imap, indexMultMap, contigs);
+        IndexMapBarcodes barcodes(imap, indexMultMap);
+        PairTables tables(1);
+        pairBatches(barcodes, tables, PairBatch(tables.pmaps[0], sig));
+        createGraph(tables, 0, contigs.size(), inMemory, params.min_links, sig);
+    }
+
+    /* Spilled, with limits that split the barcode and the link counts into many runs */
+    ARCS::CompactGraph spilled;
+    {
+        params.mem_limit = 2048;
+        indexMapLimit = 16384;
+        ARCS::IndexMap imap;
+        ARCS::IndexMultMap indexMultMap;
+        readBAM(path, imap, indexMultMap, contigs);
+        spillIndexMaps(imap, indexMultMap);
+        failed += !expect(barcodeRuns.size() > 2, "The barcode counts were not spilled to several runs");
+        MergedBarcodes barcodes(barcodeRuns);
+        PairTables tables(1);
+        pairBatches(barcodes, tables, PairBatch(tables.pmaps[0], sig));
+        failed += !expect(tables.runs[0].size() > 2, "The link counts were not spilled to several runs");
+        createGraph(tables, 0, contigs.size(), spilled, params.min_links, sig);
+        indexMapLimit = 0;
+    }
+    params = saved;
+
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>> want = graphEdges(inMemory), got = graphEdges(spilled);
+    failed += !expect(want.size() > 10, "The spill test graph has too few edges to compare");
+    failed += !expectEqual("edges", "graph spilled with --mem-limit", got.size(), want.size());
+    for (std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>>::const_iterator it = want.begin(); it != want.end(); ++it) {
+        std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>>::const_iterator e = got.find(it->first);
+        if (e == got.end() || e->second != it->second) {
+            std::cerr << "Edge " << it->first.first << "-" << it->first.second << " differs in the graph spilled with --mem-limit\n";
+            ++failed;
+        }
+    }
+
+    remove(path);
+    return failed;
+}
+
+/*
+ * removeDegreeNodes masks the vertices of the CompactGraph; the boost
+ * graph copied from it must have the vertices and edges left by
+ * clear_vertex and remove_vertex on the boost graph of the whole graph.
+ */
+
+/* The removeDegreeNodes of the boost graph that the mask replaced */
+void boostRemoveDegreeNodes(ARCS::Graph& g, int max_degree) {
+    boost::graph_traits<ARCS::Graph>::vertex_iterator vi, vi_end;
+    std::vector<ARCS::VertexDes> dVertex;
+    for (boost::tie(vi, vi_end) = boost::vertices(g); vi != vi_end; ++vi) {
+        if (static_cast<int>(boost::degree(*vi, g)) > max_degree)
+            dVertex.push_back(*vi);
+    }
+    for (size_t i = 0; i < dVertex.size(); ++i) {
+        boost::clear_vertex(dVertex[i], g);
+        boost::remove_vertex(dVertex[i], g);
+    }
+    boost::renumber_indices(g);
+}
+
+/* The contig IDs of the vertices of g, in order */
+std::vector<uint32_t> boostVertexIds(const ARCS::Graph& g) {
+    std::vector<uint32_t> ids;
+    boost::graph_traits<ARCS::Graph>::vertex_iterator vi, vi_end;
+    for (boost::tie(vi, vi_end) = boost::vertices(g); vi != vi_end; ++vi)
+        ids.push_back(g[*vi].id);
+    return ids;
+}
+
+/* The edges of g, by the contig IDs they join: orientation and weight */
+std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>> boostGraphEdges(const ARCS::Graph& g) {
+    std::map<std::pair<uint32_t, uint32_t>, std::pair<int, int>> edges;
+    boost::graph_traits<ARCS::Graph>::edge_iterator ei, ei_end;
+    for (boost::tie(ei, ei_end) = boost::edges(g); ei != ei_end; ++ei) {
+        uint32_t a = g[boost::source(*ei, g)].id, b = g[boost::target(*ei, g)].id;
+        edges[std::make_pair(std::min(a, b), std::max(a, b))] = std::make_pair(g[*ei].orientation, g[*ei].weight);
+    }
+    return edges;
+}
+
+/* A PairMap of random links between nContigs contigs, most with a dominant orientation */
+void randomPairMap(ARCS::PairMap& pmap, uint32_t nContigs, size_t nPairs, unsigned seed) {
+    std::mt19937 rng(seed);
+    for (size_t i = 0; i < nPairs; ++i) {
+        uint32_t a = rng() % nContigs, b = rng() % nContigs;
+        if (a == b)
+            continue;
+        ARCS::PairCounts& counts = pmap[ARCS::PairMap::key(std::min(a, b), std::max(a, b))];
+        counts[rng() % 4] += 1 + rng() % 20;
+    }
+}
+
+int checkRemoveDegreeNodes() {
+    static const uint32_t nContigs = 400;
+    ARCS::PairMap pmap;
+    randomPairMap(pmap, nContigs, 1200, 5);
+    SignificanceTable sig(params.error_percent, params.binomial);
+
+    int failed = 0;
+    static const int degrees[] = { 0, 1, 3, 5, 8, 1000 };
+    for (size_t d = 0; d < sizeof degrees / sizeof *degrees; ++d) {
+        ARCS::CompactGraph g;
+        createGraph(pmap, nContigs, g, 0, sig);
+        ARCS::Graph want;
+        toBoostGraph(g, want);
+        if (d == 0)
+            failed += !expect(boost::num_edges(want) > 500, "The degree test graph has too few edges");
+        boostRemoveDegreeNodes(want, degrees[d]);
+
+        removeDegreeNodes(g, degrees[d]);
+        ARCS::Graph got;
+        toBoostGraph(g, got);
+
+        std::ostringstream where;
+        where << "removeDegreeNodes(" << degrees[d] << ")";
+        failed += !expectEqual("vertices", where.str(), boost::num_vertices(got), boost::num_vertices(want));
+        failed += !expect(boostVertexIds(got) == boostVertexIds(want),
+                where.str() + " leaves other vertices than clear_vertex and remove_vertex");
+        failed += !expectEqual("edges", where.str(), boost::num_edges(got), boost::num_edges(want));
+        failed += !expect(boostGraphEdges(got) == boostGraphEdges(want),
+                where.str() + " leaves other edges than clear_vertex and remove_vertex");
+    }
+    return failed;
+}
+
+/*
+ * writeGraph must write the file boost::write_graphviz_dp writes of the
+ * same graph with the properties of the former writeGraph, with and
+ * without the vertices of -d removed.
+ */
+
+/* The former writeGraph: the boost graph g, its vertices named by contig */
+void boostWriteGraph(const std::string& path, ARCS::Graph& g, const ARCS::ContigTable& contigs) {
+    std::map<ARCS::VertexDes, std::string> names;
+    boost::graph_traits<ARCS::Graph>::vertex_iterator vi, vi_end;
+    for (boost::tie(vi, vi_end) = boost::vertices(g); vi != vi_end; ++vi)
+        names[*vi] = contigs.names[g[*vi].id];
+
+    std::ofstream out(path.c_str());
+    boost::dynamic_properties dp;
+    dp.property("id", boost::make_assoc_property_map(names));
+    dp.property("weight", get(&ARCS::EdgeProperties::weight, g));
+    dp.property("label", get(&ARCS::EdgeProperties::orientation, g));
+    dp.property("node_id", get(boost::vertex_index, g));
+    boost::write_graphviz_dp(out, g, dp);
+}
+
+int checkWriteGraph() {
+    static const uint32_t nContigs = 120;
+    static const char* const prefixes[] = { "", "contig-", "ctg_", "tig\"", "\351", "." };
+    ARCS::ContigTable contigs;
+    for (uint32_t i = 0; i < nContigs; ++i) {
+        std::ostringstream name;
+        name << prefixes[i % (sizeof prefixes / sizeof *prefixes)] << i;
+        contigs.add(name.str(), 1000);
+    }
+    ARCS::PairMap pmap;
+    randomPairMap(pmap, nContigs, 300, 7);
+    SignificanceTable sig(params.error_percent, params.binomial);
+
+    static const char* const gotPath = "arcs-test.gv";
+    static const char* const wantPath = "arcs-test.boost.gv";
+    int failed = 0;
+    static const int degrees[] = { 0, 4, 6 };
+    for (size_t d = 0; d < sizeof degrees / sizeof *degrees; ++d) {
+        ARCS::CompactGraph g;
+        createGraph(pmap, nContigs, g, 0, sig);
+        ARCS::Graph bg;
+        toBoostGraph(g, bg);
+        if (degrees[d] > 0) {
+            removeDegreeNodes(g, degrees[d]);
+            boostRemoveDegreeNodes(bg, degrees[d]);
+        }
+        writeGraph(gotPath, g, contigs);
+        boostWriteGraph(wantPath, bg, contigs);
+
+        std::vector<uint8_t> got = readFileBytes(gotPath), want = readFileBytes(wantPath);
+        std::ostringstream where;
+        where << "writeGraph with -d " << degrees[d];
+        failed += !expect(boost::num_edges(bg) > 20, where.str() + ": the graph has too few edges");
+        failed += !expect(got == want, where.str() + " writes another file than boost::write_graphviz_dp");
+    }
+    remove(gotPath);
+    remove(wantPath);
+    return failed;
+}
+
+/*
+ * SignificanceTable::passes must agree with the direct test it
+ * tabulates: the normal approximation of the baseline, or the exact
+ * binomial tail with --binomial. checkSignificance tests x above n.
+ */
+int checkSignificanceTable() {
+    static const float levels[] = { 0.05f, 0.01f, 0.2f, 0.001f };
+    int failed = 0;
+    for (size_t l = 0; l < sizeof levels / sizeof *levels; ++l) {
+        float p = levels[l];
+        SignificanceTable normal(p, false), exact(p, true);
+        for (int n = 0; n <= 2000; ++n) {
+            for (int x = 0; x <= 2 * n + 10; ++x) {
+                bool want = 1 - normalEstimation(x, 0.5, n) < p;
+                if (normal.passes(x, n) != want) {
+                    std::cerr << "SignificanceTable(" << p << ").passes(" << x << ", " << n << ") is "
+                        << !want << ", normalEstimation gives " << want << "\n";
+                    ++failed;
+                }
+                if (n > 300)
+                    continue;
+                want = binomialTail(x, n) < p;
+                if (exact.passes(x, n) != want) {
+                    std::cerr << "SignificanceTable(" << p << ", --binomial).passes(" << x << ", " << n << ") is "
+                        << !want << ", binomialTail gives " << want << "\n";
+                    ++failed;
+                }
+            }
+        }
+    }
+    return failed;
+}
+
+/*
+ * The mate buffer pairs the reads of coordinate-sorted and unsorted
+ * files. A read whose mate is more than --mate-window bp on, or on
+ * another contig, is dropped as unpaired, as are the oldest reads once
+ * more than --mate-buffer are waiting.
+ */
+
+/* One alignment of the mate buffer test */
+struct TestMate {
+    const char* name;
+    int flag;
+    uint32_t contig;
+    int pos;
+    int mapq;
+    int si;
+    bool hasSeq;
+};
+
+/* Run metrics expected from a stream of TestMates */
+struct MateCounts {
+    uint64_t pairs, endPairs, unpaired, rejectedFlag, rejectedMapq, rejectedIdentity;
+};
+
+/*
+ * Add the reads of a file of sort order so through addAlignment, and
+ * compare the run metrics they add with want. The end counts go to imap.
+ */
+int checkMates(const std::string& what, const std::string& so, const TestMate* reads, size_t n, const MateCounts& want,
+        ARCS::IndexMap& imap) {
+    ARCS::ContigTable contigs;
+    contigs.add("c0", 10000);
+    contigs.add("c1", 10000);
+    ARCS::IndexMultMap indexMultMap;
+
+    static const char* const counters[] = { "records", "pairs_accepted", "pairs_in_contig_ends", "reads_unpaired",
+        "reads_rejected_flag", "reads_rejected_mapq", "reads_rejected_identity" };
+    static const size_t nCounters = sizeof counters / sizeof *counters;
+    uint64_t before[nCounters];
+    for (size_t i = 0; i < nCounters; ++i)
+        before[i] = metrics.counter(counters[i]);
+
+    ReadPairState st;
+    st.setSortOrder(so);
+    int failed = !expect(st.useMateBuffer, what + ": the mate buffer is not used");
+    ARCS::ReadAlignment aln;
+    for (size_t i = 0; i < n; ++i) {
+        aln.readName = reads[i].name;
+        aln.flag = reads[i].flag;
+        aln.contig = reads[i].contig;
+        aln.pos = reads[i].pos;
+        aln.mapq = reads[i].mapq;
+        aln.si = reads[i].si;
+        aln.hasSeq = reads[i].hasSeq;
+        addAlignment(st, aln, imap, indexMultMap, contigs);
+    }
+    warnSkipped(st);
+
+    const uint64_t wants[nCounters] = { n, want.pairs, want.endPairs, want.unpaired,
+        want.rejectedFlag, want.rejectedMapq, want.rejectedIdentity };
+    for (size_t i = 0; i < nCounters; ++i)
+        failed += !expectEqual(counters[i], what, metrics.counter(counters[i]) - before[i], wants[i]);
+    return failed;
+}
+
+/* The end counts of barcode in imap, as (contig, head, tail) */
+std::vector<std::array<int, 3>> barcodeEnds(const ARCS::IndexMap& imap, const char* barcode) {
+    std::map<ARCS::Barcode, std::vector<std::array<int, 3>>> counts = endCounts(imap);
+    return counts[encodeBarcode(barcode, strlen(barcode))];
+}
+
+int checkMateBuffer() {
+    const uint32_t NO = ARCS::ContigTable::NO_CONTIG;
+    /* A coordinate-sorted file, with --mate-window 1000 */
+    static const TestMate sorted[] = {
+        { "a_AAAA", 99, 0, 100, 60, 100, true },
+        { "b_AAAA", 99, 0, 200, 60, 100, true },
+        /* Its mate is missing */
+        { "u_AAAA", 163, 0, 250, 60, 100, true },
+        /* The mate of a low mapq read waits in vain */
+        { "q_CCCC", 99, 0, 300, 0, 100, true },
+        { "a_AAAA", 147, 0, 400, 60, 100, true },
+        /* A read whose mate is unmapped, and its mate */
+        { "m_CCCC", 73, 0, 450, 60, 100, true },
+        { "m_CCCC", 133, 0, 450, 0, 0, true },
+        { "q_CCCC", 147, 0, 500, 60, 100, true },
+        /* 1300 bp from its mate: b, u and then this read are unpaired */
+        { "b_AAAA", 147, 0, 1500, 60, 100, true },
+        { "c_GGGG", 99, 0, 9000, 60, 100, true },
+        { "c_GGGG", 147, 0, 9300, 60, 100, true },
+        /* Mates on two contigs */
+        { "d_TTTT", 99, 0, 9500, 60, 100, true },
+        { "d_TTTT", 147, 1, 100, 60, 100, true },
+        /* A pair without a barcode is not held */
+        { "e", 99, 1, 200, 60, 100, true },
+        { "e", 147, 1, 300, 60, 100, true },
+        /* Low identity, then its mate waits in vain */
+        { "f_ACGT", 99, 1, 400, 60, 90, true },
+        { "f_ACGT", 147, 1, 600, 60, 100, true },
+        /* No sequence */
+        { "g_ACGT", 99, 1, 700, 60, 100, false },
+        /* Unmapped, at the end of the file */
+        { "h_ACGT", 4, NO, 0, 0, 0, true },
+    };
+    /* Unpaired: b, u, q and b by the window, d by the change of contig, and d and f left at the end */
+    const MateCounts sortedWant = { 2, 2, 7, 4, 1, 1 };
+
+    /* An unsorted file with --mate-buffer 2: x is evicted by z */
+    static const TestMate unsorted[] = {
+        { "x_AAAA", 99, 0, 9000, 60, 100, true },
+        { "y_AAAA", 99, 1, 100, 60, 100, true },
+        { "z_AAAA", 99, 0, 300, 60, 100, true },
+        { "z_AAAA", 147, 0, 500, 60, 100, true },
+        { "y_AAAA", 147, 1, 300, 60, 100, true },
+        { "x_AAAA", 147, 0, 9200, 60, 100, true },
+    };
+    /* x is evicted, and then its mate waits in vain */
+    const MateCounts unsortedWant = { 2, 2, 2, 0, 0, 0 };
+
+    const ARCS::ArcsParams saved = params;
+    params.mate_window = 1000;
+    int failed = 0;
+    {
+        ARCS::IndexMap imap;
+        failed += checkMates("coordinate-sorted reads", "coordinate", sorted, sizeof sorted / sizeof *sorted, sortedWant, imap);
+        std::vector<std::array<int, 3>> a(1), c(1);
+        a[0][0] = 0, a[0][1] = 1, a[0][2] = 0;
+        c[0][0] = 0, c[0][1] = 0, c[0][2] = 1;
+        failed += !expect(barcodeEnds(imap, "AAAA") == a, "coordinate-sorted reads: pair a is not at the head of c0");
+        failed += !expect(barcodeEnds(imap, "GGGG") == c, "coordinate-sorted reads: pair c is not at the tail of c0");
+        failed += !expectEqual("barcodes with end counts", "coordinate-sorted reads", imap.size(), size_t(2));
+    }
+    params.mate_buffer = 2;
+    {
+        ARCS::IndexMap imap;
+        failed += checkMates("unsorted reads", "unsorted", unsorted, sizeof unsorted / sizeof *unsorted, unsortedWant, imap);
+        std::vector<std::array<int, 3>> ends(2);
+        ends[0][0] = 0, ends[0][1] = 1, ends[0][2] = 0;
+        ends[1][0] = 1, ends[1][1] = 1, ends[1][2] = 0;
+        failed += !expect(barcodeEnds(imap, "AAAA") == ends, "unsorted reads: pairs y and z are not at the heads of c1 and c0");
+    }
+    params = saved;
+    return failed;
+}
+
+/*
+ * With --ends-only, readBAM must find the contig ends of a
+ * coordinate-sorted BAM file through its BAI index, and add the same
+ * alignments that start in those ends as reading the whole file, so
+ * that the end counts are the same.
+ */
+
+/* One alignment of the indexed BAM file and its virtual offsets, [beg, end) */
+struct IndexedRead {
+    std::string sam;
+    int tid;
+    int pos; // 0-based
+    std::string barcode;
+    uint64_t beg, end;
+    bool operator<(const IndexedRead& o) const {
+        return static_cast<uint32_t>(tid) < static_cast<uint32_t>(o.tid) || (tid == o.tid && pos < o.pos);
+    }
+};
+
+static const char* const INDEXED_REFS[] = { "big", "small", "tiny", "other", "big2" };
+static const int INDEXED_REF_LENGTHS[] = { 60000, 3000, 400, 20000, 40000 };
+static const int INDEXED_PAIRS[] = { 1200, 100, 20, 300, 800 };
+static const int N_INDEXED_REFS = 5;
+static const int INDEXED_READ_LENGTH = 50;
+
+/* The bin of the alignments in [beg, end), 0-based, as in the SAM specification */
+uint32_t reg2bin(int beg, int end) {
+    --end;
+    if (beg >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + (beg >> 14);
+    if (beg >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + (beg >> 17);
+    if (beg >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + (beg >> 20);
+    if (beg >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + (beg >> 23);
+    if (beg >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + (beg >> 26);
+    return 0;
+}
+
+/*
+ * Write a coordinate-sorted BAM file of random read pairs on the
+ * INDEXED_REFS, followed by unmapped reads, filling reads with its
+ * alignments in file order.
+ */
+void writeIndexedBam(const std::string& path, std::vector<IndexedRead>& reads, unsigned seed) {
+    static const char* const barcodes[] = { "AACC", "GGTT", "ACGT", "CATG", "TTTT", "GACA" };
+    std::mt19937 rng(seed);
+    for (int tid = 0; tid < N_INDEXED_REFS; ++tid) {
+        for (int i = 0; i < INDEXED_PAIRS[tid]; ++i) {
+            int distance = rng() % std::min(600, INDEXED_REF_LENGTHS[tid] / 2);
+            int pos = rng() % (INDEXED_REF_LENGTHS[tid] - distance - INDEXED_READ_LENGTH);
+            int matePos = pos + distance;
+            std::ostringstream name;
+            name << "p" << tid << "." << i << "_" << barcodes[rng() % 6];
+            for (int r = 0; r < 2; ++r) {
+                IndexedRead read;
+                std::ostringstream sam;
+                int p = r == 0 ? pos : matePos, mate = r == 0 ? matePos : pos;
+                sam << name.str() << "\t" << (r == 0 ? 99 : 147) << "\t" << INDEXED_REFS[tid] << "\t" << p + 1
+                    << "\t60\t50M\t=\t" << mate + 1 << "\t" << (mate - p) << "\t" SEQ50 "\t*\tNM:i:0";
+                read.sam = sam.str();
+                read.tid = tid;
+                read.pos = p;
+                read.barcode = name.str().substr(name.str().find('_') + 1);
+                reads.push_back(read);
+            }
+        }
+    }
+    for (int i = 0; i < 10; ++i) {
+        IndexedRead read;
+        read.sam = "u" + std::string(1, char('0' + i)) + "_AACC\t4\t*\t0\t0\t*\t*\t0\t0\t" SEQ50 "\t*";
+        read.tid = -1;
+        read.pos = -1;
+        read.barcode = "AACC";
+        reads.push_back(read);
+    }
+    std::stable_sort(reads.begin(), reads.end());
+
+    std::vector<std::string> refs(INDEXED_REFS, INDEXED_REFS + N_INDEXED_REFS);
+    std::string text = "@HD\tVN:1.6\tSO:coordinate\n";
+    BgzfWriter out(path);
+    out.write("BAM\1", 4);
+    out.write32(text.size());
+    out.write(text.data(), text.size());
+    out.write32(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i) {
+        out.write32(refs[i].size() + 1);
+        out.write(refs[i].c_str(), refs[i].size() + 1);
+        out.write32(INDEXED_REF_LENGTHS[i]);
+    }
+    out.endBlock();
+    BamRecordEncoder encoder;
+    for (size_t i = 0; i < reads.size(); ++i) {
+        TestRead read = { reads[i].sam.c_str(), 'C' };
+        const std::vector<uint8_t>& rec = encoder.encode(read, refs);
+        reads[i].beg = out.tell();
+        out.write32(rec.size());
+        out.write(rec.data(), rec.size());
+        reads[i].end = out.tell();
+    }
+    out.close();
+}
+
+/*
+ * Write the BAI index of the alignments reads to path: the chunks of
+ * each bin, merged where they touch, the pseudo-bin of statistics and
+ * the linear index of the first alignment overlapping each 16 kbp window.
+ */
+void writeBai(const std::string& path, const std::vector<IndexedRead>& reads) {
+    std::vector<std::map<uint32_t, std::vector<BamIndex::Chunk>>> bins(N_INDEXED_REFS);
+    std::vector<std::vector<uint64_t>> linear(N_INDEXED_REFS);
+    static const uint64_t NONE = ~uint64_t(0);
+    for (size_t i = 0; i < reads.size(); ++i) {
+        const IndexedRead& r = reads[i];
+        if (r.tid < 0)
+            continue;
+        int end = r.pos + INDEXED_READ_LENGTH;
+        std::vector<BamIndex::Chunk>& chunks = bins[r.tid][reg2bin(r.pos, end)];
+        if (!chunks.empty() && chunks.back().end == r.beg) {
+            chunks.back().end = r.end;
+        } else {
+            BamIndex::Chunk chunk = { r.beg, r.end };
+            chunks.push_back(chunk);
+        }
+        std::vector<uint64_t>& lin = linear[r.tid];
+        for (int w = r.pos >> 14; w <= (end - 1) >> 14; ++w) {
+            if (lin.size() <= size_t(w))
+                lin.resize(w + 1, NONE);
+            if (lin[w] == NONE)
+                lin[w] = r.beg;
+        }
+    }
+
+    std::vector<uint8_t> data;
+    auto put32 = [&](uint32_t v) {
+        for (int i = 0; i < 4; ++i)
+            data.push_back(uint8_t(v >> (8 * i)));
+    };
+    auto put64 = [&](uint64_t v) {
+        put32(static_cast<uint32_t>(v));
+        put32(static_cast<uint32_t>(v >> 32));
+    };
+    data.insert(data.end(), "BAI\1", "BAI\1" + 4);
+    put32(N_INDEXED_REFS);
+    for (int tid = 0; tid < N_INDEXED_REFS; ++tid) {
+        put32(bins[tid].size() + !bins[tid].empty());
+        uint64_t first = NONE, last = 0, n = 0;
+        for (std::map<uint32_t, std::vector<BamIndex::Chunk>>::const_iterator b = bins[tid].begin(); b != bins[tid].end(); ++b) {
+            put32(b->first);
+            put32(b->second.size());
+            for (size_t c = 0; c < b->second.size(); ++c) {
+                put64(b->second[c].beg);
+                put64(b->second[c].end);
+                first = std::min(first, b->second[c].beg);
+                last = std::max(last, b->second[c].end);
+            }
+        }
+        if (!bins[tid].empty()) {
+            for (size_t i = 0; i < reads.size(); ++i)
+                n += reads[i].tid == tid;
+            put32(37450);
+            put32(2);
+            put64(first);
+            put64(last);
+            put64(n);
+            put64(0);
+        }
+        put32(linear[tid].size());
+        for (size_t w = 0; w < linear[tid].size(); ++w) {
+            if (linear[tid][w] == NONE)
+                linear[tid][w] = w == 0 ? 0 : linear[tid][w - 1];
+            put64(linear[tid][w]);
+        }
+    }
+    writeFileBytes(path, data);
+}
+
+/* The first of reads on reference tid that ends after beg and starts before end, or NULL */
+const IndexedRead* firstOverlapping(const std::vector<IndexedRead>& reads, int tid, int64_t beg, int64_t end) {
+    for (size_t i = 0; i < reads.size(); ++i)
+        if (reads[i].tid == tid && reads[i].pos + INDEXED_READ_LENGTH > beg && reads[i].pos < end)
+            return &reads[i];
+    return NULL;
+}
+
+int checkEndsOnly() {
+    static const char* const path = "arcs-test.bam";
+    const std::string baiPath = std::string(path) + ".bai";
+    const ARCS::ArcsParams saved = params;
+    params.min_size = 500;
+    params.end_length = 5000;
+    params.mate_window = 1000;
+    params.mate_buffer = 0;
+    int failed = 0;
+
+    std::vector<IndexedRead> reads;
+    writeIndexedBam(path, reads, 19);
+    writeBai(baiPath, reads);
+
+    /* In another order than the BAM header; big2 is shorter than its reference, and other is missing */
+    ARCS::ContigTable contigs;
+    contigs.add("tiny", 400);
+    contigs.add("big2", 39000);
+    contigs.add("small", 3000);
+    contigs.add("big", 60000);
+
+    BamReader in(path);
+    std::vector<uint32_t> refContigs;
+    for (size_t i = 0; i < in.refNames().size(); ++i)
+        refContigs.push_back(contigs.find(in.refNames()[i]));
+    std::vector<BamRegion> regions;
+    endRegions(refContigs, in.refLengths(), contigs, regions);
+    /* -e 5000 and --mate-window 1000: the heads and tails of big and big2, and all of small */
+    static const int64_t wantRegions[][3] = {
+        { 0, 0, 6000 }, { 0, 53999, 60000 }, { 1, 0, 3000 }, { 4, 0, 6000 }, { 4, 32999, 40000 },
+    };
+    failed += !expectEqual("regions", "endRegions", regions.size(), sizeof wantRegions / sizeof *wantRegions);
+    for (size_t i = 0; i < regions.size() && i < sizeof wantRegions / sizeof *wantRegions; ++i) {
+        if (regions[i].tid != wantRegions[i][0] || regions[i].beg != wantRegions[i][1] || regions[i].end != wantRegions[i][2]) {
+            std::cerr << "endRegions: region " << i << " is " << regions[i].tid << ":" << regions[i].beg << "-" << regions[i].end
+                << ", expected " << wantRegions[i][0] << ":" << wantRegions[i][1] << "-" << wantRegions[i][2] << "\n";
+            ++failed;
+        }
+    }
+
+    /*
+     * offset must start at or before the first alignment overlapping
+     * a region, and at or after the first overlapping its 16 kbp window
+     */
+    BamIndex index;
+    failed += !expect(index.load(path), "BamIndex does not load " + baiPath);
+    std::mt19937 rng(23);
+    for (int i = 0; i < 2000; ++i) {
+        int tid = rng() % N_INDEXED_REFS;
+        int64_t beg = rng() % INDEXED_REF_LENGTHS[tid], end = beg + 1 + rng() % 8000;
+        std::ostringstream where;
+        where << "BamIndex::offset(" << tid << ", " << beg << ", " << end << ")";
+        uint64_t voffset = 0;
+        bool found = index.offset(tid, beg, end, voffset);
+        const IndexedRead* first = firstOverlapping(reads, tid, beg, end);
+        const IndexedRead* window = firstOverlapping(reads, tid, beg >> 14 << 14, end);
+        if (first != NULL)
+            failed += !expect(found && voffset <= first->beg, where.str() + " starts after the first alignment of the region");
+        if (found && window != NULL)
+            failed += !expect(voffset >= window->beg, where.str() + " starts before the 16 kbp window of the region");
+    }
+    uint64_t voffset;
+    failed += !expect(!index.offset(N_INDEXED_REFS, 0, 100, voffset), "BamIndex::offset finds a reference past the last");
+    failed += !expect(!index.offset(0, 100, 100, voffset), "BamIndex::offset finds an empty region");
+
+    /* The alignments that start in the regions, and the multiplicities of their barcodes */
+    uint64_t wantRecords = 0;
+    std::map<ARCS::Barcode, int> wantMult;
+    for (size_t i = 0; i < reads.size(); ++i) {
+        for (size_t r = 0; r < regions.size(); ++r) {
+            if (reads[i].tid == regions[r].tid && reads[i].pos >= regions[r].beg && reads[i].pos < regions[r].end) {
+                ++wantRecords;
+                wantMult[encodeBarcode(reads[i].barcode.data(), reads[i].barcode.size())]++;
+                break;
+            }
+        }
+    }
+
+    ARCS::IndexMap full;
+    ARCS::IndexMultMap fullMult;
+    params.ends_only = 0;
+    readBAM(path, full, fullMult, contigs);
+    int endPairs = 0;
+    for (size_t i = 0; i < full.size(); ++i)
+        for (size_t j = 0; j < full.ends[i].size(); ++j)
+            endPairs += full.ends[i][j].head + full.ends[i][j].tail;
+    failed += !expect(endPairs > 200, "The --ends-only test file has too few pairs in the contig ends");
+
+    /* With the index beside the file and, without .bam, as arcs-test.bai */
+    static const char* const baiPaths[] = { "arcs-test.bam.bai", "arcs-test.bai" };
+    for (size_t b = 0; b < 2; ++b) {
+        if (b > 0)
+            rename(baiPaths[b - 1], baiPaths[b]);
+        std::string where = std::string("--ends-only with ") + baiPaths[b];
+        ARCS::IndexMap ends;
+        ARCS::IndexMultMap endsMult;
+        params.ends_only = 1;
+        uint64_t before = metrics.counter("records");
+        readBAM(path, ends, endsMult, contigs);
+        failed += !expectEqual("records", where, metrics.counter("records") - before, wantRecords);
+        failed += !expect(std::map<ARCS::Barcode, int>(endsMult.begin(), endsMult.end()) == wantMult,
+                where + ": the barcode multiplicities are not those of the alignments in the contig ends");
+        failed += !expect(endCounts(ends) == endCounts(full),
+                where + ": the end counts differ from reading the whole file");
+    }
+
+    params = saved;
+    remove(path);
+    remove(baiPaths[1]);
+    return failed;
+}
+
+/*
+ * forEachCanonicalKmer must give, for each window of k ACGT bases
+ * starting at a multiple of k_shift, the smaller of the packed k-mer
+ * and its reverse complement, computed directly from the sequence.
+ */
+
+/* The canonical k-mers of seq, computed directly from each window */
+template<typename K>
+std::vector<K> directCanonicalKmers(const std::string& seq, int k, int k_shift) {
+    std::vector<K> kmers;
+    for (int i = 0; i + k <= int(seq.size()); i += k_shift) {
+        std::string fwd = seq.substr(i, k), rc(k, 'N');
+        std::transform(fwd.begin(), fwd.end(), fwd.begin(), ::toupper);
+        if (fwd.find_first_not_of("ACGT") != std::string::npos)
+            continue;
+        for (int j = 0; j < k; ++j)
+            rc[k - 1 - j] = "TGCA"[std::string("ACGT").find(fwd[j])];
+        const std::string& canonical = std::min(fwd, rc);
+        K kmer = 0;
+        for (int j = 0; j < k; ++j)
+            kmer = kmer << 2 | K(std::string("ACGT").find(canonical[j]));
+        kmers.push_back(kmer);
+    }
+    return kmers;
+}
+
+template<typename K>
+int checkCanonicalKmers(const std::string& seq, int k, int k_shift) {
+    std::vector<K> rolled;
+    forEachCanonicalKmer<K>(seq.data(), seq.size(), k, k_shift, [&](K kmer) { rolled.push_back(kmer); });
+    std::vector<K> want = directCanonicalKmers<K>(seq, k, k_shift);
+    if (rolled == want)
+        return 0;
+    size_t i = 0;
+    while (i < rolled.size() && i < want.size() && rolled[i] == want[i])
+        ++i;
+    std::cerr << "forEachCanonicalKmer with k " << k << " and k_shift " << k_shift << " gives " << rolled.size()
+        << " k-mers, expected " << want.size() << "; the first difference is k-mer " << i << "\n";
+    return 1;
+}
+
+int checkForEachCanonicalKmer() {
+    std::mt19937 rng(3);
+    /* Lower case, isolated Ns, a run of Ns, and a palindrome whose k-mer is its own reverse complement */
+    std::string seq;
+    for (int i = 0; i < 600; ++i)
+        seq += "ACGTacgt"[rng() % 8];
+    for (int i = 0; i < 600; i += 97)
+        seq[i] = 'N';
+    seq.replace(300, 40, 40, 'N');
+    seq += std::string(32, 'A') + std::string(32, 'T') + "n";
+
+    static const int ks[] = { 1, 31, 32, 33, 64 };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof ks / sizeof *ks; ++i) {
+        for (int shift = 1; shift <= 3; shift += 2) {
+            if (ks[i] <= 32)
+                failed += checkCanonicalKmers<ARCS::Kmer>(seq, ks[i], shift);
+            else
+                failed += checkCanonicalKmers<ARCS::LongKmer>(seq, ks[i], shift);
+        }
+    }
+    return failed;
+}
+
+/*
+ * With --reads, each read pair of a FASTQ file is counted against the
+ * contig end its k-mers hit most often, under the barcode of its BX:Z:
+ * tag or read name. A pair that hits no end, or two ends equally, or
+ * only k-mers shared by two ends, counts only towards the multiplicity.
+ */
+
+/* The reverse complement of seq */
+std::string reverseComplement(const std::string& seq) {
+    std::string rc(seq.rbegin(), seq.rend());
+    for (size_t i = 0; i < rc.size(); ++i)
+        rc[i] = rc[i] == 'A' ? 'T' : rc[i] == 'C' ? 'G' : rc[i] == 'G' ? 'C' : 'A';
+    return rc;
+}
+
+/* A FASTQ record of seq */
+std::string fastqRecord(const std::string& name, const std::string& comment, const std::string& seq) {
+    return "@" + name + (comment.empty() ? "" : " " + comment) + "\n" + seq + "\n+\n" + std::string(seq.size(), 'I') + "\n";
+}
+
+/* A read pair of the 350 bp at pos of contig, the second read reverse complemented */
+std::string fastqPair(const std::string& name, const std::string& comment, const std::string& contig, size_t pos) {
+    return fastqRecord(name + "/1", comment, contig.substr(pos, 100))
+        + fastqRecord(name + "/2", comment, reverseComplement(contig.substr(pos + 250, 100)));
+}
+
+int checkLinkedReads() {
+    static const char* const fastaPath = "arcs-test.fa";
+    static const char* const fastqPath = "arcs-test.fq";
+    const ARCS::ArcsParams saved = params;
+    params.k_value = 30;
+    params.k_shift = 1;
+    params.min_size = 500;
+    params.end_length = 0;
+    params.min_kmer_hits = 5;
+
+    /* Contigs 0 to 2 of 2000 bp; contig 3 begins as contig 0 does; contig 4 is below -z */
+    std::mt19937 rng(17);
+    std::vector<std::string> seqs(5);
+    for (size_t i = 0; i < seqs.size(); ++i)
+        for (int j = i == 4 ? 300 : 2000; j > 0; --j)
+            seqs[i] += "ACGT"[rng() % 4];
+    seqs[3].replace(0, 500, seqs[0], 0, 500);
+    std::string fasta;
+    for (size_t i = 0; i < seqs.size(); ++i)
+        fasta += ">ctg" + std::string(1, char('0' + i)) + "\n" + seqs[i] + "\n";
+    writeFileBytes(fastaPath, std::vector<uint8_t>(fasta.begin(), fasta.end()));
+
+    std::string fastq;
+    /* The heads are the first 1000 bp and the tails the last 1000 bp */
+    fastq += fastqPair("a", "BX:Z:AAAA-1", seqs[0], 600);
+    fastq += fastqPair("b", "BX:Z:AAAA-1", seqs[1], 1500);
+    /* One read on each of two ends */
+    fastq += fastqRecord("c/1", "BX:Z:AAAA-1", seqs[0].substr(700, 100))
+        + fastqRecord("c/2", "BX:Z:AAAA-1", seqs[1].substr(1700, 100));
+    fastq += fastqPair("d_CCGT", "", seqs[2], 100);
+    /* Only k-mers shared by the heads of contigs 0 and 3 */
+    fastq += fastqPair("e_CCGT", "", seqs[3], 50);
+    /* The contig below -z has no k-mers */
+    fastq += fastqPair("f", "BX:Z:GGGG-1", seqs[4], 0);
+    /* No barcode */
+    fastq += fastqPair("g", "", seqs[1], 100);
+    /* A read without its mate */
+    fastq += fastqRecord("h", "BX:Z:GGGG-1", reverseComplement(seqs[2].substr(1800, 100)));
+    writeFileBytes(fastqPath, std::vector<uint8_t>(fastq.begin(), fastq.end()));
+
+    int failed = 0;
+    for (int mmap = 0; mmap <= 1; ++mmap) {
+        params.mmap = mmap;
+        std::string where = mmap ? "--reads with --mmap" : "--reads";
+        ARCS::ContigTable contigs;
+        ARCS::ContigKMap kmap;
+        getContigKmers(fastaPath, kmap, params.k_value, params.k_shift, contigs, true);
+        failed += !expectEqual("contigs", where, contigs.size(), seqs.size());
+
+        ARCS::IndexMap imap;
+        ARCS::IndexMultMap indexMultMap;
+        readLinkedReads(fastqPath, kmap, imap, indexMultMap);
+
+        std::array<int, 3> aHead = {{ 0, 1, 0 }}, bTail = {{ 1, 0, 1 }}, dHead = {{ 2, 1, 0 }}, hTail = {{ 2, 0, 1 }};
+        failed += !expect(barcodeEnds(imap, "AAAA") == std::vector<std::array<int, 3>>{ aHead, bTail },
+                where + ": barcode AAAA is not counted on the head of ctg0 and the tail of ctg1");
+        failed += !expect(barcodeEnds(imap, "CCGT") == std::vector<std::array<int, 3>>{ dHead },
+                where + ": barcode CCGT is not counted on the head of ctg2 alone");
+        failed += !expect(barcodeEnds(imap, "GGGG") == std::vector<std::array<int, 3>>{ hTail },
+                where + ": barcode GGGG is not counted on the tail of ctg2 alone");
+        failed += !expectEqual("barcodes with end counts", where, imap.size(), size_t(3));
+
+        std::map<ARCS::Barcode, int> mult(indexMultMap.begin(), indexMultMap.end()), wantMult;
+        wantMult[encodeBarcode("AAAA", 4)] = 6;
+        wantMult[encodeBarcode("CCGT", 4)] = 4;
+        wantMult[encodeBarcode("GGGG", 4)] = 3;
+        failed += !expect(mult == wantMult, where + ": the barcode multiplicities differ");
+
+        /* Without storeKmers, only the contig table is filled */
+        ARCS::ContigTable names;
+        ARCS::ContigKMap empty;
+        getContigKmers(fastaPath, empty, params.k_value, params.k_shift, names, false);
+        failed += !expect(empty.empty() && names.names == contigs.names && names.lengths == contigs.lengths,
+                where + ": getContigKmers without storeKmers stores k-mers or other contigs");
+    }
+
+    params = saved;
+    remove(fastaPath);
+    remove(fastqPath);
+    return failed;
+}
+
+/*
+ * kstream must parse FASTA and FASTQ as the character-at-a-time kseq
+ * it replaced did, whatever its buffer size, including records longer
+ * than the buffer and record delimiters in the middle of a line.
+ */
+
+/* One call of kstream::read: its return value and the record */
+struct KseqRecord {
+    int ret;
+    std::string name, comment, seq, qual;
+
+    bool operator==(const KseqRecord& o) const {
+        return ret == o.ret && name == o.name && comment == o.comment && seq == o.seq && qual == o.qual;
+    }
+};
+
+/* The records of data as the kseq read loop before the bulk scans parses them */
+std::vector<KseqRecord> referenceKseq(const std::string& data) {
+    std::vector<KseqRecord> records;
+    size_t pos = 0;
+    auto getc = [&]() { return pos < data.size() ? int(data[pos++]) : -1; };
+    int last = 0;
+    for (;;) {
+        KseqRecord r;
+        int c;
+        if (last == 0) {
+            while ((c = getc()) != -1 && c != '>' && c != '@');
+            if (c == -1)
+                break;
+            last = c;
+        }
+        if (pos == data.size())
+            break;
+        for (c = 0; (c = getc()) != -1 && !isspace(c); c = 0)
+            r.name += char(c);
+        if (c != '\n')
+            while ((c = getc()) != -1 && c != '\n')
+                r.comment += char(c);
+        while ((c = getc()) != -1 && c != '>' && c != '+' && c != '@')
+            if (isgraph(c))
+                r.seq += char(c);
+        if (c == '>' || c == '@')
+            last = c;
+        r.ret = r.seq.size();
+        if (c == '+') {
+            while ((c = getc()) != -1 && c != '\n');
+            if (c == -1) {
+                r.ret = -2;
+            } else {
+                while ((c = getc()) != -1 && r.qual.size() < r.seq.size())
+                    if (c >= 33 && c <= 127)
+                        r.qual += char(c);
+                last = 0;
+                if (r.seq.size() != r.qual.size())
+                    r.ret = -2;
+            }
+        }
+        records.push_back(r);
+        if (r.ret < 0)
+            break;
+    }
+    return records;
+}
+
+/* The records read from ks, up to the end of the input or an error */
+template<typename KStream>
+std::vector<KseqRecord> readKseq(KStream& ks) {
+    std::vector<KseqRecord> records;
+    kseq seq;
+    int ret;
+    while ((ret = ks.read(seq)) != -1) {
+        KseqRecord r = { ret, seq.name, seq.comment, seq.seq, seq.qual };
+        records.push_back(r);
+        if (ret < 0)
+            break;
+    }
+    return records;
+}
+
+/* Lines of width characters of n random characters of alphabet */
+std::string randomLines(std::mt19937& rng, size_t n, size_t width, const std::string& alphabet) {
+    std::string lines;
+    lines.reserve(n + n / width + 1);
+    for (size_t i = 0; i < n; ++i) {
+        lines += alphabet[rng() % alphabet.size()];
+        if ((i + 1) % width == 0 || i + 1 == n)
+            lines += '\n';
+    }
+    return lines;
+}
+
+int checkKstream() {
+    std::mt19937 rng(5);
+    /* Records of 2.5 MB and 3 MB, over two buffers of KSTREAM_BUFSIZE */
+    const size_t longFastq = 5 * KSTREAM_BUFSIZE / 2, longFasta = 3 * KSTREAM_BUFSIZE;
+    const std::string inputs[] = {
+        ">long description\n" + randomLines(rng, longFasta, 80, "ACGTNacgt")
+            + ">short\nACGT\nAC\n>empty\n>crlf x y\r\nAC GT\r\nTT\r\n",
+        "@long c\n" + randomLines(rng, longFastq, 60, "ACGT") + "+\n" + randomLines(rng, longFastq, 60, "!#0:?IJ~")
+            + "@next\nACGT\n+next\nII\nII\n@last\nA\n+\n",
+        /* Delimiters within lines end the sequence, and a short quality is an error */
+        ">a\nAC>b GT\nTT\n>c\nA+B\nxx\n@d\nACGT@e\n+\nIII",
+    };
+
+    static const size_t bufsizes[] = { 1, 7, 4096, KSTREAM_BUFSIZE };
+    static const char* const path = "arcs-test.fa";
+    int failed = 0;
+    for (size_t i = 0; i < sizeof inputs / sizeof *inputs; ++i) {
+        std::vector<KseqRecord> want = referenceKseq(inputs[i]);
+        writeFileBytes(path, std::vector<uint8_t>(inputs[i].begin(), inputs[i].end()));
+        for (size_t b = 0; b <= sizeof bufsizes / sizeof *bufsizes; ++b) {
+            std::vector<KseqRecord> got;
+            std::ostringstream what;
+            if (b < sizeof bufsizes / sizeof *bufsizes) {
+                gzFile fp = gzopen(path, "r");
+                FunctorZlib gzr;
+                kstream<gzFile, FunctorZlib> ks(fp, gzr, bufsizes[b]);
+                got = readKseq(ks);
+                gzclose(fp);
+                what << "a buffer of " << bufsizes[b] << " bytes";
+            } else {
+                MappedFile map(path);
+                kstream<const MappedFile*, FunctorMmap> ks(map.data(), map.size());
+                got = readKseq(ks);
+                what << "--mmap";
+            }
+            if (got.size() != want.size()) {
+                std::cerr << "kstream reads " << got.size() << " records of input " << i << " with " << what.str()
+                    << ", expected " << want.size() << "\n";
+                ++failed;
+                continue;
+            }
+            for (size_t r = 0; r < want.size(); ++r) {
+                if (!(got[r] == want[r])) {
+                    std::cerr << "kstream reads record " << r << " (" << want[r].name << ") of input " << i
+                        << " differently with " << what.str() << "\n";
+                    ++failed;
+                }
+            }
+        }
+    }
+    remove(path);
+    return failed;
+}
+
+int main() {
+    int failed = 0;
+    failed += checkEscapeDotString();
+    failed += checkBamDecoding();
+    failed += checkSamIntegers();
+    failed += checkCorruptBam();
+    failed += checkIndexFile();
+    failed += checkPairContigs();
+    failed += checkSweepPairContigs();
+    failed += checkSpilledGraph();
+    failed += checkRemoveDegreeNodes();
+    failed += checkWriteGraph();
+    failed += checkSignificanceTable();
+    failed += checkMateBuffer();
+    failed += checkEndsOnly();
+    failed += checkForEachCanonicalKmer();
+    failed += checkLinkedReads();
+    failed += checkKstream();
+    if (failed > 0) {
+        std::cerr << failed << " checks failed.\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "All checks passed.\n";
+    return EXIT_SUCCESS;
+}
@@ -2,7 +2,17 @@
 // for the inputted Fasta or Fastq file of contigs (if it is compressed with gzip)
 #include <zlib.h>
 #include "kseq.hpp"
+#include "BamReader.hpp"
+#include "BamIndex.hpp"
+#include "IndexFile.hpp"
+#include "Metrics.hpp"
+#include "SpillFile.hpp"
 #include <cassert>
+#include <climits>
+#include <list>
+#if _OPENMP
+# include <omp.h>
+#endif
 
 #define PROGRAM "arcs"
 #define VERSION "1.0.1"
@@ -20,8 +30,9 @@ static const char USAGE_MESSAGE[] =
 "Usage: [" PROGRAM " " VERSION "]\n"
 //"   -f  Assembled Sequences to further scaffold (Multi-Fasta format, required)\n"
 "   -f  Using kseq parser, these are the contig sequences to further scaffold and can be in either FASTA or FASTQ format\n"
-"   -a  File of File Names listing all input BAM alignment files (required). \n"
-"       NOTE: alignments must be sorted in order of name\n"
+"   -a  File of File Names listing all input BAM (or SAM) alignment files (required unless --reads is given). \n"
+"       NOTE: alignments must be sorted in order of name, unless the @HD header line has SO:coordinate or\n"
+"             SO:unsorted (see --mate-buffer)\n"
 "             index must be included in read name in the format read1_indexA\n"
 "   -s  Minimum sequence identity (min. required to include the read's scaffold alignment in the graph file, default: 98)\n"
 "   -c  Minimum number of mapping read pairs/Index required before creating edge in graph. (default: 5)\n"
@@ -31,19 +42,54 @@ static const char USAGE_MESSAGE[] =
 "   -g  shift between k-mers (default: 1)\n"
 "   -l  Minimum number of links to create edge in graph (default: 0)\n"
 "   -z  Minimum contig length to consider for scaffolding (default: 500)\n"
-"   -b  Base name for your output files (optional)\n"
+"   -b  Base name for your output files (optional). The time, CPU time and memory of each stage, and counts of\n"
+"       the records, pairs, barcodes and edges seen, are written to <base name>_metrics.json\n"
 "   -m  Range (in the format min-max) of index multiplicity (only reads with indices in this multiplicity range will be included in graph) (default: 50-10000)\n"
 "   -d  Maximum degree of nodes in graph. All nodes with degree greater than this number will be removed from the graph prior to printing final graph. For no node removal, set to 0 (default: 0)\n"
 "   -e  End length (bp) of sequences to consider (default: 30000)\n"
 "   -r  Maximum p-value for H/T assignment and link orientation determination. Lower is more stringent (default: 0.05)\n"
-"   -v  Runs in verbose mode (optional, default: 0)\n";
+"   -t  Number of threads; BAM files are read concurrently, blocks within a BAM file are decompressed in parallel and barcodes are paired in parallel (default: 1)\n"
+"   -v  Runs in verbose mode (optional, default: 0)\n"
+"   --mmap  Memory-map uncompressed contig and SAM files and parse them in place (optional)\n"
+"   --binomial  Use an exact binomial test rather than its normal approximation for -r (optional)\n"
+"   --tsv  Also write the graph as a tab-separated edge list (contigA, contigB, orientation, weight) to <base name>_original.tsv (optional)\n"
+"   --save-index=FILE  Write the barcode counts read from the alignments to FILE (optional)\n"
+"   --reads=FILE  File of File Names listing linked-read FASTQ (or FASTA) files, which may be gzipped, to use instead of -a.\n"
+"       Read pairs are mapped to the contig ends by their k-mers (-k) without alignment. The reads of a pair must\n"
+"       be consecutive. The index is taken from a BX:Z: tag or from the read name in the format read1_indexA (optional)\n"
+"   --min-kmer-hits=N  Minimum number of k-mers of a read pair in a contig end to map it there with --reads (default: 5)\n"
+"   --mate-buffer=N  Pair the reads of every alignment file through a buffer of at most N reads waiting for their\n"
+"       mate, instead of by consecutive read names. Used by default, with N = 10000000, for files whose @HD\n"
+"       header line has SO:coordinate or SO:unsorted (optional)\n"
+"   --mate-window=N  In a coordinate-sorted file, drop a waiting read once its mate has not come up within N bp\n"
+"       (default: 100000)\n"
+"   --ends-only  Read only the alignments near the contig ends (-e) of each BAM file, seeking to them through\n"
+"       its .bai or .csi index. The BAM files must be sorted by coordinate and indexed. Index multiplicity\n"
+"       (-m) then counts only the reads near the contig ends (optional)\n"
+"   --progress=SECONDS  Every SECONDS seconds, print the number of records read so far and their rate (optional)\n"
+"   --mem-limit=SIZE  Memory (bytes, or with a K, M or G suffix) for the barcode and link counts. Counts that\n"
+"       do not fit are spilled to temporary files next to the base name and merged from disk (default: no limit)\n"
+"   --load-index=FILE  Read the barcode counts from FILE, written by --save-index, instead of -f and -a.\n"
+"                      -s, -z and -e must match the run that wrote it (optional)\n"
+"   --sweep-c=LIST, --sweep-l=LIST, --sweep-r=LIST, --sweep-m=LIST\n"
+"       Comma-separated values of -c, -l, -r or -m (e.g. --sweep-m=50-10000,100-5000). The barcodes are\n"
+"       paired once for all combinations and one graph is written per combination, to\n"
+"       <base name>_c<c>_l<l>_r<r>_m<min>-<max>_original.gv. Options not swept keep their single value (optional)\n";
 
 
 ARCS::ArcsParams params;
 
-static const char shortopts[] = "f:a:s:c:k:l:z:b:m:d:e:r:v";
+/* Stage times and counters of the run, written to <base name>_metrics.json */
+ARCS::Metrics metrics;
 
-enum { OPT_HELP = 1, OPT_VERSION};
+/* Records read so far, for --progress */
+ARCS::ProgressMeter progress;
+
+static const char shortopts[] = "f:a:s:c:k:g:l:z:b:m:d:e:r:t:v";
+
+enum { OPT_HELP = 1, OPT_VERSION, OPT_MMAP, OPT_BINOMIAL, OPT_TSV, OPT_SAVE_INDEX, OPT_LOAD_INDEX,
+    OPT_READS, OPT_MIN_KMER_HITS, OPT_MEM_LIMIT, OPT_MATE_BUFFER, OPT_MATE_WINDOW, OPT_ENDS_ONLY, OPT_PROGRESS,
+    OPT_SWEEP_C, OPT_SWEEP_L, OPT_SWEEP_R, OPT_SWEEP_M };
 
 static const struct option longopts[] = {
     {"file", required_argument, NULL, 'f'},
@@ -51,6 +97,7 @@ static const struct option longopts[] = {
     {"seq_id", required_argument, NULL, 's'}, 
     {"min_reads", required_argument, NULL, 'c'},
     {"k_value", required_argument, NULL, 'k'}, 
+    {"k_shift", required_argument, NULL, 'g'},
     {"min_links", required_argument, NULL, 'l'},
     {"min_size", required_argument, NULL, 'z'},
     {"base_name", required_argument, NULL, 'b'},
@@ -58,105 +105,124 @@ static const struct option longopts[] = {
     {"max_degree", required_argument, NULL, 'd'},
     {"end_length", required_argument, NULL, 'e'},
     {"error_percent", required_argument, NULL, 'r'},
+    {"threads", required_argument, NULL, 't'},
     {"run_verbose", required_argument, NULL, 'v'},
+    {"mmap", no_argument, NULL, OPT_MMAP},
+    {"binomial", no_argument, NULL, OPT_BINOMIAL},
+    {"tsv", no_argument, NULL, OPT_TSV},
+    {"save-index", required_argument, NULL, OPT_SAVE_INDEX},
+    {"load-index", required_argument, NULL, OPT_LOAD_INDEX},
+    {"reads", required_argument, NULL, OPT_READS},
+    {"min-kmer-hits", required_argument, NULL, OPT_MIN_KMER_HITS},
+    {"mem-limit", required_argument, NULL, OPT_MEM_LIMIT},
+    {"mate-buffer", required_argument, NULL, OPT_MATE_BUFFER},
+    {"mate-window", required_argument, NULL, OPT_MATE_WINDOW},
+    {"ends-only", no_argument, NULL, OPT_ENDS_ONLY},
+    {"progress", required_argument, NULL, OPT_PROGRESS},
+    {"sweep-c", required_argument, NULL, OPT_SWEEP_C},
+    {"sweep-l", required_argument, NULL, OPT_SWEEP_L},
+    {"sweep-r", required_argument, NULL, OPT_SWEEP_R},
+    {"sweep-m", required_argument, NULL, OPT_SWEEP_M},
     {"version", no_argument, NULL, OPT_VERSION},
     {"help", no_argument, NULL, OPT_HELP},
     { NULL, 0, NULL, 0 }
 };
 
-/* Helper that flips A T G C (T A C G respectively) */
-char flipBase(char base) {
-	if (base == 'A' || base == 'a') {
-		return 'T'; 
-	} else if (base == 'T' || base == 't') {
-		return 'A';
-	} else if (base == 'G' || base == 'g') {
-		return 'C';  
-	} else if (base == 'C' || base == 'c') {
-		return 'G';
-	} else {
-		std::cerr << "Error: Not a base character." << std::endl; 
-		return 'N'; // holder for mistake
-	}
-} 
-
+/* 2-bit code of each base (A=0, C=1, G=2, T=3), 4 for anything else */
+static const uint8_t BASE_CODE[256] = {
+	4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+	4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+	4,0,4,1,4,4,4,2,4,4,4,4,4,4,4,4, 4,4,4,4,3,4,4,4,4,4,4,4,4,4,4,4,
+	4,0,4,1,4,4,4,2,4,4,4,4,4,4,4,4, 4,4,4,4,3,4,4,4,4,4,4,4,4,4,4,4,
+	4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+	4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+	4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,
+	4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4, 4,4,4,4,4,4,4,4,4,4,4,4,4,4,4,4
+};
 
-/* Returns the reverse complement as a sequence string
- * 	std::string 			sequence
- */ 
-std::string getReverseComplement(std::string sequence) {
-
-	std::string rcsequence = ""; 	
-	std::string seq = sequence;
-
-	int sequence_length = sequence.length(); 
-	for (int i = sequence_length-1; i >= 0; i--) {
-		char sequence_char = sequence.at(i); 
-		//std::cout << sequence_char;  
-		char flipped_char = flipBase(sequence_char); 
-		//std::cout << flipped_char << std::endl; 
-		rcsequence.push_back(flipped_char); 
+/* Rolls a window of k bases along seq, keeping the packed forward k-mer and
+ * its reverse complement up to date in O(1) per base, and calls f with the
+ * canonical (smaller) of the two for every k-mer starting at a multiple of
+ * k_shift. Windows containing a non-ACGT base are skipped.
+ * 	const char*, int				sequence and its length
+ * 	int						k-value specified by user
+ */
+template<typename K, typename Func>
+void forEachCanonicalKmer(const char* seq, int seqsize, int k, int k_shift, Func f) {
+
+	const K mask = (k == static_cast<int>(sizeof(K)) * 4) ? ~K(0) : (K(1) << (2 * k)) - 1; 
+	const int rcshift = 2 * (k - 1); 
+	K kmer = 0, rckmer = 0; 
+	int valid = 0; 
+	for (int i = 0; i < seqsize; i++) {
+		K code = BASE_CODE[static_cast<unsigned char>(seq[i])]; 
+		if (code > 3) {
+			valid = 0; 
+			continue; 
+		}
+		kmer = ((kmer << 2) | code) & mask; 
+		rckmer = (rckmer >> 2) | ((3 - code) << rcshift); 
+		if (++valid >= k && (i - k + 1) % k_shift == 0)
+			f(kmer < rckmer ? kmer : rckmer); 
 	}
-	return rcsequence; 
 }
 
 /* Shreds end sequence into kmers and inputs them one by one into the ContigKMap 
- * 	std::pair<std::string, bool> 				specifies contigID and head/tail 
- * 	std::string						the end sequence of the contig 
+ * A k-mer found in more than one contig end is marked ARCS::NO_CONTIG_END.
+ * 	ARCS::ContigEnd						specifies contig ordinal and head/tail 
+ * 	const std::string&					name of the contig (for warnings)
+ * 	const char*, int					the end sequence of the contig and its length
  *	int							k-value specified by user 
  *	ARCS::ContigKMap					ContigKMap for storage of kmers
  */
-void mapKmers(std::pair<std::string, bool> contigIdentity, std::string seqToKmerize, 
-		int k, int k_shift, ARCS::ContigKMap& kmap) {
+template<typename KMap>
+void mapKmers(ARCS::ContigEnd contigEnd, const std::string& contigID, const char* seqToKmerize, 
+		int seqsize, int k, int k_shift, KMap& kmap) {
 
-	int seqsize = seqToKmerize.length(); 
+	typedef typename KMap::key_type K; 
 
 	// Checks if length of the subsequence is smaller than the k size
 	// 	If the contig end is shorter than the k-value, then we ignore it for now. 
 	if (seqsize < k) {
 		std::cout << "Warning: ends of contig is shorter than k-value for contigID (no k-mers added): " 
-			<< contigIdentity.first << std::endl; 
+			<< contigID << std::endl; 
 	} else {
-		//assert(seqsize >= k); 
-		std::string kmerseq; 
-		std::string rckmerseq;
-		int shift = k_shift; 
-		int i = 0; 
-		while (i <= seqsize - k) {
-			kmerseq = seqToKmerize.substr(i, k); 
-			rckmerseq = getReverseComplement(kmerseq); 
-			kmap[kmerseq] = contigIdentity; 
-			kmap[rckmerseq] = contigIdentity; 
-		i += shift; 
-		}
+		// Only the canonical k-mer is stored; look ups must canonicalize too
+		forEachCanonicalKmer<K>(seqToKmerize, seqsize, k, k_shift, 
+			[&](K kmer) {
+				std::pair<typename KMap::iterator, bool> it = kmap.insert(std::make_pair(kmer, contigEnd)); 
+				if (!it.second && it.first->second != contigEnd)
+					it.first->second = ARCS::NO_CONTIG_END; 
+			}); 
 	}
 }
 
-/* Get the k-mers from the paired ends of the contigs and store them in map. 
- * 	std::string file					FASTA (or later FASTQ) file 
- *	std::sparse_hash_map<k-mer, pair<contidID, bool>> 	ContigKMap
+/* Get the k-mers from the paired ends of the contigs read from ks and store them in map. 
+ * Every contig, including those shorter than min_size, is added to the ContigTable 
+ * with its length, so the contig file is only read once. 
+ * The head and tail are the first and last end_length bp, as for the alignments in readBAM. 
+ * 	KStream ks						kstream over the FASTA (or later FASTQ) file 
+ *	std::sparse_hash_map<k-mer, ContigEnd> 			ContigKMap (or LongContigKMap for k > 32)
  *	int k							k-value (specified by user)
+ *	ARCS::ContigTable					contig names and lengths, by contig ID
+ *	bool storeKmers						false to only fill the ContigTable
  */ 
-void getContigKmers(std::string file, ARCS::ContigKMap& kmap, int k, int k_shift){
+template<typename KStream, typename KMap>
+void kmerizeContigs(KStream& ks, KMap& kmap, int k, int k_shift, ARCS::ContigTable& contigs, bool storeKmers){
 
-	//int counter = 0; 
-	gzFile fp; 
+	int counter = 0; 
 	kseq seq; 
 	int l; 
-	//std::string contigID; 
-	//std::string sequence; 
-	const char* filename = file.c_str(); 
-	fp = gzopen(filename, "r"); 
-	FunctorZlib gzr; 
-	kstream<gzFile, FunctorZlib> ks(fp, gzr);
 	while((l= ks.read(seq)) >= 0) {
-		std::string contigID = seq.name; 
-		std::string sequence = seq.seq; 
+		counter++; 
+		const std::string& contigID = seq.name; 
+		const std::string& sequence = seq.seq; 
+		uint32_t id = contigs.add(contigID, sequence.length()); 
 
 		// If the sequence is above minimum contig length, then will extract kmers from both ends 
 		// If not (FOR NOW) will ignore the contig
 		int sequence_length = sequence.length();
-		if (sequence_length >= params.min_size) {
+		if (storeKmers && sequence_length >= params.min_size) {
 			
 			// If contig length is less than 2 x end_length, then we split the sequence 
 			// in half to decide head/tail (aka we changed the end_length)
@@ -165,30 +231,86 @@ void getContigKmers(std::string file, ARCS::ContigKMap& kmap, int k, int k_shift
 				cutOff = sequence_length/2; 
 
 			// Arbitrarily assign head or tail to ends of the contig
-			std::pair<std::string, bool> headside(contigID, true); 
-			std::pair<std::string, bool> tailside(contigID, false); 
+			ARCS::ContigEnd headside = (id << 1) | 1; 
+			ARCS::ContigEnd tailside = id << 1; 
 
 			//get ends of the sequence and put k-mers into the map
-			std::string seqend; 
-			seqend = sequence.substr(0, cutOff); 
-			mapKmers(headside, seqend, k, k_shift, kmap); 
-			seqend = sequence.substr(cutOff, sequence_length); 
-			mapKmers(tailside, seqend, k, k_shift, kmap); 
+			mapKmers(headside, contigID, sequence.data(), cutOff, k, k_shift, kmap); 
+			mapKmers(tailside, contigID, sequence.data() + sequence_length - cutOff, cutOff, k, k_shift, kmap); 
+		}
+	}
+
+	if (params.verbose)
+		std::cout << "Saw " << counter << " sequences.\n"; 
+}
+
+/* Get the k-mers from the paired ends of the contigs and store them in map, 
+ * and the name and length of every contig in the ContigTable. 
+ * 	std::string file					FASTA (or later FASTQ) file 
+ *	std::sparse_hash_map<k-mer, ContigEnd> 			ContigKMap (or LongContigKMap for k > 32)
+ *	int k							k-value (specified by user)
+ *	ARCS::ContigTable					contig names and lengths, by contig ID
+ *	bool storeKmers						false to only fill the ContigTable
+ * With --mmap, an uncompressed file is memory-mapped and parsed in place.
+ */ 
+template<typename KMap>
+void getContigKmers(std::string file, KMap& kmap, int k, int k_shift, ARCS::ContigTable& contigs, bool storeKmers){
+
+	const char* filename = file.c_str(); 
+	if (params.mmap) {
+		MappedFile map(filename); 
+		if (map.good() && !map.isGzip()) {
+			kstream<const MappedFile*, FunctorMmap> ks(map.data(), map.size()); 
+			kmerizeContigs(ks, kmap, k, k_shift, contigs, storeKmers); 
+			return; 
 		}
 	}
+
+	gzFile fp; 
+	fp = gzopen(filename, "r"); 
+	FunctorZlib gzr; 
+	kstream<gzFile, FunctorZlib> ks(fp, gzr);
+	kmerizeContigs(ks, kmap, k, k_shift, contigs, storeKmers); 
 	gzclose(fp); 
 }
 
 
-/* Returns true if seqence only contains ATGC and is of length indexLen */
-bool checkIndex(std::string seq) {
-    for (int i = 0; i < static_cast<int>(seq.length()); i++) {
-        char c = toupper(seq[i]);
-        if (c != 'A' && c != 'T' && c != 'G' && c != 'C')
-            return false;
+/* Longest index sequence that fits in a Barcode */
+static const size_t MAX_BARCODE_LEN = 31;
+
+/*
+ * Returns the Barcode of an index sequence, or 0 if the sequence
+ * is empty, contains anything other than ATGC or is longer than
+ * MAX_BARCODE_LEN.
+ */
+ARCS::Barcode encodeBarcode(const char* seq, size_t len) {
+    if (len == 0 || len > MAX_BARCODE_LEN)
+        return 0;
+    ARCS::Barcode code = 1;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = BASE_CODE[static_cast<unsigned char>(seq[i])];
+        if (c > 3)
+            return 0;
+        code = (code << 2) | c;
     }
-    //return (static_cast<int>(seq.length()) == params.indexLen);
-    return true;
+    return code;
+}
+
+/*
+ * Add one read pair aligning to the head or tail of contig to the
+ * end counts of its index in imap, keeping them sorted by contig ID.
+ */
+void countEnd(ARCS::IndexMap& imap, ARCS::Barcode index, uint32_t contig, bool isHead) {
+    ARCS::ScafMap& ends = imap[index];
+    ARCS::ScafMap::iterator it = std::lower_bound(ends.begin(), ends.end(), contig);
+    if (it == ends.end() || it->contig != contig) {
+        it = ends.insert(it, ARCS::EndCount(contig));
+        imap.nEnds++;
+    }
+    if (isHead)
+        it->head++;
+    else
+        it->tail++;
 }
 
 /*
@@ -205,227 +327,924 @@ bool checkChar(char c) {
     return (c == 'M' || c == '=' || c == 'X' || c == 'I');
 }
 
+/*
+ * A field of a SAM line: a view into the line buffer, which is
+ * valid until the buffer is refilled.
+ */
+struct SamField {
+    const char* p;
+    size_t len;
+    SamField() : p(""), len(0) {}
+};
+
+/* Number of mandatory fields of a SAM line */
+static const int SAM_FIELDS = 11;
+
+/*
+ * Split a SAM line (without its newline) at tabs into the mandatory
+ * fields and the remaining optional tag fields. Missing fields are
+ * left empty. Nothing is copied.
+ */
+void splitSamLine(const char* line, size_t len, SamField fields[SAM_FIELDS], SamField& tags) {
+    const char* p = line;
+    const char* end = line + len;
+    for (int i = 0; i < SAM_FIELDS; ++i) {
+        if (p > end) {
+            fields[i] = SamField();
+            continue;
+        }
+        const char* tab = static_cast<const char*>(memchr(p, '\t', end - p));
+        const char* fieldEnd = tab == NULL ? end : tab;
+        fields[i].p = p;
+        fields[i].len = fieldEnd - p;
+        p = fieldEnd + 1;
+    }
+    if (p < end) {
+        tags.p = p;
+        tags.len = end - p;
+    } else {
+        tags = SamField();
+    }
+}
+
+/*
+ * Parse a decimal integer at the start of [p, end) into value, 0 if
+ * there is none. Returns false, with value 0, if it does not fit in an int.
+ */
+bool parseInt(const char* p, const char* end, int& value) {
+    value = 0;
+    bool neg = p < end && *p == '-';
+    if (neg)
+        ++p;
+    int64_t v = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+        v = v * 10 + (*p - '0');
+        if (v > int64_t(INT_MAX) + neg)
+            return false;
+    }
+    value = static_cast<int>(neg ? -v : v);
+    return true;
+}
+
+/* The integer of a SAM field; 0 if there is none or it does not fit in an int */
+int parseInt(const SamField& f) {
+    int value;
+    parseInt(f.p, f.p + f.len, value);
+    return value;
+}
+
 /*
  * Calculate the sequence identity from the cigar string
  * sequence length, and tags.
  */
-double calcSequenceIdentity(const std::string& line, const std::string& cigar, const std::string& seq) {
+double calcSequenceIdentity(const SamField& cigar, const SamField& tags, size_t seqLen) {
 
-    int qalen = 0;
-    std::stringstream ss;
-    for (auto i = cigar.begin(); i != cigar.end(); ++i) {
+    /* A length or edit distance that does not fit in an int gives an identity of 0 */
+    int64_t qalen = 0;
+    int64_t value = 0;
+    for (const char* i = cigar.p; i != cigar.p + cigar.len; ++i) {
         if (!isdigit(*i)) {
-            if (checkChar(*i)) {
-                ss << "\t";
-                int value = 0;
-                ss >> value;
+            if (checkChar(*i))
                 qalen += value;
-                ss.str("");
-            } else {
-                ss.str("");
-            }
+            value = 0;
         } else {
-            ss << *i;
+            value = value * 10 + (*i - '0');
+            if (value > INT_MAX)
+                return 0;
         }
     }
+    if (qalen > INT_MAX)
+        return 0;
 
     int edit_dist = 0;
-    std::size_t found = line.find("NM:i:");
-    if (found!=std::string::npos) {
-        edit_dist = std::strtol(&line[found + 5], 0, 10);
+    const char* tagsEnd = tags.p + tags.len;
+    for (const char* p = tags.p; tagsEnd - p >= 5; ++p) {
+        p = static_cast<const char*>(memchr(p, 'N', tagsEnd - p - 4));
+        if (p == NULL)
+            break;
+        if (memcmp(p, "NM:i:", 5) == 0) {
+            if (!parseInt(p + 5, tagsEnd, edit_dist))
+                return 0;
+            break;
+        }
     }
         
     double si = 0;
-    if (qalen != 0) {
+    if (qalen != 0 && seqLen > 0) {
         double mins = qalen - edit_dist;
-        double div = mins/seq.length();
+        double div = mins/seqLen;
         si = div * 100;
     }
 
     return si;
 }
 
+/*
+ * Calculate the sequence identity of a BAM record from its
+ * packed cigar, sequence length and NM tag.
+ */
+double calcSequenceIdentity(const BamRecord& rec) {
+
+    int qalen = 0;
+    for (int i = 0; i < rec.nCigar(); ++i) {
+        uint32_t op = rec.cigar(i);
+        switch (op & 0xf) {
+            case BAM_CMATCH: case BAM_CINS: case BAM_CEQUAL: case BAM_CDIFF:
+                qalen += op >> 4;
+                break;
+        }
+    }
+
+    int64_t edit_dist = 0;
+    rec.auxInt("NM", edit_dist);
+
+    double si = 0;
+    if (qalen != 0 && rec.seqLen() > 0) {
+        double mins = qalen - edit_dist;
+        double div = mins/rec.seqLen();
+        si = div * 100;
+    }
+
+    return si;
+}
+
+/* Size of the chunks a SAM file is read in */
+static const size_t SAM_BUFFER_SIZE = 1 << 20;
+/* Number of BGZF blocks (up to 64 KB each) read per pipeline batch */
+static const size_t BAM_BATCH_BLOCKS = 256;
+/* Number of records decoded per worker task */
+static const size_t BAM_DECODE_CHUNK = 4096;
+
+/*
+ * Fill aln from a BAM record. refContigs maps each reference
+ * of the BAM header to its contig ID.
+ */
+void decodeAlignment(const BamRecord& rec, const std::vector<uint32_t>& refContigs, ARCS::ReadAlignment& aln) {
+    aln.readName.assign(rec.readName(), rec.readNameLen());
+    aln.flag = rec.flag();
+    int32_t refID = rec.refID();
+    if (refID >= 0 && refID < static_cast<int32_t>(refContigs.size()))
+        aln.contig = refContigs[refID];
+    else
+        aln.contig = ARCS::ContigTable::NO_CONTIG;
+    /* SAM positions are 1-based */
+    aln.pos = rec.pos() + 1;
+    aln.mapq = rec.mapq();
+    aln.hasSeq = rec.seqLen() > 0;
+
+    /* Calculate the sequence identity */
+    aln.si = calcSequenceIdentity(rec);
+}
+
+/*
+ * Fill aln from a SAM line (without its newline). scafName holds the
+ * reference name and is reused between lines.
+ */
+void decodeSamLine(const char* line, size_t len, const ARCS::ContigTable& contigs, std::string& scafName, ARCS::ReadAlignment& aln) {
+    SamField fields[SAM_FIELDS], tags;
+    splitSamLine(line, len, fields, tags);
+    aln.readName.assign(fields[0].p, fields[0].len);
+    aln.flag = parseInt(fields[1]);
+    scafName.assign(fields[2].p, fields[2].len);
+    aln.contig = contigs.find(scafName);
+    aln.pos = parseInt(fields[3]);
+    aln.mapq = parseInt(fields[4]);
+    /* A SEQ of * is no sequence, as an l_seq of 0 in BAM */
+    size_t seqLen = fields[9].len == 1 && fields[9].p[0] == '*' ? 0 : fields[9].len;
+    aln.hasSeq = seqLen > 0;
+
+    /* Calculate the sequence identity */
+    aln.si = calcSequenceIdentity(fields[5], tags, seqLen);
+}
+
+/* Pending mates held by default for coordinate-sorted and unsorted files */
+static const size_t DEFAULT_MATE_BUFFER = 10000000;
+
+/* A read that passed the filters, waiting in the mate buffer for its mate */
+struct PendingMate {
+    uint32_t contig;
+    int pos;
+    /* Position in the eviction order */
+    std::list<const std::string*>::iterator age;
+};
+
+/*
+ * Read pairing state carried from one alignment to the next.
+ * A name sorted file is paired by comparing each read name with the
+ * previous one. Any other file is paired through the mate buffer: the
+ * reads that pass the filters wait in pending, by name, for their mate.
+ * Reads are evicted, oldest first, when more than maxPending are
+ * waiting and, in a coordinate-sorted file (window > 0), once the
+ * alignments move to another contig or more than window bp past them.
+ */
+struct ReadPairState {
+    std::string prevRN;
+    ARCS::Barcode readyToAddIndex;
+    uint32_t prevRef, readyToAddContig;
+    int prevSI, prevFlag, prevMapq, prevPos, readyToAddPos;
+    int ct;
+
+    bool useMateBuffer;
+    std::unordered_map<std::string, PendingMate> pending;
+    std::list<const std::string*> pendingOrder;
+    size_t maxPending;
+    int window;
+
+    // Number of unpaired reads.
+    size_t countUnpaired;
+    // Number of reads with an index longer than MAX_BARCODE_LEN.
+    size_t countLongIndex;
+    // Number of records, and of reads of a pair that fail each filter (see filterRead).
+    size_t countRecords;
+    size_t countRejected[4];
+    // Number of pairs on one contig with an index, and of those counted against a contig end.
+    size_t countPairs, countEndPairs;
+
+    ReadPairState() : readyToAddIndex(0), prevRef(ARCS::ContigTable::NO_CONTIG), readyToAddContig(ARCS::ContigTable::NO_CONTIG),
+        prevSI(0), prevFlag(0), prevMapq(0), prevPos(-1), readyToAddPos(-1), ct(1),
+        useMateBuffer(false), maxPending(0), window(0), countUnpaired(0), countLongIndex(0),
+        countRecords(0), countRejected(), countPairs(0), countEndPairs(0) {}
+
+    /*
+     * Choose how to pair the reads of a file from the sort order (SO)
+     * of its @HD header line, "" if none. --mate-buffer forces the mate
+     * buffer for every file.
+     */
+    void setSortOrder(const std::string& so) {
+        useMateBuffer = params.mate_buffer != 0 || so == "coordinate" || so == "unsorted";
+        maxPending = params.mate_buffer != 0 ? params.mate_buffer : DEFAULT_MATE_BUFFER;
+        window = so == "coordinate" ? params.mate_window : 0;
+    }
+};
+
+/* The first filter a read fails, in the order they are checked */
+enum ReadFilter { PASS_FILTERS = 0, FAIL_FLAG, FAIL_MAPQ, FAIL_IDENTITY };
+
+/* Names of the run metrics of reads failing each ReadFilter */
+static const char* const REJECTED_METRIC[] = { NULL, "reads_rejected_flag", "reads_rejected_mapq", "reads_rejected_identity" };
+
+/* Check one read of a pair against the filters of -s and the accepted flags */
+ReadFilter filterRead(bool hasSeq, int flag, int mapq, int si) {
+    if (!hasSeq || !checkFlag(flag))
+        return FAIL_FLAG;
+    if (mapq == 0)
+        return FAIL_MAPQ;
+    if (si < params.seq_id)
+        return FAIL_IDENTITY;
+    return PASS_FILTERS;
+}
+
+/* The sort order (SO) of the @HD line at the start of a SAM header, or "" */
+std::string headerSortOrder(const char* text, size_t len) {
+    const char* end = static_cast<const char*>(memchr(text, '\n', len));
+    std::string hd(text, end == NULL ? len : end - text);
+    if (hd.compare(0, 3, "@HD") != 0)
+        return "";
+    size_t so = hd.find("\tSO:");
+    if (so == std::string::npos)
+        return "";
+    so += 4;
+    return hd.substr(so, hd.find('\t', so) - so);
+}
+
+/*
+ * Parse the index from a read name in the format read1_indexA,
+ * returning 0 if there is none or it cannot be packed.
+ */
+ARCS::Barcode parseIndex(const std::string& readName, ReadPairState& st) {
+    ARCS::Barcode index = 0;
+    std::size_t found = readName.find("_");
+    if (found!=std::string::npos) {
+        size_t len = readName.length() - found - 1;
+        index = encodeBarcode(readName.data() + found + 1, len);
+        if (len > MAX_BARCODE_LEN) {
+            if (st.countLongIndex == 0)
+                std::cerr << "Warning: Skipping reads with an index longer than " << MAX_BARCODE_LEN << " bp.\n"
+                    "  Read: " << readName << std::endl;
+            ++st.countLongIndex;
+        }
+    }
+    return index;
+}
+
+/*
+ * Count a read pair of index whose reads align to contig, around
+ * pos, against the head or tail of the contig in imap.
+ */
+void countPair(ReadPairState& st, ARCS::IndexMap& imap, ARCS::Barcode index, uint32_t contig, int pos, const ARCS::ContigTable& contigs) {
+
+    ++st.countPairs;
+
+    int size = contigs.lengths[contig];
+    if (size >= params.min_size) {
+
+       /* 
+        * If length of sequence is less than 2 x end_length, split
+        * the sequence in half to determing head/tail 
+        */
+       int cutOff = params.end_length;
+       if (cutOff == 0 || size <= cutOff * 2)
+           cutOff = size/2;
+
+       /* Aligns to head */
+       if (pos <= cutOff) {
+           countEnd(imap, index, contig, true);
+           ++st.countEndPairs;
+       }
+       /* Aligns to tail */
+       else if (pos > size - cutOff) {
+           countEnd(imap, index, contig, false);
+           ++st.countEndPairs;
+       }
+
+    }
+}
+
+/*
+ * Add one alignment of a name sorted file. Once both reads of a pair
+ * have been seen and pass the filters, and the next read name comes up,
+ * the pair is counted against the head or tail of its scaffold in imap.
+ */
+void pairAlignment(ReadPairState& st, const ARCS::ReadAlignment& aln, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, const ARCS::ContigTable& contigs) {
+
+    const std::string& readName = aln.readName;
+    uint32_t contigID = aln.contig;
+    int si = aln.si;
+
+    /* Parse the index from the readName */
+    ARCS::Barcode index = parseIndex(readName, st);
+
+    /* Keep track of index multiplicity */
+    if (index != 0)
+        indexMultMap[index]++;
+
+    if (st.ct == 2 && readName != st.prevRN) {
+        if (st.countUnpaired == 0)
+            std::cerr << "Warning: Skipping an unpaired read. BAM file should be sorted in order of read name.\n"
+                "  Prev read: " << st.prevRN << "\n"
+                "  Curr read: " << readName << std::endl;
+        ++st.countUnpaired;
+        if (st.countUnpaired % 1000000 == 0)
+            std::cerr << "Warning: Skipped " << st.countUnpaired << " unpaired reads." << std::endl;
+        st.ct = 1;
+    }
+
+    if (st.ct >= 3)
+        st.ct = 1;
+    if (st.ct == 1) {
+        if (readName.compare(st.prevRN) != 0) {
+            st.prevRN = readName;
+            st.prevSI = si;
+            st.prevFlag = aln.flag;
+            st.prevMapq = aln.mapq;
+            st.prevRef = contigID;
+            st.prevPos = aln.pos;
+
+
+            /* 
+             * Read names are different so we can add the previous index and contig as
+             * long as there were only two mappings (one for each read)
+             */
+            if (st.readyToAddIndex != 0 && st.readyToAddContig != ARCS::ContigTable::NO_CONTIG && st.readyToAddPos != -1) {
+                countPair(st, imap, st.readyToAddIndex, st.readyToAddContig, st.readyToAddPos, contigs);
+                st.readyToAddIndex = 0;
+                st.readyToAddContig = ARCS::ContigTable::NO_CONTIG;
+                st.readyToAddPos = -1;
+            }
+        } else {
+            st.ct = 0;
+            st.readyToAddIndex = 0;
+            st.readyToAddContig = ARCS::ContigTable::NO_CONTIG;
+            st.readyToAddPos = -1;
+        }
+    } else if (st.ct == 2) {
+        assert(readName == st.prevRN);
+        ReadFilter prevFilter = filterRead(true, st.prevFlag, st.prevMapq, st.prevSI);
+        ReadFilter filter = filterRead(aln.hasSeq, aln.flag, aln.mapq, si);
+        st.countRejected[prevFilter]++;
+        st.countRejected[filter]++;
+        if (prevFilter == PASS_FILTERS && filter == PASS_FILTERS) {
+            if (st.prevRef == contigID && contigID != ARCS::ContigTable::NO_CONTIG && index != 0) {
+                    
+                st.readyToAddIndex = index;
+                st.readyToAddContig = contigID;
+                /* Take average read alignment position between read pairs */
+                st.readyToAddPos = (st.prevPos + aln.pos)/2;
+            }
+        }
+    }
+   st.ct++; 
+}
+
+/* Drop the read that has waited longest in the mate buffer */
+void evictMate(ReadPairState& st) {
+    st.pending.erase(st.pending.find(*st.pendingOrder.front()));
+    st.pendingOrder.pop_front();
+    ++st.countUnpaired;
+}
+
+/*
+ * Add one alignment of a file paired through the mate buffer. A read
+ * that passes the filters of pairAlignment waits for its mate, and the
+ * pair is counted as soon as the mate arrives if both reads align to
+ * the same contig.
+ */
+void addMate(ReadPairState& st, const ARCS::ReadAlignment& aln, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, const ARCS::ContigTable& contigs) {
+
+    ARCS::Barcode index = parseIndex(aln.readName, st);
+
+    /* Keep track of index multiplicity */
+    if (index != 0)
+        indexMultMap[index]++;
+
+    /* In a coordinate-sorted file, a read whose mate has not come up by now is unpaired */
+    while (st.window > 0 && !st.pendingOrder.empty()) {
+        const PendingMate& oldest = st.pending.find(*st.pendingOrder.front())->second;
+        if (oldest.contig == aln.contig && oldest.pos + st.window >= aln.pos)
+            break;
+        evictMate(st);
+    }
+
+    ReadFilter filter = filterRead(aln.hasSeq, aln.flag, aln.mapq, aln.si);
+    st.countRejected[filter]++;
+    if (filter != PASS_FILTERS || aln.contig == ARCS::ContigTable::NO_CONTIG || index == 0)
+        return;
+
+    PendingMate read = { aln.contig, aln.pos, st.pendingOrder.end() };
+    std::pair<std::unordered_map<std::string, PendingMate>::iterator, bool> it = st.pending.insert(std::make_pair(aln.readName, read));
+    if (it.second) {
+        it.first->second.age = st.pendingOrder.insert(st.pendingOrder.end(), &it.first->first);
+        if (st.pendingOrder.size() > st.maxPending)
+            evictMate(st);
+        return;
+    }
+
+    /* The mate was waiting */
+    const PendingMate& mate = it.first->second;
+    if (mate.contig == aln.contig)
+        countPair(st, imap, index, aln.contig, (mate.pos + aln.pos)/2, contigs);
+    st.pendingOrder.erase(mate.age);
+    st.pending.erase(it.first);
+}
+
+/* Records counted by a thread before they are added to progress */
+static const size_t PROGRESS_RECORDS = 1 << 16;
+
+/* Add one alignment, by name or through the mate buffer */
+void addAlignment(ReadPairState& st, const ARCS::ReadAlignment& aln, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, const ARCS::ContigTable& contigs) {
+    if (++st.countRecords % PROGRESS_RECORDS == 0)
+        progress.add(PROGRESS_RECORDS);
+    if (st.useMateBuffer)
+        addMate(st, aln, imap, indexMultMap, contigs);
+    else
+        pairAlignment(st, aln, imap, indexMultMap, contigs);
+}
+
+/*
+ * Report the reads of one file that could not be paired or indexed,
+ * and add the counts of the file to the run metrics.
+ */
+void warnSkipped(const ReadPairState& st) {
+    size_t unpaired = st.countUnpaired + (st.useMateBuffer ? st.pending.size() : 0);
+    progress.add(st.countRecords % PROGRESS_RECORDS);
+    #pragma omp critical(metrics)
+    {
+        metrics.add("records", st.countRecords);
+        for (int f = FAIL_FLAG; f <= FAIL_IDENTITY; ++f)
+            metrics.add(REJECTED_METRIC[f], st.countRejected[f]);
+        metrics.add("reads_unpaired", unpaired);
+        metrics.add("reads_long_index", st.countLongIndex);
+        metrics.add("pairs_accepted", st.countPairs);
+        metrics.add("pairs_in_contig_ends", st.countEndPairs);
+    }
+
+    if (st.useMateBuffer && st.countUnpaired + st.pending.size() > 0)
+        std::cerr << "Warning: Skipped " << st.countUnpaired + st.pending.size() << " reads that pass the filters"
+            " without a mate that does in the mate buffer (--mate-buffer, --mate-window).\n";
+    else if (st.countUnpaired > 0)
+        std::cerr << "Warning: Skipped " << st.countUnpaired << " unpaired reads. BAM file should be sorted in order of read name"
+            " (or have SO:coordinate in its @HD header line, or use --mate-buffer).\n";
+    if (st.countLongIndex > 0)
+        std::cerr << "Warning: Skipped " << st.countLongIndex << " reads with an index longer than " << MAX_BARCODE_LEN << " bp.\n";
+}
+
+/* Sorted runs of the barcode counts spilled to disk with --mem-limit */
+static ARCS::SortedRuns<ARCS::BarcodeRecord> barcodeRuns;
+
+/* Bytes that each IndexMap being filled and its IndexMultMap may use, 0 for no limit */
+static size_t indexMapLimit = 0;
+
+/*
+ * Write the end counts of imap and the multiplicities of indexMultMap
+ * to a new run of barcodeRuns, sorted by barcode and contig, and empty
+ * both maps.
+ */
+void spillIndexMaps(ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap) {
+
+    if (imap.size() == 0 && indexMultMap.empty())
+        return;
+
+    std::vector<ARCS::Barcode> barcodes(imap.barcodes);
+    for (ARCS::IndexMultMap::const_iterator it = indexMultMap.begin(); it != indexMultMap.end(); ++it)
+        if (imap.slots.find(it->first) == imap.slots.end())
+            barcodes.push_back(it->first);
+    std::sort(barcodes.begin(), barcodes.end());
+
+    FILE* out;
+    #pragma omp critical(spill)
+    out = barcodeRuns.create(params.base_name);
+
+    ARCS::RecordWriter<ARCS::BarcodeRecord> w(out);
+    for (size_t i = 0; i < barcodes.size(); ++i) {
+        ARCS::BarcodeRecord r;
+        r.barcode = barcodes[i];
+        google::dense_hash_map<ARCS::Barcode, uint32_t, ARCS::KmerHash>::const_iterator s = imap.slots.find(r.barcode);
+        if (s != imap.slots.end()) {
+            const ARCS::ScafMap& ends = imap.ends[s->second];
+            for (size_t j = 0; j < ends.size(); ++j) {
+                r.contig = ends[j].contig;
+                r.head = ends[j].head;
+                r.tail = ends[j].tail;
+                w.push(r);
+            }
+        }
+        ARCS::IndexMultMap::const_iterator m = indexMultMap.find(r.barcode);
+        if (m != indexMultMap.end()) {
+            r.contig = ARCS::ContigTable::NO_CONTIG;
+            r.head = m->second;
+            r.tail = 0;
+            w.push(r);
+        }
+    }
+    if (!w.flush()) {
+        std::cerr << "Could not write the barcode counts to a temporary file next to "
+            << params.base_name << ". --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+    if (params.verbose) {
+        #pragma omp critical(cout)
+        std::cout << "Spilled " << barcodes.size() << " barcodes to disk" << std::endl;
+    }
+
+    ARCS::IndexMap().swap(imap);
+    ARCS::IndexMultMap().swap(indexMultMap);
+}
+
+/* Spill imap and indexMultMap once they use more than indexMapLimit bytes */
+void spillIfFull(ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap) {
+    if (indexMapLimit != 0 && imap.bytes() + indexMultMap.bytes() > indexMapLimit)
+        spillIndexMaps(imap, indexMultMap);
+}
+
+/* BamRegion: the alignments of reference tid of a BAM file that start in [beg, end), 0-based */
+struct BamRegion {
+    int32_t tid;
+    int64_t beg, end;
+};
+
+/*
+ * The regions of a coordinate-sorted BAM file whose alignments can be
+ * counted by countPair: the head and tail of each contig of at least
+ * min_size bp. A pair counts for the head when the average position of
+ * its reads is in the head, so its second read may start up to cutOff
+ * bp (or, in the mate buffer, mate_window bp) further in, and likewise
+ * for the tail. The head and tail of a short contig make one region.
+ */
+void endRegions(const std::vector<uint32_t>& refContigs, const std::vector<int32_t>& refLengths,
+        const ARCS::ContigTable& contigs, std::vector<BamRegion>& regions) {
+    for (size_t tid = 0; tid < refContigs.size(); ++tid) {
+        if (refContigs[tid] == ARCS::ContigTable::NO_CONTIG)
+            continue;
+        int64_t size = contigs.lengths[refContigs[tid]];
+        if (size < params.min_size)
+            continue;
+        int64_t cutOff = params.end_length;
+        if (cutOff == 0 || size <= cutOff * 2)
+            cutOff = size/2;
+        int64_t pad = std::min<int64_t>(cutOff, params.mate_window);
+        int64_t end = std::max<int64_t>(size, refLengths[tid]);
+
+        BamRegion head = { static_cast<int32_t>(tid), 0, cutOff + pad };
+        BamRegion tail = { static_cast<int32_t>(tid), std::max<int64_t>(size - cutOff - pad - 1, 0), end };
+        if (head.end >= tail.beg) {
+            head.end = end;
+            regions.push_back(head);
+        } else {
+            regions.push_back(head);
+            regions.push_back(tail);
+        }
+    }
+}
+
+/* True if rec comes before region r in a coordinate-sorted file; unmapped reads come last */
+bool beforeRegion(const BamRecord& rec, const BamRegion& r) {
+    uint32_t tid = static_cast<uint32_t>(rec.refID());
+    return tid < static_cast<uint32_t>(r.tid) || (tid == static_cast<uint32_t>(r.tid) && rec.pos() < r.beg);
+}
+
+/*
+ * With --ends-only, add the alignments of the contig ends of the
+ * coordinate-sorted BAM file in, seeking to each region through its
+ * index. When the next region starts where the last one stopped, it is
+ * read on without a seek.
+ */
+void readBAMRegions(BamReader& in, const BamIndex& index, const std::vector<uint32_t>& refContigs, ReadPairState& st,
+        ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, const ARCS::ContigTable& contigs) {
 
-/* Get all scaffold sizes from FASTA file */
-void getScaffSizes(std::string file, std::unordered_map<std::string, int>& sMap) {
+    std::vector<BamRegion> regions;
+    endRegions(refContigs, in.refLengths(), contigs, regions);
 
-    int counter = 0;
-    FastaReader in(file.c_str(), FastaReader::FOLD_CASE);
-    for (FastaRecord rec; in >> rec;) {
-        counter++;
-        std::string  scafName = rec.id;
-        int size = rec.seq.length();
-        //assert(sMap.count(scafName) == 0);
-        sMap[scafName] = size;
+    BamRecord rec;
+    ARCS::ReadAlignment aln;
+    int linecount = 0;
+    /* rec holds the first record not added yet */
+    bool have = false;
+    for (size_t i = 0; i < regions.size() && in.good(); ++i) {
+        const BamRegion& r = regions[i];
+        if (!have || beforeRegion(rec, r)) {
+            uint64_t voffset;
+            if (!index.offset(r.tid, r.beg, r.end, voffset))
+                continue;
+            if (!in.seek(voffset))
+                break;
+            have = in.next(rec);
+        }
+        for (; have && rec.refID() == r.tid && rec.pos() < r.end; have = in.next(rec)) {
+            if (rec.pos() < r.beg)
+                continue;
+            linecount++;
+            decodeAlignment(rec, refContigs, aln);
+            addAlignment(st, aln, imap, indexMultMap, contigs);
+            spillIfFull(imap, indexMultMap);
+            if (params.verbose && linecount % 10000000 == 0) {
+                #pragma omp critical(cout)
+                std::cout << "On line " << linecount << std::endl;
+            }
+        }
     }
-    
-    if (params.verbose)
-        std::cout << "Saw " << counter << " sequences.\n";
 }
 
 /* 
  * Read BAM file, if sequence identity greater than threashold
  * update indexMap. IndexMap also stores information about
  * contig number index algins with and counts.
+ * The file may be binary BAM or SAM text.
  */
-void readBAM(const std::string bamName, ARCS::IndexMap& imap, std::unordered_map<std::string, int>& indexMultMap, std::unordered_map<std::string, int> sMap) {
+void readBAM(const std::string bamName, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, const ARCS::ContigTable& contigs) {
 
-    /* Open BAM file */
-    std::ifstream bamName_stream;
-    bamName_stream.open(bamName.c_str());
-    if (!bamName_stream) {
-        std::cerr << "Could not open " << bamName << ". --fatal.\n";
+    if (BamReader::isCram(bamName)) {
+        std::cerr << bamName << " is a CRAM file, which is not supported. "
+            "Convert it to BAM with samtools view -b. --fatal.\n";
         exit(EXIT_FAILURE);
     }
 
-    std::string prevRN = "", readyToAddIndex = "", prevRef = "", readyToAddRefName = "";
-    int prevSI = 0, prevFlag = 0, prevMapq = 0, prevPos = -1, readyToAddPos = -1;
-    int ct = 1; 
-
-    std::string line;
+    ReadPairState st;
+    ARCS::ReadAlignment aln;
     int linecount = 0;
 
-    // Number of unpaired reads.
-    size_t countUnpaired = 0;
+    if (BamReader::isBam(bamName)) {
 
-    /* Read each line of the BAM file */
-    while (getline(bamName_stream, line)) {
-        
-        /* Check to make sure it is not the header */
-        if (line.substr(0, 1).compare("@") != 0) {
-            linecount++;
+        /* Open BAM file */
+        BamReader in(bamName);
+        if (!in.good()) {
+            std::cerr << "Could not read the BAM header of " << bamName << ". --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+
+        st.setSortOrder(headerSortOrder(in.headerText().data(), in.headerText().size()));
+
+        /* Resolve the reference names of the header to contig IDs once */
+        const std::vector<std::string>& refNames = in.refNames();
+        std::vector<uint32_t> refContigs(refNames.size());
+        for (size_t i = 0; i < refNames.size(); ++i)
+            refContigs[i] = contigs.find(refNames[i]);
 
-            std::stringstream ss(line);
-            std::string readName, scafName, cigar, rnext, seq, qual;
-            int flag, pos, mapq, pnext, tlen;
-
-            ss >> readName >> flag >> scafName >> pos >> mapq >> cigar
-                >> rnext >> pnext >> tlen >> seq >> qual;
-
-            /* If there are no numbers in name, will return 0 - ie "*" */
-            //scafName = getIntFromScafName(scafNameString);
-
-            /* Parse the index from the readName */
-            std::string index = "", readNameSpl = "";
-            std::size_t found = readName.find("_");
-            if (found!=std::string::npos)
-                readNameSpl = readName.substr(found+1);
-            if (checkIndex(readNameSpl))
-                index = readNameSpl;
-
-            /* Keep track of index multiplicity */
-            if (!index.empty())
-                indexMultMap[index]++;
-
-            /* Calculate the sequence identity */
-            int si = calcSequenceIdentity(line, cigar, seq);
-
-            if (ct == 2 && readName != prevRN) {
-                if (countUnpaired == 0)
-                    std::cerr << "Warning: Skipping an unpaired read. BAM file should be sorted in order of read name.\n"
-                        "  Prev read: " << prevRN << "\n"
-                        "  Curr read: " << readName << std::endl;
-                ++countUnpaired;
-                if (countUnpaired % 1000000 == 0)
-                    std::cerr << "Warning: Skipped " << countUnpaired << " unpaired reads." << std::endl;
-                ct = 1;
+        if (params.ends_only) {
+            BamIndex index;
+            if (!index.load(bamName)) {
+                std::cerr << "Cannot find a .bai or .csi index of " << bamName << " for --ends-only. --fatal.\n";
+                exit(EXIT_FAILURE);
             }
+            /* An indexed file is sorted by coordinate */
+            st.setSortOrder("coordinate");
+            readBAMRegions(in, index, refContigs, st, imap, indexMultMap, contigs);
+            if (!in.good()) {
+                std::cerr << "Truncated or corrupt BAM file " << bamName << ", or its index does not match it. --fatal.\n";
+                exit(EXIT_FAILURE);
+            }
+            warnSkipped(st);
+            return;
+        }
 
-            if (ct >= 3)
-                ct = 1;
-            if (ct == 1) {
-                if (readName.compare(prevRN) != 0) {
-                    prevRN = readName;
-                    prevSI = si;
-                    prevFlag = flag;
-                    prevMapq = mapq;
-                    prevRef = scafName;
-                    prevPos = pos;
-
-
-                    /* 
-                     * Read names are different so we can add the previous index and scafName as
-                     * long as there were only two mappings (one for each read)
-                     */
-                    if (!readyToAddIndex.empty() && !readyToAddRefName.empty() && readyToAddRefName.compare("*") != 0 && readyToAddPos != -1) {
-
-                        int size = sMap[readyToAddRefName];
-                        if (size >= params.min_size) {
-
-                           /* 
-                            * If length of sequence is less than 2 x end_length, split
-                            * the sequence in half to determing head/tail 
-                            */
-                           int cutOff = params.end_length;
-                           if (cutOff == 0 || size <= cutOff * 2)
-                               cutOff = size/2;
-
-                           /* 
-                            * pair <X, true> indicates read pair aligns to head,
-                            * pair <X, false> indicates read pair aligns to tail
-                            */
-                           std::pair<std::string, bool> key(readyToAddRefName, true);
-                           std::pair<std::string, bool> keyR(readyToAddRefName, false);
-
-                           /* Aligns to head */
-                           if (readyToAddPos <= cutOff) {
-                               imap[readyToAddIndex][key]++;
-
-                               if (imap[readyToAddIndex].count(keyR) == 0)
-                                   imap[readyToAddIndex][keyR] = 0;
-
-                            /* Aligns to tail */
-                           } else if (readyToAddPos > size - cutOff) {
-                               imap[readyToAddIndex][keyR]++;
-
-                               if (imap[readyToAddIndex].count(key) == 0)
-                                   imap[readyToAddIndex][key] = 0;
-                           }
+        /*
+         * Three stage pipeline over batches of BGZF blocks: this thread
+         * reads the compressed blocks of batch i+1, worker tasks inflate
+         * them and decode their records, while another task pairs the
+         * reads of batch i in file order.
+         */
+        std::vector<BgzfBlock> blocks(BAM_BATCH_BLOCKS);
+        std::vector<BamRecord> recs[2];
+        std::vector<ARCS::ReadAlignment> alns[2];
+        size_t nRecs[2] = { 0, 0 };
+        int cur = 0;
+        bool more = true, inflated = true;
+        do {
+            int next = 1 - cur;
+            #pragma omp parallel
+            #pragma omp single
+            {
+                /* Stage 3: pair the reads of the decoded batch in order */
+                #pragma omp task
+                for (size_t i = 0; i < nRecs[cur]; ++i) {
+                    linecount++;
+                    addAlignment(st, alns[cur][i], imap, indexMultMap, contigs);
+                    if (params.verbose && linecount % 10000000 == 0) {
+                        #pragma omp critical(cout)
+                        std::cout << "On line " << linecount << std::endl;
+                    }
+                }
 
-                        }
-                        readyToAddIndex = "";
-                        readyToAddRefName = "";
-                        readyToAddPos = -1;
+                /* Stage 1: read the next batch of compressed blocks */
+                size_t nBlocks = more ? in.readBlocks(blocks) : 0;
+                more = nBlocks > 0;
+
+                /* Stage 2: inflate the blocks and decode their records */
+                std::vector<char> ok(nBlocks, 1);
+                #pragma omp taskgroup
+                {
+                    for (size_t b = 0; b < nBlocks; ++b) {
+                        #pragma omp task shared(ok)
+                        ok[b] = blocks[b].inflate();
                     }
-                } else {
-                    ct = 0;
-                    readyToAddIndex = "";
-                    readyToAddRefName = "";
-                    readyToAddPos = -1;
                 }
-            } else if (ct == 2) {
-                assert(readName == prevRN);
-                if (!seq.empty() && checkFlag(flag) && checkFlag(prevFlag)
-                        && mapq != 0 && prevMapq != 0 && si >= params.seq_id && prevSI >= params.seq_id) {
-                    if (prevRef.compare(scafName) == 0 && scafName.compare("*") != 0 && !scafName.empty() && !index.empty()) {
-                            
-                        readyToAddIndex = index;
-                        readyToAddRefName = scafName;
-                        /* Take average read alignment position between read pairs */
-                        readyToAddPos = (prevPos + pos)/2;
+                /* A malformed block stops readBlocks with in.good() false */
+                inflated = in.good() && std::find(ok.begin(), ok.end(), 0) == ok.end();
+                nRecs[next] = inflated ? in.splitRecords(blocks, nBlocks, recs[next]) : 0;
+                if (alns[next].size() < nRecs[next])
+                    alns[next].resize(nRecs[next]);
+                #pragma omp taskgroup
+                {
+                    for (size_t i = 0; i < nRecs[next]; i += BAM_DECODE_CHUNK) {
+                        #pragma omp task
+                        {
+                            size_t end = std::min(i + BAM_DECODE_CHUNK, nRecs[next]);
+                            for (size_t j = i; j < end; ++j)
+                                decodeAlignment(recs[next][j], refContigs, alns[next][j]);
+                        }
                     }
                 }
             }
-           ct++; 
+            cur = next;
+            spillIfFull(imap, indexMultMap);
+        } while ((more || nRecs[cur] > 0) && inflated && in.good());
+
+        if (!inflated) {
+            std::cerr << "Corrupt BGZF block in " << bamName << ". --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+        if (!in.good()) {
+            std::cerr << "Truncated or corrupt BAM record in " << bamName << ". --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
 
-            if (params.verbose && linecount % 10000000 == 0)
+    } else {
+
+        if (params.ends_only) {
+            std::cerr << bamName << " is not a BAM file, which --ends-only needs. --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+
+        std::string scafName;
+        st.setSortOrder("");
+        auto addLine = [&](const char* line, size_t len) {
+            /* Check to make sure it is not the header */
+            if (len == 0 || line[0] == '@') {
+                if (linecount == 0 && len > 3 && memcmp(line, "@HD", 3) == 0)
+                    st.setSortOrder(headerSortOrder(line, len));
+                return;
+            }
+            linecount++;
+
+            decodeSamLine(line, len, contigs, scafName, aln);
+            addAlignment(st, aln, imap, indexMultMap, contigs);
+            spillIfFull(imap, indexMultMap);
+
+            if (params.verbose && linecount % 10000000 == 0) {
+                #pragma omp critical(cout)
                 std::cout << "On line " << linecount << std::endl;
+            }
+        };
+
+        /* Pass each complete line in [p, end) to addLine, return the start of the rest */
+        auto addLines = [&](const char* p, const char* end) {
+            const char* nl;
+            while ((nl = static_cast<const char*>(memchr(p, '\n', end - p))) != NULL) {
+                addLine(p, nl - p);
+                p = nl + 1;
+            }
+            return p;
+        };
+
+        /* With --mmap, scan an uncompressed SAM file in place */
+        if (params.mmap) {
+            MappedFile map(bamName.c_str());
+            if (map.good() && !map.isGzip()) {
+                const char* end = map.data() + map.size();
+                const char* p = addLines(map.data(), end);
+                /* Last line without a newline */
+                if (p != end)
+                    addLine(p, end - p);
+                warnSkipped(st);
+                return;
+            }
+        }
 
+        /* Open SAM file */
+        gzFile fp = gzopen(bamName.c_str(), "r");
+        if (fp == NULL) {
+            std::cerr << "Could not open " << bamName << ". --fatal.\n";
+            exit(EXIT_FAILURE);
         }
-        assert(bamName_stream);
-    }
 
-    /* Close BAM file */
-    bamName_stream.close();
+        /*
+         * Read the SAM file in large chunks and split it into lines in
+         * place; a line cut at the end of a chunk is moved to the front
+         * of the buffer before the next read.
+         */
+        std::vector<char> buf(SAM_BUFFER_SIZE);
+        size_t have = 0;
+        for (;;) {
+            if (have == buf.size())
+                buf.resize(buf.size() * 2);
+            int n = gzread(fp, &buf[have], buf.size() - have);
+            if (n < 0) {
+                std::cerr << "Could not read " << bamName << ". --fatal.\n";
+                exit(EXIT_FAILURE);
+            }
+            have += n;
+            const char* end = &buf[0] + have;
+            const char* p = addLines(&buf[0], end);
+            if (n == 0) {
+                /* Last line without a newline */
+                if (p != end)
+                    addLine(p, end - p);
+                break;
+            }
+            have = end - p;
+            memmove(&buf[0], p, have);
+        }
+
+        /* Close SAM file */
+        gzclose(fp);
+    }
 
-    if (countUnpaired > 0)
-        std::cerr << "Warning: Skipped " << countUnpaired << " unpaired reads. BAM file should be sorted in order of read name.\n";
+    warnSkipped(st);
 }
 
-/* 
- * Reading each BAM file from fofName
+/*
+ * Add the counts of a partial IndexMap and index multiplicity map,
+ * filled from a subset of the BAM files, into imap and indexMultMap.
+ * The partial maps are emptied.
  */
-void readBAMS(const std::string& fofName, ARCS::IndexMap& imap, std::unordered_map<std::string, int>& indexMultMap, std::unordered_map<std::string, int> sMap) {
+void mergeIndexMaps(ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, ARCS::IndexMap& partial, ARCS::IndexMultMap& partialMult) {
+
+    ARCS::ScafMap merged;
+    for (size_t i = 0; i < partial.size(); ++i) {
+        ARCS::ScafMap& src = partial.ends[i];
+        ARCS::ScafMap& dst = imap[partial.barcodes[i]];
+        if (dst.empty()) {
+            dst.swap(src);
+            imap.nEnds += dst.size();
+            continue;
+        }
+
+        /* Merge the two lists of end counts sorted by contig ID */
+        merged.clear();
+        ARCS::ScafMap::const_iterator a = dst.begin(), b = src.begin();
+        while (a != dst.end() || b != src.end()) {
+            if (b == src.end() || (a != dst.end() && a->contig < b->contig)) {
+                merged.push_back(*a++);
+            } else if (a == dst.end() || b->contig < a->contig) {
+                merged.push_back(*b++);
+            } else {
+                merged.push_back(*a++);
+                merged.back().head += b->head;
+                merged.back().tail += b->tail;
+                ++b;
+            }
+        }
+        imap.nEnds += merged.size() - dst.size();
+        dst.assign(merged.begin(), merged.end());
+    }
+    ARCS::IndexMap().swap(partial);
+
+    for (auto it = partialMult.begin(); it != partialMult.end(); ++it)
+        indexMultMap[it->first] += it->second;
+    ARCS::IndexMultMap().swap(partialMult);
+}
+
+/* Read the file names listed one per line in fofName */
+std::vector<std::string> readFileNames(const std::string& fofName) {
 
     std::ifstream fofName_stream(fofName.c_str());
     if (!fofName_stream) {
@@ -433,14 +1252,307 @@ void readBAMS(const std::string& fofName, ARCS::IndexMap& imap, std::unordered_m
         exit(EXIT_FAILURE);
     }
 
-    std::string bamName;
-    while (getline(fofName_stream, bamName)) {
-        if (params.verbose)
-            std::cout << "Reading bam " << bamName << std::endl;
-        readBAM(bamName, imap, indexMultMap, sMap);
+    std::vector<std::string> names;
+    std::string name;
+    while (getline(fofName_stream, name)) {
+        names.push_back(name);
         assert(fofName_stream);
     }
     fofName_stream.close();
+    return names;
+}
+
+/*
+ * Call readFile(name, imap, indexMultMap) for each file of names. With
+ * more than one thread, the files are read concurrently into per-thread
+ * maps that are merged once all files have been read. With --mem-limit,
+ * the maps share the limit and are spilled to barcodeRuns when full.
+ */
+template<typename ReadFile>
+void readFiles(const std::vector<std::string>& names, const char* what, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, ReadFile readFile) {
+
+    int nFileThreads = std::min(params.threads, static_cast<int>(names.size()));
+    indexMapLimit = params.mem_limit / std::max(1, nFileThreads);
+    if (nFileThreads <= 1) {
+        for (unsigned i = 0; i < names.size(); i++) {
+            if (params.verbose)
+                std::cout << "Reading " << what << " " << names[i] << std::endl;
+            readFile(names[i], imap, indexMultMap);
+        }
+        return;
+    }
+
+    std::vector<ARCS::IndexMap> partial(nFileThreads);
+    std::vector<ARCS::IndexMultMap> partialMult(nFileThreads);
+
+#if _OPENMP
+    /* Threads left over after one per file work within a file */
+    omp_set_max_active_levels(2);
+#endif
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(nFileThreads)
+    for (unsigned i = 0; i < names.size(); i++) {
+        int tid = 0;
+#if _OPENMP
+        tid = omp_get_thread_num();
+        omp_set_num_threads(std::max(1, params.threads / nFileThreads));
+#endif
+        if (params.verbose) {
+            #pragma omp critical(cout)
+            std::cout << "Reading " << what << " " << names[i] << std::endl;
+        }
+        readFile(names[i], partial[tid], partialMult[tid]);
+    }
+
+    size_t bytes = 0;
+    for (int t = 0; t < nFileThreads; t++)
+        bytes += partial[t].bytes() + partialMult[t].bytes();
+    bool spill = params.mem_limit != 0 && (!barcodeRuns.empty() || bytes > params.mem_limit);
+    for (int t = 0; t < nFileThreads; t++) {
+        if (spill)
+            spillIndexMaps(partial[t], partialMult[t]);
+        else
+            mergeIndexMaps(imap, indexMultMap, partial[t], partialMult[t]);
+    }
+}
+
+/* 
+ * Reading each BAM file from fofName. With more than one thread, the
+ * files are read concurrently, and the threads left over decompress
+ * the blocks of each file in parallel.
+ */
+void readBAMS(const std::string& fofName, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, const ARCS::ContigTable& contigs) {
+    readFiles(readFileNames(fofName), "bam", imap, indexMultMap,
+        [&](const std::string& bamName, ARCS::IndexMap& fileImap, ARCS::IndexMultMap& fileMult) {
+            readBAM(bamName, fileImap, fileMult, contigs);
+        });
+}
+
+/* Number of reads mapped to the contig ends per batch */
+static const size_t READ_BATCH_SIZE = 1 << 16;
+
+/* One read of a linked-read file, with its name stripped of /1 or /2 */
+struct LinkedRead {
+    std::string name;
+    std::string seq;
+    ARCS::Barcode barcode;
+    LinkedRead() : barcode(0) {}
+
+    void swap(LinkedRead& o) {
+        name.swap(o.name);
+        seq.swap(o.seq);
+        std::swap(barcode, o.barcode);
+    }
+};
+
+/* Counts of one linked-read file */
+struct LinkedReadStats {
+    size_t reads, fragments, mapped;
+    // Number of reads with an index longer than MAX_BARCODE_LEN.
+    size_t countLongIndex;
+    LinkedReadStats() : reads(0), fragments(0), mapped(0), countLongIndex(0) {}
+};
+
+/*
+ * Fill read from a FASTQ record. The index is taken from a BX:Z: tag
+ * in the comment, dropping its -1 suffix (10x Genomics), or else from
+ * the read name in the format read1_indexA, as for the alignments.
+ */
+void parseLinkedRead(const kseq& rec, LinkedRead& read, LinkedReadStats& stats) {
+
+    read.name.assign(rec.name);
+    size_t n = read.name.length();
+    if (n > 2 && read.name[n - 2] == '/' && (read.name[n - 1] == '1' || read.name[n - 1] == '2'))
+        read.name.resize(n - 2);
+    read.seq.assign(rec.seq);
+
+    const char* index = NULL;
+    size_t len = 0;
+    size_t found = rec.comment.find("BX:Z:");
+    if (found != std::string::npos) {
+        index = rec.comment.data() + found + 5;
+        len = strcspn(index, "- \t");
+    } else if ((found = read.name.find("_")) != std::string::npos) {
+        index = read.name.data() + found + 1;
+        len = read.name.length() - found - 1;
+    }
+    read.barcode = encodeBarcode(index, len);
+    if (len > MAX_BARCODE_LEN) {
+        if (stats.countLongIndex == 0)
+            std::cerr << "Warning: Skipping reads with an index longer than " << MAX_BARCODE_LEN << " bp.\n"
+                "  Read: " << rec.name << std::endl;
+        ++stats.countLongIndex;
+    }
+}
+
+/*
+ * Find the contig end that the k-mers of the reads of one fragment
+ * (a read pair) hit most often. Returns ARCS::NO_CONTIG_END unless it
+ * is hit at least min_kmer_hits times and more often than any other end.
+ * hits is scratch space.
+ */
+template<typename KMap>
+ARCS::ContigEnd mapFragment(const LinkedRead* begin, const LinkedRead* end, const KMap& kmap,
+        std::vector<std::pair<ARCS::ContigEnd, int>>& hits) {
+
+    typedef typename KMap::key_type K;
+
+    hits.clear();
+    for (const LinkedRead* r = begin; r != end; ++r) {
+        forEachCanonicalKmer<K>(r->seq.data(), r->seq.length(), params.k_value, 1,
+            [&](K kmer) {
+                typename KMap::const_iterator it = kmap.find(kmer);
+                if (it == kmap.end() || it->second == ARCS::NO_CONTIG_END)
+                    return;
+                size_t i = 0;
+                while (i < hits.size() && hits[i].first != it->second)
+                    ++i;
+                if (i == hits.size())
+                    hits.push_back(std::make_pair(it->second, 0));
+                hits[i].second++;
+            });
+    }
+
+    ARCS::ContigEnd best = ARCS::NO_CONTIG_END;
+    int bestHits = 0, secondHits = 0;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        if (hits[i].second > bestHits) {
+            secondHits = bestHits;
+            bestHits = hits[i].second;
+            best = hits[i].first;
+        } else if (hits[i].second > secondHits) {
+            secondHits = hits[i].second;
+        }
+    }
+    return bestHits >= params.min_kmer_hits && bestHits > secondHits ? best : ARCS::NO_CONTIG_END;
+}
+
+/*
+ * Map the reads of ks to the contig ends of kmap and count each read
+ * pair, the consecutive reads with the same name, against the head or
+ * tail it maps to in imap, as readBAM does for an aligned pair. Reads
+ * are mapped in parallel in batches of READ_BATCH_SIZE.
+ */
+template<typename KStream, typename KMap>
+void mapLinkedReads(KStream& ks, const std::string& fileName, const KMap& kmap, ARCS::IndexMap& imap,
+        ARCS::IndexMultMap& indexMultMap, LinkedReadStats& stats) {
+
+    std::vector<LinkedRead> batch(READ_BATCH_SIZE);
+    std::vector<size_t> fragStart;
+    std::vector<ARCS::ContigEnd> mapped;
+    kseq rec;
+    size_t n = 0;
+    bool more = true;
+    while (more) {
+        for (; n < batch.size(); ++n) {
+            int l = ks.read(rec);
+            if (l == -2) {
+                std::cerr << "Truncated FASTQ record " << rec.name << " in " << fileName << ". --fatal.\n";
+                exit(EXIT_FAILURE);
+            }
+            if (l < 0) {
+                more = false;
+                break;
+            }
+            parseLinkedRead(rec, batch[n], stats);
+        }
+
+        /* Split the batch into fragments, holding back the last one while its mate may follow */
+        fragStart.clear();
+        for (size_t i = 0; i < n; ++i)
+            if (i == 0 || batch[i].name != batch[i - 1].name)
+                fragStart.push_back(i);
+        size_t nFrags = fragStart.size();
+        if (more && nFrags > 1)
+            --nFrags;
+        else
+            fragStart.push_back(n);
+        size_t done = fragStart[nFrags];
+
+        mapped.resize(nFrags);
+        #pragma omp parallel
+        {
+            std::vector<std::pair<ARCS::ContigEnd, int>> hits;
+            #pragma omp for schedule(dynamic, 256)
+            for (size_t f = 0; f < nFrags; ++f) {
+                const LinkedRead* begin = &batch[fragStart[f]];
+                const LinkedRead* end = begin + (fragStart[f + 1] - fragStart[f]);
+                mapped[f] = begin->barcode == 0 ? ARCS::NO_CONTIG_END : mapFragment(begin, end, kmap, hits);
+            }
+        }
+
+        for (size_t f = 0; f < nFrags; ++f) {
+            ARCS::Barcode index = batch[fragStart[f]].barcode;
+            if (index != 0)
+                indexMultMap[index] += fragStart[f + 1] - fragStart[f];
+            if (mapped[f] != ARCS::NO_CONTIG_END) {
+                countEnd(imap, index, mapped[f] >> 1, mapped[f] & 1);
+                stats.mapped++;
+            }
+        }
+        stats.reads += done;
+        stats.fragments += nFrags;
+        progress.add(done);
+        spillIfFull(imap, indexMultMap);
+
+        for (size_t i = done; i < n; ++i)
+            batch[i - done].swap(batch[i]);
+        n -= done;
+    }
+}
+
+/*
+ * Map the reads of one FASTQ (or FASTA) file, which may be gzipped, to
+ * the contig ends. With --mmap, an uncompressed file is memory-mapped
+ * and parsed in place.
+ */
+template<typename KMap>
+void readLinkedReads(const std::string& fileName, const KMap& kmap, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap) {
+
+    LinkedReadStats stats;
+    bool mapped = false;
+    if (params.mmap) {
+        MappedFile map(fileName.c_str());
+        if (map.good() && !map.isGzip()) {
+            kstream<const MappedFile*, FunctorMmap> ks(map.data(), map.size());
+            mapLinkedReads(ks, fileName, kmap, imap, indexMultMap, stats);
+            mapped = true;
+        }
+    }
+    if (!mapped) {
+        gzFile fp = gzopen(fileName.c_str(), "r");
+        if (fp == NULL) {
+            std::cerr << "Could not open " << fileName << ". --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+        FunctorZlib gzr;
+        kstream<gzFile, FunctorZlib> ks(fp, gzr);
+        mapLinkedReads(ks, fileName, kmap, imap, indexMultMap, stats);
+        gzclose(fp);
+    }
+
+    if (stats.countLongIndex > 0)
+        std::cerr << "Warning: Skipped " << stats.countLongIndex << " reads with an index longer than " << MAX_BARCODE_LEN << " bp.\n";
+    #pragma omp critical(metrics)
+    {
+        metrics.add("records", stats.reads);
+        metrics.add("read_pairs", stats.fragments);
+        metrics.add("read_pairs_mapped", stats.mapped);
+        metrics.add("reads_long_index", stats.countLongIndex);
+    }
+    if (params.verbose) {
+        #pragma omp critical(cout)
+        std::cout << fileName << ": " << stats.reads << " reads, " << stats.fragments << " read pairs, "
+            << stats.mapped << " mapped to a contig end" << std::endl;
+    }
+}
+
+/* Map each linked-read file listed in fofName to the contig ends of kmap */
+template<typename KMap>
+void readLinkedReadFiles(const std::string& fofName, const KMap& kmap, ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap) {
+    readFiles(readFileNames(fofName), "reads", imap, indexMultMap,
+        [&](const std::string& fileName, ARCS::IndexMap& fileImap, ARCS::IndexMultMap& fileMult) {
+            readLinkedReads(fileName, kmap, fileImap, fileMult);
+        });
 }
 
 /* Normal approximation to the binomial distribution */
@@ -450,19 +1562,85 @@ float normalEstimation(int x, float p, int n) {
     return 0.5 * (1 + std::erf((x - mean)/(sd * std::sqrt(2))));
 }
 
+/* Exact upper tail P(X >= x) of the binomial distribution with p = 0.5 */
+double binomialTail(int x, int n) {
+    if (x <= 0)
+        return 1;
+    if (x > n)
+        return 0;
+    /* Sum the shorter side, starting from its largest term */
+    if (2 * x <= n)
+        return 1 - binomialTail(n - x + 1, n);
+    double term = std::exp(std::lgamma(n + 1.0) - std::lgamma(x + 1.0) - std::lgamma(n - x + 1.0) - n * std::log(2.0));
+    double sum = 0;
+    for (int k = x; k <= n && term > sum * 1e-17; ++k) {
+        sum += term;
+        term *= double(n - k) / (k + 1);
+    }
+    return sum;
+}
+
+/*
+ * One-sided test of x successes out of n trials against p = 0.5 at
+ * the significance level of -r, by the normal approximation or, with
+ * --binomial, exactly. For n below TABLE_SIZE the smallest passing x
+ * is found once (the test is monotone in x), so that testing is a
+ * lookup; larger n are tested directly.
+ */
+class SignificanceTable {
+  public:
+    static const int TABLE_SIZE = 1 << 16;
+
+    SignificanceTable(float p, bool exact) : m_p(p), m_exact(exact), m_minX(TABLE_SIZE) {
+        for (int n = 0; n < TABLE_SIZE; ++n) {
+            /* No x passes the normal test beyond a z-score of 10 unless all do */
+            int hi = exact ? n + 1 : n / 2 + static_cast<int>(std::ceil(10 * std::sqrt(n * 0.5))) + 1;
+            if (!test(hi, n)) {
+                m_minX[n] = INT_MAX;
+                continue;
+            }
+            /* The smallest passing x moves little from one n to the next */
+            int x = n > 0 ? std::min(m_minX[n - 1], hi) : hi;
+            while (x > 0 && test(x - 1, n))
+                --x;
+            while (!test(x, n))
+                ++x;
+            m_minX[n] = x;
+        }
+    }
+
+    /* True if x out of n is significantly more than half */
+    bool passes(int x, int n) const {
+        if (n < TABLE_SIZE)
+            return x >= m_minX[n];
+        return test(x, n);
+    }
+
+  private:
+    bool test(int x, int n) const {
+        if (m_exact)
+            return binomialTail(x, n) < m_p;
+        float normalCdf = normalEstimation(x, 0.5, n);
+        return (1 - normalCdf < m_p);
+    }
+
+    float m_p;
+    bool m_exact;
+    std::vector<int> m_minX;
+};
+
 /*
  * Based on number of read pairs that align to the 
  * head or tail of scaffold, determine if is significantly 
  * different from a uniform distribution (p=0.5)
  */
-std::pair<bool, bool> headOrTail(int head, int tail) {
+std::pair<bool, bool> headOrTail(int head, int tail, int minReads, const SignificanceTable& sig) {
     int max = std::max(head, tail);
     int sum = head + tail;
-    if (sum < params.min_reads) {
+    if (sum < minReads) {
         return std::pair<bool, bool> (false, false);
     }
-    float normalCdf = normalEstimation(max, 0.5, sum);
-    if (1 - normalCdf < params.error_percent) {
+    if (sig.passes(max, sum)) {
         bool isHead = (max == head);
         return std::pair<bool, bool> (true, isHead);
     } else {
@@ -470,73 +1648,428 @@ std::pair<bool, bool> headOrTail(int head, int tail) {
     }
 }
 
+/* Number of barcodes in each shard handed to a pairing thread */
+static const int PAIR_SHARD_SIZE = 1024;
+
+/* A contig of one barcode, the end its read pairs align to and their number */
+struct ResolvedEnd {
+    uint32_t contig;
+    bool isHead;
+    int reads;
+};
+
+/*
+ * Resolve the end of each contig in [begin, end) with headOrTail, and
+ * list the contigs with a significant end in valid, in order.
+ */
+void resolveEnds(const ARCS::EndCount* begin, const ARCS::EndCount* end, std::vector<ResolvedEnd>& valid, int minReads, const SignificanceTable& sig) {
+    valid.clear();
+    for (const ARCS::EndCount* it = begin; it != end; ++it) {
+        bool isValid, isHead;
+        std::tie(isValid, isHead) = headOrTail(it->head, it->tail, minReads, sig);
+        if (isValid) {
+            ResolvedEnd r = { it->contig, isHead, it->head + it->tail };
+            valid.push_back(r);
+        }
+    }
+}
+
+/*
+ * The barcodes of an IndexMap as pairContigs reads them: barcode i
+ * has multiplicity multiplicity(i), from indexMultMap, and the end
+ * counts begin(i) to end(i). IndexFile has the same interface.
+ */
+struct IndexMapBarcodes {
+    const ARCS::IndexMap& imap;
+    const ARCS::IndexMultMap& indexMultMap;
+
+    IndexMapBarcodes(const ARCS::IndexMap& imap, const ARCS::IndexMultMap& indexMultMap)
+        : imap(imap), indexMultMap(indexMultMap) {}
+
+    size_t size() const { return imap.size(); }
+    int multiplicity(size_t i) const {
+        ARCS::IndexMultMap::const_iterator mult = indexMultMap.find(imap.barcodes[i]);
+        return mult == indexMultMap.end() ? 0 : mult->second;
+    }
+    const ARCS::EndCount* begin(size_t i) const { return imap.ends[i].data(); }
+    const ARCS::EndCount* end(size_t i) const { return imap.ends[i].data() + imap.ends[i].size(); }
+};
+
+/* Barcodes first to first + n - 1 of barcodes, with the same interface */
+template<typename Barcodes>
+struct BarcodeRange {
+    const Barcodes& barcodes;
+    size_t first, n;
+
+    BarcodeRange(const Barcodes& barcodes, size_t first, size_t n) : barcodes(barcodes), first(first), n(n) {}
+
+    size_t size() const { return n; }
+    int multiplicity(size_t i) const { return barcodes.multiplicity(first + i); }
+    const ARCS::EndCount* begin(size_t i) const { return barcodes.begin(first + i); }
+    const ARCS::EndCount* end(size_t i) const { return barcodes.end(first + i); }
+};
+
+/* Records of each run buffered by a RunMerger, with runs runs of records of size bytes */
+size_t mergeBufferRecords(size_t runs, size_t size) {
+    size_t n = params.mem_limit / 8 / std::max(runs, size_t(1)) / size;
+    return std::min(std::max(n, size_t(1024)), size_t(1) << 16);
+}
+
+/*
+ * The barcodes of barcodeRuns in increasing order, read back in
+ * batches by fill(). Each batch has the interface of IndexMapBarcodes.
+ */
+class MergedBarcodes {
+  public:
+    explicit MergedBarcodes(const ARCS::SortedRuns<ARCS::BarcodeRecord>& runs)
+        : m_merger(runs, mergeBufferRecords(runs.size(), sizeof(ARCS::BarcodeRecord))) {
+        m_more = m_merger.next(m_next);
+    }
+
+    /*
+     * Replace the batch with the next barcodes, at least one, until the
+     * pairs of contigs they could link reach maxPairs. Returns false
+     * once all barcodes have been read.
+     */
+    bool fill(size_t maxPairs) {
+        m_barcodes.clear();
+        m_mult.clear();
+        m_ends.clear();
+        m_offsets.assign(1, 0);
+        size_t pairs = 0;
+        while (m_more && (m_barcodes.empty() || pairs < maxPairs)) {
+            ARCS::Barcode b = m_next.barcode;
+            m_barcodes.push_back(b);
+            m_mult.push_back(0);
+            for (; m_more && m_next.barcode == b; m_more = m_merger.next(m_next)) {
+                if (m_next.contig == ARCS::ContigTable::NO_CONTIG) {
+                    m_mult.back() += m_next.head;
+                    continue;
+                }
+                if (m_ends.size() == m_offsets.back() || m_ends.back().contig != m_next.contig)
+                    m_ends.push_back(ARCS::EndCount(m_next.contig));
+                m_ends.back().head += m_next.head;
+                m_ends.back().tail += m_next.tail;
+            }
+            size_t n = m_ends.size() - m_offsets.back();
+            pairs += n * (n - 1) / 2;
+            m_offsets.push_back(m_ends.size());
+        }
+        if (!m_merger.good()) {
+            std::cerr << "Could not read back the barcode counts spilled to disk. --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+        return !m_barcodes.empty();
+    }
+
+    size_t size() const { return m_barcodes.size(); }
+    ARCS::Barcode barcode(size_t i) const { return m_barcodes[i]; }
+    int multiplicity(size_t i) const { return m_mult[i]; }
+    const ARCS::EndCount* begin(size_t i) const { return m_ends.data() + m_offsets[i]; }
+    const ARCS::EndCount* end(size_t i) const { return m_ends.data() + m_offsets[i + 1]; }
+
+  private:
+    ARCS::RunMerger<ARCS::BarcodeRecord> m_merger;
+    ARCS::BarcodeRecord m_next;
+    bool m_more;
+    std::vector<ARCS::Barcode> m_barcodes;
+    std::vector<int> m_mult;
+    std::vector<size_t> m_offsets;
+    std::vector<ARCS::EndCount> m_ends;
+};
+
+/*
+ * Add the link counts of partial into pmap. partial is emptied.
+ */
+void mergePairMaps(ARCS::PairMap& pmap, ARCS::PairMap& partial) {
+    if (pmap.empty()) {
+        pmap.swap(partial);
+        return;
+    }
+    for (auto it = partial.begin(); it != partial.end(); ++it) {
+        std::pair<ARCS::PairMap::iterator, bool> ins = pmap.insert(*it);
+        if (!ins.second)
+            for (int k = 0; k < 4; ++k)
+                ins.first->second[k] += it->second[k];
+    }
+    ARCS::PairMap().swap(partial);
+}
+
 /* 
- * Iterate through IndexMap and for every pair of scaffolds
+ * Iterate through the barcodes and for every pair of scaffolds
  * that align to the same index, store in PairMap. PairMap 
- * is a map with a key of pairs of saffold names, and value
+ * is a hash table with a key of pairs of contig IDs, and value
  * of number of links between the pair. (Each link is one index).
+ * Shards of barcodes are paired by separate threads into their
+ * own PairMaps, which are added together at the end.
  */
-void pairContigs(ARCS::IndexMap& imap, ARCS::PairMap& pmap, std::unordered_map<std::string, int>& indexMultMap) {
-
-    /* Iterate through each index in IndexMap */
-    for(auto it = imap.begin(); it != imap.end(); ++it) {
+template<typename Barcodes>
+void pairContigs(const Barcodes& barcodes, ARCS::PairMap& pmap, const SignificanceTable& sig) {
+
+    std::vector<ARCS::PairMap> partial(params.threads);
+    size_t dropped = 0;
+
+    #pragma omp parallel num_threads(params.threads)
+    {
+        int tid = 0;
+#if _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        ARCS::PairMap& local = partial[tid];
+
+        /* Contigs of the barcode with a resolved end */
+        std::vector<ResolvedEnd> valid;
+
+        /* Iterate through each index */
+        #pragma omp for schedule(dynamic, PAIR_SHARD_SIZE) reduction(+:dropped)
+        for (long i = 0; i < static_cast<long>(barcodes.size()); ++i) {
+
+            int indexMult = barcodes.multiplicity(i);
+            if (indexMult < params.min_mult || indexMult > params.max_mult) {
+                ++dropped;
+                continue;
+            }
 
-        /* Get index multiplicity from indexMultMap */
-        std::string index = it->first;
-        int indexMult = indexMultMap[index];
+            resolveEnds(barcodes.begin(i), barcodes.end(i), valid, params.min_reads, sig);
+
+            /* 
+             * Link every pair of valid contigs. The contigs are sorted,
+             * so scafA < scafB and each pair is inserted once.
+             */
+            for (size_t o = 0; o < valid.size(); ++o) {
+                for (size_t p = o + 1; p < valid.size(); ++p) {
+                    ARCS::PairCounts& count = local.insert(std::make_pair(ARCS::PairMap::key(valid[o].contig, valid[p].contig), ARCS::PairCounts())).first->second;
+                    /* 0-HH, 1-HT, 2-TH, 3-TT */
+                    count[(!valid[o].isHead << 1) | !valid[p].isHead]++;
+                }
+            }
+        }
+    }
 
-        if (indexMult >= params.min_mult && indexMult <= params.max_mult) {
+    for (size_t t = 0; t < partial.size(); ++t)
+        mergePairMaps(pmap, partial[t]);
 
-           /* Iterate through all the scafNames in ScafMap */ 
-            for (auto o = it->second.begin(); o != it->second.end(); ++o) {
-                for (auto p = it->second.begin(); p != it->second.end(); ++p) {
-                    std::string scafA, scafB;
-                    bool scafAflag, scafBflag;
-                    std::tie (scafA, scafAflag) = o->first;
-                    std::tie (scafB, scafBflag) = p->first;
+    metrics.add("barcodes_kept", barcodes.size() - dropped);
+    metrics.add("barcodes_dropped_multiplicity", dropped);
+}  
 
-                    /* Only insert into pmap if scafA < scafB to avoid duplicates */
-                    if (scafA < scafB && scafAflag && scafBflag) {
-                        bool validA, validB, scafAhead, scafBhead;
+/* One combination of the thresholds of sweep mode */
+struct SweepSetting {
+    int minMult, maxMult;
+    float r;
+    int c, l;
+};
 
-                        std::tie(validA, scafAhead) = headOrTail(it->second[std::pair<std::string, bool>(scafA, true)], it->second[std::pair<std::string, bool>(scafA, false)]);
-                        std::tie(validB, scafBhead) = headOrTail(it->second[std::pair<std::string, bool>(scafB, true)], it->second[std::pair<std::string, bool>(scafB, false)]);
+/* 
+ * Pair the contigs of each barcode for every combination of the -m, -r
+ * and -c values of sweep mode in one pass. pmaps[(m * nR + r) * nC + c]
+ * receives the links of m range m, p-value r and c value c. Each link
+ * of a barcode and p-value counts towards every -c value that is at most
+ * the number of read pairs of either contig.
+ */
+template<typename Barcodes>
+void sweepPairContigs(const Barcodes& barcodes, std::vector<ARCS::PairMap>& pmaps,
+        const std::vector<std::pair<int, int>>& ms, const std::vector<SignificanceTable>& sigs, const std::vector<int>& cs) {
+
+    size_t nR = sigs.size(), nC = cs.size();
+    int minC = *std::min_element(cs.begin(), cs.end());
+    std::vector<std::vector<ARCS::PairMap>> partial(params.threads, std::vector<ARCS::PairMap>(pmaps.size()));
+    size_t dropped = 0;
+
+    #pragma omp parallel num_threads(params.threads)
+    {
+        int tid = 0;
+#if _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        std::vector<ARCS::PairMap>& local = partial[tid];
+        std::vector<ResolvedEnd> valid;
+        std::vector<size_t> inRange;
+
+        #pragma omp for schedule(dynamic, PAIR_SHARD_SIZE) reduction(+:dropped)
+        for (long i = 0; i < static_cast<long>(barcodes.size()); ++i) {
+
+            int indexMult = barcodes.multiplicity(i);
+            inRange.clear();
+            for (size_t m = 0; m < ms.size(); ++m)
+                if (indexMult >= ms[m].first && indexMult <= ms[m].second)
+                    inRange.push_back(m);
+            if (inRange.empty()) {
+                ++dropped;
+                continue;
+            }
 
-                        if (validA && validB) {
-                            std::pair<std::string, std::string> pair (scafA, scafB);
-                            if (pmap.count(pair) == 0) {
-                                std::vector<int> init(4,0); 
-                                pmap[pair] = init;
+            for (size_t r = 0; r < nR; ++r) {
+                resolveEnds(barcodes.begin(i), barcodes.end(i), valid, minC, sigs[r]);
+                for (size_t o = 0; o < valid.size(); ++o) {
+                    for (size_t p = o + 1; p < valid.size(); ++p) {
+                        uint64_t key = ARCS::PairMap::key(valid[o].contig, valid[p].contig);
+                        int reads = std::min(valid[o].reads, valid[p].reads);
+                        int orientation = (!valid[o].isHead << 1) | !valid[p].isHead;
+                        for (size_t m = 0; m < inRange.size(); ++m) {
+                            for (size_t c = 0; c < nC; ++c) {
+                                if (cs[c] > reads)
+                                    continue;
+                                ARCS::PairMap& pmap = local[(inRange[m] * nR + r) * nC + c];
+                                pmap.insert(std::make_pair(key, ARCS::PairCounts())).first->second[orientation]++;
                             }
-                            // Head - Head
-                            if (scafAhead && scafBhead)
-                                pmap[pair][0]++;
-                            // Head - Tail
-                            else if (scafAhead && !scafBhead)
-                                pmap[pair][1]++;
-                            // Tail - Head
-                            else if (!scafAhead && scafBhead)
-                                pmap[pair][2]++;
-                            // Tail - Tail
-                            else if (!scafAhead && !scafBhead)
-                                pmap[pair][3]++;
                         }
                     }
                 }
             }
         }
     }
-}  
+
+    for (size_t t = 0; t < partial.size(); ++t)
+        for (size_t k = 0; k < pmaps.size(); ++k)
+            mergePairMaps(pmaps[k], partial[t][k]);
+
+    /* A barcode is kept if any -m range of the sweep keeps it */
+    metrics.add("barcodes_kept", barcodes.size() - dropped);
+    metrics.add("barcodes_dropped_multiplicity", dropped);
+}
+
+/*
+ * The link counts of one or more combinations of thresholds, one
+ * PairMap each. With --mem-limit, once the PairMaps together use
+ * more than half the limit, each is written to a new sorted run of
+ * its own and emptied.
+ */
+struct PairTables {
+    std::vector<ARCS::PairMap> pmaps;
+    std::vector<ARCS::SortedRuns<ARCS::PairRecord>> runs;
+
+    explicit PairTables(size_t n) : pmaps(n), runs(n) {}
+
+    /* True if any PairMap has been spilled */
+    bool spilled() const {
+        for (size_t k = 0; k < runs.size(); ++k)
+            if (!runs[k].empty())
+                return true;
+        return false;
+    }
+
+    void spillIfFull() {
+        size_t bytes = 0;
+        for (size_t k = 0; k < pmaps.size(); ++k)
+            bytes += pmaps[k].bytes();
+        if (params.mem_limit != 0 && bytes > params.mem_limit / 2)
+            spill();
+    }
+
+    /* Write each non-empty PairMap to a new run, sorted by key */
+    void spill() {
+        std::vector<uint64_t> keys;
+        for (size_t k = 0; k < pmaps.size(); ++k) {
+            if (pmaps[k].empty())
+                continue;
+            keys.clear();
+            for (ARCS::PairMap::const_iterator it = pmaps[k].begin(); it != pmaps[k].end(); ++it)
+                keys.push_back(it->first);
+            std::sort(keys.begin(), keys.end());
+
+            ARCS::RecordWriter<ARCS::PairRecord> w(runs[k].create(params.base_name));
+            for (size_t i = 0; i < keys.size(); ++i) {
+                ARCS::PairRecord r = { keys[i], pmaps[k].find(keys[i])->second };
+                w.push(r);
+            }
+            if (!w.flush()) {
+                std::cerr << "Could not write the link counts to a temporary file next to "
+                    << params.base_name << ". --fatal.\n";
+                exit(EXIT_FAILURE);
+            }
+            if (params.verbose)
+                std::cout << "Spilled " << keys.size() << " contig pairs to disk" << std::endl;
+            ARCS::PairMap().swap(pmaps[k]);
+        }
+    }
+
+    /* Once all barcodes are paired, spill the rest if anything was spilled */
+    void finish() {
+        if (spilled())
+            spill();
+    }
+};
+
+/* Estimated bytes of the link counts of one pair of contigs while pairing */
+static const size_t PAIR_BYTES = 64;
+
+/* Most pairs of contigs to link in one batch of barcodes with --mem-limit */
+size_t maxBatchPairs() {
+    return std::max(params.mem_limit / 4 / PAIR_BYTES, size_t(1));
+}
+
+/* Pairs a batch of barcodes into one PairMap, for buildGraph */
+struct PairBatch {
+    ARCS::PairMap& pmap;
+    const SignificanceTable& sig;
+
+    PairBatch(ARCS::PairMap& pmap, const SignificanceTable& sig) : pmap(pmap), sig(sig) {}
+
+    template<typename Barcodes>
+    void operator()(const Barcodes& barcodes) const { pairContigs(barcodes, pmap, sig); }
+};
+
+/* Pairs a batch of barcodes into the PairMaps of sweep mode */
+struct SweepPairBatch {
+    std::vector<ARCS::PairMap>& pmaps;
+    const std::vector<std::pair<int, int>>& ms;
+    const std::vector<SignificanceTable>& sigs;
+    const std::vector<int>& cs;
+
+    SweepPairBatch(std::vector<ARCS::PairMap>& pmaps, const std::vector<std::pair<int, int>>& ms,
+            const std::vector<SignificanceTable>& sigs, const std::vector<int>& cs)
+        : pmaps(pmaps), ms(ms), sigs(sigs), cs(cs) {}
+
+    template<typename Barcodes>
+    void operator()(const Barcodes& barcodes) const { sweepPairContigs(barcodes, pmaps, ms, sigs, cs); }
+};
+
+/*
+ * Pair the barcodes with pairBatch into tables. With --mem-limit, the
+ * barcodes are paired in batches, and tables is spilled between them
+ * when full.
+ */
+template<typename Barcodes, typename PairFn>
+void pairBatches(Barcodes& barcodes, PairTables& tables, PairFn pairBatch) {
+    if (params.mem_limit == 0) {
+        pairBatch(barcodes);
+        return;
+    }
+    size_t maxPairs = maxBatchPairs();
+    for (size_t first = 0; first < barcodes.size();) {
+        size_t last = first, pairs = 0;
+        for (; last < barcodes.size() && (last == first || pairs < maxPairs); ++last) {
+            size_t n = barcodes.end(last) - barcodes.begin(last);
+            pairs += n * (n - 1) / 2;
+        }
+        pairBatch(BarcodeRange<Barcodes>(barcodes, first, last - first));
+        tables.spillIfFull();
+        first = last;
+    }
+    tables.finish();
+}
+
+/* Pair the barcodes spilled to disk, reading them back one batch at a time */
+template<typename PairFn>
+void pairBatches(MergedBarcodes& barcodes, PairTables& tables, PairFn pairBatch) {
+    size_t maxPairs = maxBatchPairs();
+    while (barcodes.fill(maxPairs)) {
+        pairBatch(barcodes);
+        tables.spillIfFull();
+    }
+    tables.finish();
+}
 
 /*
  * Return the max value and its index position
  * in the vector
  */
-std::pair<int, int> getMaxValueAndIndex(const std::vector<int> array) {
+std::pair<int, int> getMaxValueAndIndex(const ARCS::PairCounts& array) {
     int max = 0;
     int index = 0;
     for (int i = 0; i < int(array.size()); i++) {
-        if (array[i] > max) {
+        if (int(array[i]) > max) {
             max = array[i];
             index = i;
         }
@@ -550,117 +2083,360 @@ std::pair<int, int> getMaxValueAndIndex(const std::vector<int> array) {
  * Return true if the link orientation with the max support
  * is dominant
  */
-bool checkSignificance(int max, int second) {
-    if (max < params.min_links) {
+bool checkSignificance(int max, int second, int minLinks, const SignificanceTable& sig) {
+    if (max < minLinks) {
         return false;
     }
-    float normalCdf = normalEstimation(max, 0.5, second);
-    return (1 - normalCdf < params.error_percent);
+    return sig.passes(max, second);
 }
 
 /*
- * Construct a boost graph from PairMap. Each pair represents an
- * edge in the graph. The weight of each edge is the number of links
- * between the scafNames.
- * VidVdes is a mapping of vertex descriptors to scafNames (vertex id).
+ * Fill the CSR adjacency of g from its edge list.
  */
-void createGraph(const ARCS::PairMap& pmap, ARCS::Graph& g) {
-
-    ARCS::VidVdesMap vmap;
+void buildAdjacency(ARCS::CompactGraph& g) {
+    size_t n = g.numVertices();
+    g.offsets.assign(n + 1, 0);
+    for (size_t e = 0; e < g.edges.size(); ++e) {
+        g.offsets[g.edges[e].u + 1]++;
+        g.offsets[g.edges[e].v + 1]++;
+    }
+    for (size_t v = 0; v < n; ++v)
+        g.offsets[v + 1] += g.offsets[v];
+
+    std::vector<size_t> next(g.offsets.begin(), g.offsets.end() - 1);
+    g.adj.resize(g.offsets[n]);
+    for (size_t e = 0; e < g.edges.size(); ++e) {
+        g.adj[next[g.edges[e].u]++] = e;
+        g.adj[next[g.edges[e].v]++] = e;
+    }
+    g.removed.assign(n, 0);
+}
 
-    ARCS::PairMap::const_iterator it;
-    for(it = pmap.begin(); it != pmap.end(); ++it) {
-        std::string scaf1, scaf2;
-        std::tie (scaf1, scaf2) = it->first;
+/* No vertex yet for a contig, in the vmap of createGraph */
+static const uint32_t NO_VERTEX = 0xffffffff;
 
-        int max, index;
-        std::vector<int> count = it->second;
-        std::tie(max, index) = getMaxValueAndIndex(count);
+/*
+ * Add the edge of one pair of contigs to g if the orientation with
+ * the most links is dominant, adding the contigs to g and to vmap,
+ * a mapping of contig IDs to vertices, if new.
+ */
+void addPairEdge(uint64_t key, const ARCS::PairCounts& count, ARCS::CompactGraph& g, std::vector<uint32_t>& vmap,
+        int minLinks, const SignificanceTable& sig) {
 
-        int second = 0;
-        for (int i = 0; i < int(count.size()); i++) {
-            if (count[i] != max && count[i] > second)
-                second = count[i];
-        }
+    uint32_t scaf1 = ARCS::PairMap::first(key), scaf2 = ARCS::PairMap::second(key);
 
-        /* Only insert edge if orientation with max links is dominant */
-        if (checkSignificance(max, second)) {
+    int max, index;
+    std::tie(max, index) = getMaxValueAndIndex(count);
 
-            /* If scaf1 is not a node in the graph, add it */
-            if (vmap.count(scaf1) == 0) {
-                ARCS::Graph::vertex_descriptor v = boost::add_vertex(g);
-                g[v].id = scaf1;
-                vmap[scaf1] = v;
-            }
+    int second = 0;
+    for (int i = 0; i < int(count.size()); i++) {
+        if (int(count[i]) != max && int(count[i]) > second)
+            second = count[i];
+    }
 
-            /* If scaf2 is not a node in the graph, add it */
-            if (vmap.count(scaf2) == 0) {
-                ARCS::Graph::vertex_descriptor v = boost::add_vertex(g);
-                g[v].id = scaf2;
-                vmap[scaf2] = v;
-            }
+    /* Only insert edge if orientation with max links is dominant */
+    if (checkSignificance(max, second, minLinks, sig)) {
 
-            ARCS::Graph::edge_descriptor e;
-            bool inserted;
+        /* If scaf1 is not a node in the graph, add it */
+        if (vmap[scaf1] == NO_VERTEX) {
+            vmap[scaf1] = g.ids.size();
+            g.ids.push_back(scaf1);
+        }
 
-            /* Add the edge representing the pair */
-            std::tie (e, inserted) = boost::add_edge(vmap[scaf1], vmap[scaf2], g);
-            if (inserted) {
-                g[e].weight = max;
-                g[e].orientation = index;
-            }
+        /* If scaf2 is not a node in the graph, add it */
+        if (vmap[scaf2] == NO_VERTEX) {
+            vmap[scaf2] = g.ids.size();
+            g.ids.push_back(scaf2);
         }
+
+        /* Add the edge representing the pair */
+        ARCS::CompactGraph::Edge e;
+        e.u = vmap[scaf1];
+        e.v = vmap[scaf2];
+        e.prop.weight = max;
+        e.prop.orientation = index;
+        g.edges.push_back(e);
     }
+}
+
+/*
+ * Construct the scaffold graph from PairMap. Each pair represents an
+ * edge in the graph. The weight of each edge is the number of links
+ * between the contigs. Pairs are added in order of contig IDs, so that
+ * the graph does not depend on the order of the hash table.
+ */
+void createGraph(const ARCS::PairMap& pmap, size_t nContigs, ARCS::CompactGraph& g, int minLinks, const SignificanceTable& sig) {
+
+    std::vector<uint32_t> vmap(nContigs, NO_VERTEX);
+
+    std::vector<uint64_t> keys;
+    keys.reserve(pmap.size());
+    for (ARCS::PairMap::const_iterator it = pmap.begin(); it != pmap.end(); ++it)
+        keys.push_back(it->first);
+    std::sort(keys.begin(), keys.end());
+
+    for (size_t k = 0; k < keys.size(); ++k)
+        addPairEdge(keys[k], pmap.find(keys[k])->second, g, vmap, minLinks, sig);
+    buildAdjacency(g);
+    metrics.add("contig_pairs", keys.size());
 } 
 
-/* 
- * Write out the boost graph in a .dot file.
+/*
+ * Construct the scaffold graph from the link counts spilled to runs,
+ * adding up the counts of each pair of contigs in a k-way merge. The
+ * graph is the same as from a PairMap of all the counts.
  */
-void writeGraph(const std::string& graphFile_dot, ARCS::Graph& g) {
-    std::ofstream out(graphFile_dot.c_str());
-    assert(out);
+void createGraph(const ARCS::SortedRuns<ARCS::PairRecord>& runs, size_t nContigs, ARCS::CompactGraph& g, int minLinks, const SignificanceTable& sig) {
+
+    std::vector<uint32_t> vmap(nContigs, NO_VERTEX);
+
+    ARCS::RunMerger<ARCS::PairRecord> merger(runs, mergeBufferRecords(runs.size(), sizeof(ARCS::PairRecord)));
+    ARCS::PairRecord r, next;
+    size_t nPairs = 0;
+    bool more = merger.next(next);
+    while (more) {
+        r = next;
+        while ((more = merger.next(next)) && next.sameKey(r))
+            for (int k = 0; k < 4; ++k)
+                r.counts[k] += next.counts[k];
+        addPairEdge(r.key, r.counts, g, vmap, minLinks, sig);
+        ++nPairs;
+    }
+    if (!merger.good()) {
+        std::cerr << "Could not read back the link counts spilled to disk. --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+    buildAdjacency(g);
+    metrics.add("contig_pairs", nPairs);
+}
 
-    boost::dynamic_properties dp;
-    dp.property("id", get(&ARCS::VertexProperties::id, g));
-    dp.property("weight", get(&ARCS::EdgeProperties::weight, g));
-    dp.property("label", get(&ARCS::EdgeProperties::orientation, g));
-    dp.property("node_id", get(boost::vertex_index, g));
-    boost::write_graphviz_dp(out, g, dp);
-    assert(out);
+/*
+ * Construct the graph of the link counts of table k of tables, from
+ * its PairMap or, if spilled, its runs.
+ */
+void createGraph(const PairTables& tables, size_t k, size_t nContigs, ARCS::CompactGraph& g, int minLinks, const SignificanceTable& sig) {
+    if (tables.runs[k].empty())
+        createGraph(tables.pmaps[k], nContigs, g, minLinks, sig);
+    else
+        createGraph(tables.runs[k], nContigs, g, minLinks, sig);
+}
 
-    out.close();
+/*
+ * Copy the vertices and edges of g that have not been removed
+ * into the boost graph out, in the same order.
+ */
+void toBoostGraph(const ARCS::CompactGraph& g, ARCS::Graph& out) {
+    ARCS::VidVdesMap vmap(g.numVertices(), ARCS::Graph::null_vertex());
+    for (size_t v = 0; v < g.numVertices(); ++v) {
+        if (g.removed[v])
+            continue;
+        vmap[v] = boost::add_vertex(out);
+        out[vmap[v]].id = g.ids[v];
+    }
+    for (size_t e = 0; e < g.edges.size(); ++e) {
+        if (!g.hasEdge(e))
+            continue;
+        ARCS::Graph::edge_descriptor ed;
+        bool inserted;
+        std::tie (ed, inserted) = boost::add_edge(vmap[g.edges[e].u], vmap[g.edges[e].v], out);
+        if (inserted)
+            out[ed] = g.edges[e].prop;
+    }
 }
 
+/* Size of the output buffer of GraphWriter */
+static const size_t GRAPH_BUFFER_SIZE = 1 << 20;
 
-/* 
- * Remove all nodes from graph wich have a degree
- * greater than max_degree
+/*
+ * Buffered writer for the graph files. Output is formatted
+ * into a buffer that is written out in large blocks.
  */
-void removeDegreeNodes(ARCS::Graph& g, int max_degree) {
+class GraphWriter {
+  public:
+    GraphWriter(const std::string& path) : m_path(path), m_out(fopen(path.c_str(), "w")) {
+        if (m_out == NULL) {
+            std::cerr << "Could not open " << path << " for writing. --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+        m_buf.reserve(GRAPH_BUFFER_SIZE + 4096);
+    }
 
-    boost::graph_traits<ARCS::Graph>::vertex_iterator vi, vi_end, next;
-    boost::tie(vi, vi_end) = boost::vertices(g);
+    ~GraphWriter() { close(); }
 
-    std::vector<ARCS::VertexDes> dVertex;
-    for (next = vi; vi != vi_end; vi = next) {
-        ++next;
-        if (static_cast<int>(boost::degree(*vi, g)) > max_degree) {
-            dVertex.push_back(*vi);
+    GraphWriter& operator<<(const char* str) {
+        m_buf.append(str);
+        return check();
+    }
+
+    GraphWriter& operator<<(const std::string& str) {
+        m_buf.append(str);
+        return check();
+    }
+
+    GraphWriter& operator<<(char c) {
+        m_buf.push_back(c);
+        return check();
+    }
+
+    GraphWriter& operator<<(uint64_t x) {
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = '0' + x % 10;
+            x /= 10;
+        } while (x != 0);
+        while (n > 0)
+            m_buf.push_back(digits[--n]);
+        return check();
+    }
+
+    void close() {
+        if (m_out == NULL)
+            return;
+        flush();
+        if (fclose(m_out) != 0)
+            fail();
+        m_out = NULL;
+    }
+
+  private:
+    GraphWriter& check() {
+        if (m_buf.size() >= GRAPH_BUFFER_SIZE)
+            flush();
+        return *this;
+    }
+
+    void flush() {
+        if (fwrite(m_buf.data(), 1, m_buf.size(), m_out) != m_buf.size())
+            fail();
+        m_buf.clear();
+    }
+
+    void fail() {
+        std::cerr << "Could not write " << m_path << ". --fatal.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    std::string m_path;
+    FILE* m_out;
+    std::string m_buf;
+};
+
+/* Letter or underscore of a GraphViz identifier, as boost matches it in the C locale */
+static inline bool isDotIdStart(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool isDigit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+/*
+ * Quote a GraphViz ID the way boost::write_graphviz does: IDs that
+ * do not match boost's regex of unquoted IDs,
+ *   ^([a-zA-Z_][a-zA-Z_0-9]*|-?([.][0-9]*|[0-9]+([.][0-9]*)?))$
+ * are put in double quotes, with their double quotes escaped.
+ * Bytes \200-\377 are not letters to boost, so such IDs are quoted.
+ */
+std::string escapeDotString(const std::string& id) {
+    size_t i = 0, n = id.size();
+    bool valid = false;
+    if (n > 0 && isDotIdStart(id[0])) {
+        for (i = 1; i < n && (isDotIdStart(id[i]) || isDigit(id[i])); ++i) {}
+        valid = i == n;
+    } else {
+        if (i < n && id[i] == '-')
+            ++i;
+        size_t digits = i;
+        for (; i < n && isDigit(id[i]); ++i) {}
+        /* Digits, a point, or both */
+        bool number = i > digits;
+        if (i < n && id[i] == '.') {
+            number = true;
+            for (++i; i < n && isDigit(id[i]); ++i) {}
         }
+        valid = number && i == n;
+    }
+    if (valid)
+        return id;
+
+    std::string quoted("\"");
+    for (i = 0; i < n; ++i) {
+        if (id[i] == '"')
+            quoted.push_back('\\');
+        quoted.push_back(id[i]);
+    }
+    quoted.push_back('"');
+    return quoted;
+}
+
+/* 
+ * Write out the graph in a .dot file, naming each vertex by its
+ * contig name. The format is that of boost::write_graphviz_dp
+ * with the id, label and weight properties, and the vertices
+ * that have not been removed are numbered from 0.
+ */
+void writeGraph(const std::string& graphFile_dot, const ARCS::CompactGraph& g, const ARCS::ContigTable& contigs) {
+    GraphWriter out(graphFile_dot);
+
+    std::vector<uint32_t> index(g.numVertices());
+    uint32_t nextIndex = 0;
+
+    out << "graph G {\n";
+    for (size_t v = 0; v < g.numVertices(); ++v) {
+        if (g.removed[v])
+            continue;
+        index[v] = nextIndex++;
+        out << uint64_t(index[v]) << " [id=" << escapeDotString(contigs.names[g.ids[v]]) << "];\n";
     }
+    for (size_t e = 0; e < g.edges.size(); ++e) {
+        if (!g.hasEdge(e))
+            continue;
+        const ARCS::CompactGraph::Edge& edge = g.edges[e];
+        out << uint64_t(index[edge.u]) << "--" << uint64_t(index[edge.v])
+            << "  [label=" << uint64_t(edge.prop.orientation)
+            << ", weight=" << uint64_t(edge.prop.weight) << "];\n";
+    }
+    out << "}\n";
+    out.close();
+}
+
+/*
+ * Write out the graph as a tab-separated list of edges:
+ * contigA, contigB, orientation (HH, HT, TH or TT) and weight.
+ */
+void writeTSV(const std::string& tsvFile, const ARCS::CompactGraph& g, const ARCS::ContigTable& contigs) {
+    static const char* const ORIENTATION[] = { "HH", "HT", "TH", "TT" };
+    GraphWriter out(tsvFile);
+    for (size_t e = 0; e < g.edges.size(); ++e) {
+        if (!g.hasEdge(e))
+            continue;
+        const ARCS::CompactGraph::Edge& edge = g.edges[e];
+        out << contigs.names[g.ids[edge.u]] << '\t' << contigs.names[g.ids[edge.v]]
+            << '\t' << ORIENTATION[edge.prop.orientation]
+            << '\t' << uint64_t(edge.prop.weight) << '\n';
+    }
+    out.close();
+}
+
 
-    for (unsigned i = 0; i < dVertex.size(); i++) {
-        boost::clear_vertex(dVertex[i], g);
-        boost::remove_vertex(dVertex[i], g);
+/* 
+ * Remove all nodes from graph wich have a degree
+ * greater than max_degree. The degrees are those
+ * before any node is removed.
+ */
+void removeDegreeNodes(ARCS::CompactGraph& g, int max_degree) {
+    for (uint32_t v = 0; v < g.numVertices(); ++v) {
+        if (static_cast<int>(g.degree(v)) > max_degree)
+            g.removed[v] = 1;
     }
-    boost::renumber_indices(g);
 }
 
 /* 
  * Remove nodes that have a degree greater than max_degree
  * Write graph
  */
-void writePostRemovalGraph(ARCS::Graph& g, const std::string graphFile) {
+void writePostRemovalGraph(ARCS::CompactGraph& g, const std::string graphFile, const std::string tsvFile, const ARCS::ContigTable& contigs) {
     if (params.max_degree != 0) {
         std::cout << "      Deleting nodes with degree > " << params.max_degree <<"... \n";
         removeDegreeNodes(g, params.max_degree);
@@ -668,11 +2444,170 @@ void writePostRemovalGraph(ARCS::Graph& g, const std::string graphFile) {
         std::cout << "      Max Degree (-d) set to: " << params.max_degree << ". Will not delete any verticies from graph.\n";
     }
 
+    size_t written = 0;
+    for (size_t e = 0; e < g.edges.size(); ++e)
+        written += g.hasEdge(e);
+    metrics.add("edges", g.edges.size());
+    metrics.add("edges_written", written);
+
     std::cout << "      Writting graph file to " << graphFile << "...\n";
-    writeGraph(graphFile, g);
+    writeGraph(graphFile, g, contigs);
+
+    if (params.tsv) {
+        std::cout << "      Writting edge list to " << tsvFile << "...\n";
+        writeTSV(tsvFile, g, contigs);
+    }
+}
+
+
+/*
+ * Read the contig file and the alignments, or with --reads the linked
+ * reads, into imap and indexMultMap. The k-mers of the contig ends are
+ * only needed to map the linked reads.
+ */
+void readAlignments(ARCS::IndexMap& imap, ARCS::IndexMultMap& indexMultMap, ARCS::ContigTable& contigs) {
+
+    // initialize ContigKMap (k <= 32) or LongContigKMap (k > 32)
+    ARCS::ContigKMap kmap; 
+    ARCS::LongContigKMap longKmap; 
+    bool storeKmers = !params.reads.empty();
+
+    std::time_t rawtime;
+
+    // Read contig file once: record scaffold sizes, shred sequences into k-mers, and then map them 
+    time(&rawtime); 
+    metrics.beginStage("contigs");
+    if (storeKmers)
+        std::cout << "\n=>Storing Kmers from Contig ends and scaffold sizes... " << ctime(&rawtime); 
+    else
+        std::cout << "\n=>Storing scaffold sizes... " << ctime(&rawtime); 
+    if (params.k_value <= 32)
+        getContigKmers(params.file, kmap, params.k_value, params.k_shift, contigs, storeKmers); 
+    else
+        getContigKmers(params.file, longKmap, params.k_value, params.k_shift, contigs, storeKmers); 
+
+    if (storeKmers) {
+        time(&rawtime);
+        std::cout << "\n=>Starting to map linked reads to contig ends... " << ctime(&rawtime);
+        metrics.beginStage("linked_reads");
+        progress.start("Mapping linked reads", params.progress);
+        if (params.k_value <= 32)
+            readLinkedReadFiles(params.reads, kmap, imap, indexMultMap);
+        else
+            readLinkedReadFiles(params.reads, longKmap, imap, indexMultMap);
+        return;
+    }
+
+    time(&rawtime);
+    std::cout << "\n=>Starting to read BAM files... " << ctime(&rawtime);
+    metrics.beginStage("alignments");
+    progress.start("Reading alignments", params.progress);
+    readBAMS(params.fofName, imap, indexMultMap, contigs);
+}
+
+/*
+ * Pair the contigs of each barcode, and create and write the graph.
+ */
+template<typename Barcodes>
+void buildGraph(Barcodes& barcodes, const ARCS::ContigTable& contigs, const std::string& graphFile, const std::string& tsvFile) {
+
+    PairTables tables(1);
+    ARCS::CompactGraph g;
+
+    std::time_t rawtime;
+
+    time(&rawtime);
+    std::cout << "\n=>Starting pairing of scaffolds... " << ctime(&rawtime);
+    metrics.beginStage("pairing");
+    SignificanceTable sig(params.error_percent, params.binomial);
+    pairBatches(barcodes, tables, PairBatch(tables.pmaps[0], sig));
+
+    time(&rawtime);
+    std::cout << "\n=>Starting to create graph... " << ctime(&rawtime);
+    metrics.beginStage("graph");
+    createGraph(tables, 0, contigs.size(), g, params.min_links, sig);
+
+    time(&rawtime);
+    std::cout << "\n=>Starting to write graph file... " << ctime(&rawtime) << "\n";
+    metrics.beginStage("write");
+    writePostRemovalGraph(g, graphFile, tsvFile, contigs);
+}
+
+/*
+ * Sweep mode: pair the contigs of each barcode once for every
+ * combination of the swept -c, -l, -r and -m values, and create
+ * and write a graph for each combination.
+ */
+template<typename Barcodes>
+void sweepGraphs(Barcodes& barcodes, const ARCS::ContigTable& contigs) {
+
+    std::vector<int> cs = params.sweep_c.empty() ? std::vector<int>(1, params.min_reads) : params.sweep_c;
+    std::vector<int> ls = params.sweep_l.empty() ? std::vector<int>(1, params.min_links) : params.sweep_l;
+    std::vector<float> rs = params.sweep_r.empty() ? std::vector<float>(1, params.error_percent) : params.sweep_r;
+    std::vector<std::pair<int, int>> ms = params.sweep_m.empty()
+        ? std::vector<std::pair<int, int>>(1, std::make_pair(params.min_mult, params.max_mult)) : params.sweep_m;
+
+    std::time_t rawtime;
+
+    std::vector<SignificanceTable> sigs;
+    for (size_t r = 0; r < rs.size(); ++r)
+        sigs.push_back(SignificanceTable(rs[r], params.binomial));
+
+    time(&rawtime);
+    std::cout << "\n=>Starting pairing of scaffolds for " << ms.size() * rs.size() * cs.size()
+        << " combinations of -m, -r and -c... " << ctime(&rawtime);
+    metrics.beginStage("pairing");
+    PairTables tables(ms.size() * rs.size() * cs.size());
+    pairBatches(barcodes, tables, SweepPairBatch(tables.pmaps, ms, sigs, cs));
+
+    for (size_t m = 0; m < ms.size(); ++m) {
+        for (size_t r = 0; r < rs.size(); ++r) {
+            for (size_t c = 0; c < cs.size(); ++c) {
+                size_t k = (m * rs.size() + r) * cs.size() + c;
+                for (size_t l = 0; l < ls.size(); ++l) {
+                    std::ostringstream name;
+                    name << params.base_name << "_c" << cs[c] << "_l" << ls[l] << "_r" << rs[r]
+                        << "_m" << ms[m].first << "-" << ms[m].second;
+
+                    time(&rawtime);
+                    std::cout << "\n=>Creating and writing graph " << name.str() << "... " << ctime(&rawtime);
+                    metrics.beginStage("graph " + name.str());
+                    ARCS::CompactGraph g;
+                    createGraph(tables, k, contigs.size(), g, ls[l], sigs[r]);
+                    writePostRemovalGraph(g, name.str() + "_original.gv", name.str() + "_original.tsv", contigs);
+                }
+                ARCS::PairMap().swap(tables.pmaps[k]);
+            }
+        }
+    }
+}
+
+/* Format a list of option values as a comma-separated list */
+template<typename T>
+std::string listString(const std::vector<T>& list) {
+    std::ostringstream ss;
+    for (size_t i = 0; i < list.size(); ++i)
+        ss << (i > 0 ? "," : "") << list[i];
+    return ss.str();
+}
+
+std::string listString(const std::vector<std::pair<int, int>>& list) {
+    std::ostringstream ss;
+    for (size_t i = 0; i < list.size(); ++i)
+        ss << (i > 0 ? "," : "") << list[i].first << "-" << list[i].second;
+    return ss.str();
 }
 
+/* True if any of the --sweep options was given */
+bool sweepMode() {
+    return !params.sweep_c.empty() || !params.sweep_l.empty() || !params.sweep_r.empty() || !params.sweep_m.empty();
+}
 
+/*
+ * Read the contigs and alignments, or with --load-index a snapshot
+ * of them, and build the graph. With --save-index, a snapshot is
+ * written once the alignments have been read.
+ */
 void runArcs() {
 
     std::cout << "Running: " << PROGRAM << " " << VERSION 
@@ -691,52 +2626,184 @@ void runArcs() {
         << "\n -d " << params.max_degree 
         << "\n -e " << params.end_length
         << "\n -r " << params.error_percent
-        << "\n -v " << params.verbose << "\n";
+        << "\n -t " << params.threads
+        << "\n -v " << params.verbose
+        << "\n --mmap " << params.mmap
+        << "\n --binomial " << params.binomial
+        << "\n --tsv " << params.tsv
+        << "\n --save-index " << params.saveIndex
+        << "\n --load-index " << params.loadIndex
+        << "\n --mem-limit " << params.mem_limit
+        << "\n --mate-buffer " << params.mate_buffer
+        << "\n --mate-window " << params.mate_window
+        << "\n --ends-only " << params.ends_only
+        << "\n --progress " << params.progress;
+    if (!params.reads.empty())
+        std::cout
+            << "\n --reads " << params.reads
+            << "\n --min-kmer-hits " << params.min_kmer_hits;
+    if (sweepMode())
+        std::cout
+            << "\n --sweep-c " << listString(params.sweep_c)
+            << "\n --sweep-l " << listString(params.sweep_l)
+            << "\n --sweep-r " << listString(params.sweep_r)
+            << "\n --sweep-m " << listString(params.sweep_m);
+    std::cout << "\n";
 
     std::string graphFile = params.base_name + "_original.gv";
+    std::string tsvFile = params.base_name + "_original.tsv";
 
-    // initialize ContigKMap
-    ARCS::ContigKMap kmap; 
-    kmap.set_deleted_key(NULL); 
-
-    ARCS::IndexMap imap;
-    ARCS::PairMap pmap;
-    ARCS::Graph g;
-
+    ARCS::ContigTable contigs; 
     std::time_t rawtime;
 
-    // Read contig file, shred sequences into k-mers, and then map them 
-    time(&rawtime); 
-    std::cout << "\n=>Storing Kmers from Contig ends... " << ctime(&rawtime); 
-    getContigKmers(params.file, kmap, params.k_value, params.k_shift); 
+    if (!params.loadIndex.empty()) {
+        time(&rawtime);
+        std::cout << "\n=>Loading index " << params.loadIndex << "... " << ctime(&rawtime);
+        metrics.beginStage("load_index");
+        ARCS::IndexFile index(params.loadIndex);
+        if (!index.good()) {
+            std::cerr << params.loadIndex << " is not an index written by --save-index of this version. --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+        const ARCS::IndexFileHeader& hdr = index.header();
+        if (hdr.seq_id != params.seq_id || hdr.min_size != params.min_size || hdr.end_length != params.end_length) {
+            std::cerr << params.loadIndex << " was written with -s " << hdr.seq_id << " -z " << hdr.min_size
+                << " -e " << hdr.end_length << ", which must not change. --fatal.\n";
+            exit(EXIT_FAILURE);
+        }
+        index.loadContigs(contigs);
+        if (sweepMode())
+            sweepGraphs(index, contigs);
+        else
+            buildGraph(index, contigs, graphFile, tsvFile);
+    } else {
+        ARCS::IndexMap imap;
+        ARCS::IndexMultMap indexMultMap;
+        readAlignments(imap, indexMultMap, contigs);
+
+        /* With --mem-limit, the counts may have been spilled to disk */
+        bool spilled = !barcodeRuns.empty();
+        if (spilled)
+            spillIndexMaps(imap, indexMultMap);
+
+        if (!params.saveIndex.empty()) {
+            time(&rawtime);
+            std::cout << "\n=>Writing index " << params.saveIndex << "... " << ctime(&rawtime);
+            metrics.beginStage("save_index");
+            ARCS::IndexFileHeader options = ARCS::IndexFileHeader();
+            options.seq_id = params.seq_id;
+            options.min_size = params.min_size;
+            options.end_length = params.end_length;
+            bool ok;
+            if (spilled) {
+                ARCS::IndexFileWriter out(params.saveIndex, contigs, options);
+                MergedBarcodes merged(barcodeRuns);
+                while (merged.fill(maxBatchPairs()))
+                    for (size_t i = 0; i < merged.size(); ++i)
+                        out.add(merged.barcode(i), merged.multiplicity(i), merged.begin(i), merged.end(i));
+                ok = out.close();
+            } else {
+                ok = ARCS::saveIndex(params.saveIndex, imap, indexMultMap, contigs, options);
+            }
+            if (!ok) {
+                std::cerr << "Could not write " << params.saveIndex << ". --fatal.\n";
+                exit(EXIT_FAILURE);
+            }
+        }
 
+        if (spilled) {
+            MergedBarcodes barcodes(barcodeRuns);
+            if (sweepMode())
+                sweepGraphs(barcodes, contigs);
+            else
+                buildGraph(barcodes, contigs, graphFile, tsvFile);
+        } else {
+            IndexMapBarcodes barcodes(imap, indexMultMap);
+            if (sweepMode())
+                sweepGraphs(barcodes, contigs);
+            else
+                buildGraph(barcodes, contigs, graphFile, tsvFile);
+        }
+    }
 
-    std::unordered_map<std::string, int> scaffSizeMap;
-    time(&rawtime);
-    std::cout << "\n=>Getting scaffold sizes... " << ctime(&rawtime);
-    getScaffSizes(params.file, scaffSizeMap);
+    std::string metricsFile = params.base_name + "_metrics.json";
+    std::ostringstream threads;
+    threads << params.threads;
+    std::vector<std::pair<std::string, std::string>> fields;
+    fields.push_back(std::make_pair("program", ARCS::jsonString(PROGRAM)));
+    fields.push_back(std::make_pair("version", ARCS::jsonString(VERSION)));
+    fields.push_back(std::make_pair("base_name", ARCS::jsonString(params.base_name)));
+    fields.push_back(std::make_pair("threads", threads.str()));
+    if (!metrics.write(metricsFile, fields))
+        std::cerr << "Warning: Could not write " << metricsFile << ".\n";
 
-    std::unordered_map<std::string, int> indexMultMap;
     time(&rawtime);
-    std::cout << "\n=>Starting to read BAM files... " << ctime(&rawtime);
-    readBAMS(params.fofName, imap, indexMultMap, scaffSizeMap);
+    std::cout << "\n=>Done. " << ctime(&rawtime);
+}
 
-    time(&rawtime);
-    std::cout << "\n=>Starting pairing of scaffolds... " << ctime(&rawtime);
-    pairContigs(imap, pmap, indexMultMap);
+/* Read one value of a comma-separated list */
+template<typename T>
+bool readListItem(std::istream& in, T& value) {
+    in >> value;
+    return !in.fail() && in.eof();
+}
 
-    time(&rawtime);
-    std::cout << "\n=>Starting to create graph... " << ctime(&rawtime);
-    createGraph(pmap, g);
+/* Read one min-max range of a comma-separated list */
+bool readListItem(std::istream& in, std::pair<int, int>& range) {
+    char dash = 0;
+    in >> range.first >> dash >> range.second;
+    return !in.fail() && dash == '-' && in.eof();
+}
 
-    time(&rawtime);
-    std::cout << "\n=>Starting to write graph file... " << ctime(&rawtime) << "\n";
-    writePostRemovalGraph(g, graphFile);
+/*
+ * Read a comma-separated list of values from in into list.
+ * Sets the fail bit of in if an item is not valid.
+ */
+template<typename T>
+void readList(std::istream& in, std::vector<T>& list) {
+    bool ok = true;
+    std::string item;
+    list.clear();
+    while (std::getline(in, item, ',')) {
+        std::istringstream ss(item);
+        T value;
+        ok = ok && readListItem(ss, value);
+        list.push_back(value);
+    }
+    in.clear(std::ios::eofbit);
+    if (!ok || list.empty())
+        in.setstate(std::ios::failbit);
+}
 
-    time(&rawtime);
-    std::cout << "\n=>Done. " << ctime(&rawtime);
+/*
+ * Read a size in bytes, with an optional K, M or G suffix
+ * (e.g. 64G), setting failbit if it is malformed.
+ */
+void readSize(std::istream& in, size_t& size) {
+    double value;
+    if (!(in >> value))
+        return;
+    if (value < 0) {
+        in.setstate(std::ios::failbit);
+        return;
+    }
+    size_t unit = 1;
+    char suffix;
+    if (in >> suffix) {
+        switch (toupper(suffix)) {
+            case 'K': unit = size_t(1) << 10; break;
+            case 'M': unit = size_t(1) << 20; break;
+            case 'G': unit = size_t(1) << 30; break;
+            default: in.setstate(std::ios::failbit); return;
+        }
+        in.peek();
+    } else {
+        in.clear(std::ios::eofbit);
+    }
+    size = static_cast<size_t>(value * unit);
 }
 
+#ifndef ARCS_NO_MAIN
 int main(int argc, char** argv) {
 
     bool die = false;
@@ -778,8 +2845,42 @@ int main(int argc, char** argv) {
                 arg >> params.end_length; break;
             case 'r':
                 arg >> params.error_percent; break;
+            case 't':
+                arg >> params.threads; break;
             case 'v':
                 ++params.verbose; break;
+            case OPT_MMAP:
+                params.mmap = 1; break;
+            case OPT_BINOMIAL:
+                params.binomial = 1; break;
+            case OPT_TSV:
+                params.tsv = 1; break;
+            case OPT_SAVE_INDEX:
+                arg >> params.saveIndex; break;
+            case OPT_LOAD_INDEX:
+                arg >> params.loadIndex; break;
+            case OPT_READS:
+                arg >> params.reads; break;
+            case OPT_MIN_KMER_HITS:
+                arg >> params.min_kmer_hits; break;
+            case OPT_MEM_LIMIT:
+                readSize(arg, params.mem_limit); break;
+            case OPT_MATE_BUFFER:
+                arg >> params.mate_buffer; break;
+            case OPT_MATE_WINDOW:
+                arg >> params.mate_window; break;
+            case OPT_ENDS_ONLY:
+                params.ends_only = 1; break;
+            case OPT_PROGRESS:
+                arg >> params.progress; break;
+            case OPT_SWEEP_C:
+                readList(arg, params.sweep_c); break;
+            case OPT_SWEEP_L:
+                readList(arg, params.sweep_l); break;
+            case OPT_SWEEP_R:
+                readList(arg, params.sweep_r); break;
+            case OPT_SWEEP_M:
+                readList(arg, params.sweep_m); break;
             case OPT_HELP:
                 std::cout << USAGE_MESSAGE;
                 exit(EXIT_SUCCESS);
@@ -794,16 +2895,68 @@ int main(int argc, char** argv) {
         }
     }
 
-    std::ifstream f(params.fofName.c_str());
-    if (!f.good()) {
-        std::cerr << "Cannot find -a " << params.fofName << ". Exiting... \n";
+    if (!params.loadIndex.empty()) {
+        std::ifstream idx(params.loadIndex.c_str());
+        if (!idx.good()) {
+            std::cerr << "Cannot find --load-index " << params.loadIndex << ". Exiting... \n";
+            die = true;
+        }
+        if (!params.saveIndex.empty()) {
+            std::cerr << "--save-index and --load-index cannot be used together. Exiting... \n";
+            die = true;
+        }
+    } else if (!params.reads.empty()) {
+        std::ifstream r(params.reads.c_str());
+        if (!r.good()) {
+            std::cerr << "Cannot find --reads " << params.reads << ". Exiting... \n";
+            die = true;
+        }
+        if (!params.fofName.empty()) {
+            std::cerr << "-a and --reads cannot be used together. Exiting... \n";
+            die = true;
+        }
+    } else {
+        std::ifstream f(params.fofName.c_str());
+        if (!f.good()) {
+            std::cerr << "Cannot find -a " << params.fofName << ". Exiting... \n";
+            die = true;
+        }
+    }
+    if (params.loadIndex.empty()) {
+        std::ifstream g(params.file.c_str());
+        if (!g.good()) {
+            std::cerr << "Cannot find -f " << params.file << ". Exiting... \n";
+            die = true;
+        }
+    }
+
+    if (params.k_value < 1 || params.k_value > 64) {
+        std::cerr << "-k must be between 1 and 64. Exiting... \n";
+        die = true;
+    }
+
+    if (params.k_shift < 1) {
+        std::cerr << "-g must be at least 1. Exiting... \n";
+        die = true;
+    }
+
+    if (params.mate_window < 1) {
+        std::cerr << "--mate-window must be at least 1. Exiting... \n";
         die = true;
     }
-    std::ifstream g(params.file.c_str());
-    if (!g.good()) {
-        std::cerr << "Cannot find -f " << params.file << ". Exiting... \n";
+
+    if (params.progress < 0) {
+        std::cerr << "--progress must not be negative. Exiting... \n";
+        die = true;
+    }
+
+    if (params.threads < 1) {
+        std::cerr << "-t must be at least 1. Exiting... \n";
         die = true;
     }
+#if _OPENMP
+    omp_set_num_threads(params.threads);
+#endif
 
     if (die) {
         std::cerr << "Try " << PROGRAM << " --help for more information.\n";
@@ -813,7 +2966,7 @@ int main(int argc, char** argv) {
     /* Setting base name if not previously set */
     if (params.base_name.empty()) {
         std::ostringstream filename;
-        filename << params.file << ".scaff" 
+        filename << (params.loadIndex.empty() ? params.file : params.loadIndex) << ".scaff" 
             << "_s" << params.seq_id 
             << "_c" << params.min_reads
 	    << "_k" << params.k_value
@@ -829,3 +2982,4 @@ int main(int argc, char** argv) {
 
     return 0;
 }
+#endif
@@ -6,6 +6,7 @@
 #include <getopt.h>
 #include <string>
 #include <iostream>
+#include <stdint.h>
 #include <utility>
 #include <algorithm>
 #include <cmath>
@@ -15,15 +16,15 @@
 #include <sstream>
 #include <utility> 
 #include <vector>
+#include <array>
 #include <iterator>
 #include <time.h> 
 #include <boost/graph/undirected_graph.hpp>
 #include <boost/graph/graphviz.hpp>
 #include "Common/Uncompress.h"
-#include "DataLayer/FastaReader.h"
-#include "DataLayer/FastaReader.cpp"
 // using sparse hash maps for k-merization
 #include <google/sparse_hash_map>
+#include <google/dense_hash_map>
 
 
 namespace ARCS {
@@ -47,31 +48,205 @@ namespace ARCS {
         int max_degree;
         int end_length;
         float error_percent;
+        int threads;
         int verbose;
+        int mmap;
+        int binomial;
+        int tsv;
+        std::string saveIndex;
+        std::string loadIndex;
+        /* File of linked-read FASTQ files, mapped by k-mers instead of -a */
+        std::string reads;
+        int min_kmer_hits;
+        /* Bytes of counts to hold in memory before spilling them to disk; 0 for no limit */
+        size_t mem_limit;
+        /* Most reads waiting for their mate; 0 to use the mate buffer only for unsorted files */
+        size_t mate_buffer;
+        int mate_window;
+        /* Read only the contig ends of coordinate-sorted BAM files, through their index */
+        int ends_only;
+        /* Seconds between progress lines while reading; 0 for none */
+        double progress;
+        /* Threshold lists of sweep mode; empty if the option is not swept */
+        std::vector<int> sweep_c;
+        std::vector<int> sweep_l;
+        std::vector<float> sweep_r;
+        std::vector<std::pair<int, int>> sweep_m;
 
-        ArcsParams() : file(), fofName(), seq_id(98), min_reads(5), k_value(30), k_shift(1), min_links(0), min_size(500), base_name(""), min_mult(50), max_mult(10000), max_degree(0), end_length(0), error_percent(0.05), verbose(0) {}
+        ArcsParams() : file(), fofName(), seq_id(98), min_reads(5), k_value(30), k_shift(1), min_links(0), min_size(500), base_name(""), min_mult(50), max_mult(10000), max_degree(0), end_length(0), error_percent(0.05), threads(1), verbose(0), mmap(0), binomial(0), tsv(0), saveIndex(), loadIndex(), reads(), min_kmer_hits(5), mem_limit(0), mate_buffer(0), mate_window(100000), ends_only(0), progress(0), sweep_c(), sweep_l(), sweep_r(), sweep_m() {}
 
     };
 
-	typedef std::string Kmer; 
+    /* Kmer: k-mer sequence packed 2 bits per base (A=0, C=1, G=2, T=3),
+     * first base in the most significant bits. Kmer holds k <= 32,
+     * LongKmer holds 32 < k <= 64.
+     */
+	typedef uint64_t Kmer; 
+	typedef __uint128_t LongKmer; 
+
+    /* KmerHash: mixes the bits of a packed k-mer so that neighbouring
+     * k-mers do not land in neighbouring buckets
+     */
+    struct KmerHash {
+        size_t operator()(uint64_t key) const {
+            key ^= key >> 33;
+            key *= 0xff51afd7ed558ccdULL;
+            key ^= key >> 33;
+            key *= 0xc4ceb9fe1a85ec53ULL;
+            key ^= key >> 33;
+            return key;
+        }
+        size_t operator()(LongKmer key) const {
+            return (*this)(static_cast<uint64_t>(key) ^ (*this)(static_cast<uint64_t>(key >> 64)));
+        }
+    };
+
+    /* ContigTable: name and length of every contig in the contig file,
+     * indexed by a dense contig ID assigned in file order
+     */
+    struct ContigTable {
+        static const uint32_t NO_CONTIG = 0xffffffff;
+
+        std::vector<std::string> names;
+        std::vector<int> lengths;
+        std::unordered_map<std::string, uint32_t> ids;
+
+        /* Add a contig and return its ID. A repeated name keeps its ID and takes the new length. */
+        uint32_t add(const std::string& name, int length) {
+            std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> it
+                = ids.insert(std::make_pair(name, static_cast<uint32_t>(names.size())));
+            if (it.second) {
+                names.push_back(name);
+                lengths.push_back(length);
+            } else {
+                lengths[it.first->second] = length;
+            }
+            return it.first->second;
+        }
+
+        /* ID of the named contig, or NO_CONTIG */
+        uint32_t find(const std::string& name) const {
+            std::unordered_map<std::string, uint32_t>::const_iterator it = ids.find(name);
+            return it == ids.end() ? NO_CONTIG : it->second;
+        }
+
+        size_t size() const { return names.size(); }
+    };
 
-    /* ContigKMap: <k-mer, pair(contig id, bool), hash<k-mer>, eqstr>
-     * 	k-mer = string sequence
-     *  contig id = string 
-     *  bool = True for Head; False for Tail
-     *  eqstr = equal key 
+    /* ContigEnd: (contig ID << 1) | bool, bool = True for Head; False for Tail */
+    typedef uint32_t ContigEnd;
+
+    /* NO_CONTIG_END: ContigEnd of a k-mer found in more than one contig end,
+     * or of a read fragment that maps to none */
+    static const ContigEnd NO_CONTIG_END = 0xffffffff;
+
+    /* ContigKMap: <k-mer, ContigEnd, KmerHash>
+     * 	k-mer = packed canonical sequence (the smaller of the k-mer and its
+     * 	        reverse complement, see Kmer)
+     *  ContigEnd = contig ordinal and head/tail bit
      */ 
-	typedef google::sparse_hash_map<Kmer, pair<std::string, bool>> ContigKMap; 
+	typedef google::sparse_hash_map<Kmer, ContigEnd, KmerHash> ContigKMap; 
+	typedef google::sparse_hash_map<LongKmer, ContigEnd, KmerHash> LongContigKMap; 
+
+    /* Barcode: index sequence packed 2 bits per base (A=0, C=1, G=2, T=3)
+     * after a leading 1 bit, so that barcodes of different lengths differ.
+     * Holds up to 31 bases; 0 is no barcode.
+     */
+    typedef uint64_t Barcode;
+
+    /* EndCount: # times an index maps to the head and to the tail of a contig */
+    struct EndCount {
+        uint32_t contig;
+        int head;
+        int tail;
+        EndCount(uint32_t id) : contig(id), head(0), tail(0) {}
+        bool operator<(uint32_t id) const { return contig < id; }
+    };
+
+    /* ScafMap: end counts of the contigs an index maps to, sorted by contig ID */
+    typedef std::vector<EndCount> ScafMap;
+
+    /* IndexMap: key = index barcode, value = ScafMap.
+     * The ScafMaps are stored in a vector in the order the barcodes
+     * were first seen, and the hash table holds their position.
+     * nEnds is the number of EndCounts in all ScafMaps.
+     */
+    struct IndexMap {
+        google::dense_hash_map<Barcode, uint32_t, KmerHash> slots;
+        std::vector<Barcode> barcodes;
+        std::vector<ScafMap> ends;
+        size_t nEnds;
+
+        IndexMap() : nEnds(0) { slots.set_empty_key(0); }
 
-    /* ScafMap: <pair(scaffold id, bool), count>, cout =  # times index maps to scaffold (c), bool = true-head, false-tail*/
-    typedef std::map<std::pair<std::string, bool>, int> ScafMap;
-    /* IndexMap: key = index sequence, value = ScafMap */
-    typedef std::unordered_map<std::string, ScafMap> IndexMap; 
-    /* PairMap: key = pair(first < second) of scaf sequence id, value = num links*/
-    typedef std::map<std::pair<std::string, std::string>, std::vector<int>> PairMap; 
+        /* ScafMap of barcode b, added if new */
+        ScafMap& operator[](Barcode b) {
+            std::pair<google::dense_hash_map<Barcode, uint32_t, KmerHash>::iterator, bool> it
+                = slots.insert(std::make_pair(b, static_cast<uint32_t>(barcodes.size())));
+            if (it.second) {
+                barcodes.push_back(b);
+                ends.push_back(ScafMap());
+            }
+            return ends[it.first->second];
+        }
 
+        size_t size() const { return barcodes.size(); }
+
+        /* Approximate memory used, in bytes */
+        size_t bytes() const {
+            return slots.bucket_count() * sizeof(std::pair<Barcode, uint32_t>)
+                + barcodes.capacity() * sizeof(Barcode) + ends.capacity() * sizeof(ScafMap)
+                + nEnds * sizeof(EndCount);
+        }
+
+        void swap(IndexMap& o) {
+            slots.swap(o.slots);
+            barcodes.swap(o.barcodes);
+            ends.swap(o.ends);
+            std::swap(nEnds, o.nEnds);
+        }
+    };
+
+    /* IndexMultMap: key = index barcode, value = # reads with the index (multiplicity) */
+    struct IndexMultMap : google::dense_hash_map<Barcode, int, KmerHash> {
+        IndexMultMap() { set_empty_key(0); }
+
+        /* Approximate memory used, in bytes */
+        size_t bytes() const { return bucket_count() * sizeof(value_type); }
+    };
+
+    /* PairCounts: num links between two contigs in each orientation, 0-HH, 1-HT, 2-TH, 3-TT */
+    typedef std::array<uint32_t, 4> PairCounts;
+
+    /* PairMap: key = pair(first < second) of contig IDs packed as (first << 32) | second,
+     * value = num links */
+    struct PairMap : google::dense_hash_map<uint64_t, PairCounts, KmerHash> {
+        /* first < second, so a key with equal halves never occurs */
+        PairMap() { set_empty_key(~uint64_t(0)); }
+
+        static uint64_t key(uint32_t first, uint32_t second) { return uint64_t(first) << 32 | second; }
+        static uint32_t first(uint64_t key) { return key >> 32; }
+        static uint32_t second(uint64_t key) { return static_cast<uint32_t>(key); }
+
+        /* Approximate memory used, in bytes */
+        size_t bytes() const { return bucket_count() * sizeof(value_type); }
+    };
+
+    /* ReadAlignment: the fields of one SAM/BAM alignment record used to pair reads */
+    struct ReadAlignment {
+        std::string readName;
+        int flag;
+        uint32_t contig; // contig ID, ContigTable::NO_CONTIG if unmapped or unknown
+        int pos; // 1-based, 0 if unmapped
+        int mapq;
+        bool hasSeq;
+        int si; // sequence identity
+        ReadAlignment() : readName(), flag(0), contig(ContigTable::NO_CONTIG), pos(0), mapq(0), hasSeq(false), si(0) {}
+    };
+
+    /* id: contig ID, resolved to its name when the graph is written */
     struct VertexProperties {
-        std::string id;
+        uint32_t id;
     };
 
     /* Orientation: 0-HH, 1-HT, 2-TH, 3-TT */
@@ -82,8 +257,34 @@ namespace ARCS {
     };
 
 	typedef boost::undirected_graph<VertexProperties, EdgeProperties> Graph;
-    typedef std::unordered_map<std::string, Graph::vertex_descriptor> VidVdesMap;
     typedef boost::graph_traits<ARCS::Graph>::vertex_descriptor VertexDes;
+    /* VidVdesMap: boost vertex descriptor of each CompactGraph vertex */
+    typedef std::vector<VertexDes> VidVdesMap;
+
+    /* CompactGraph: the scaffold graph in compressed sparse row form.
+     * Vertices and edges are numbered in the order they were added.
+     * The edges incident to vertex v are adj[offsets[v]] to adj[offsets[v+1] - 1].
+     * A vertex is deleted by setting removed[v], which also hides its edges.
+     * writeGraph and writeTSV write it directly; toBoostGraph copies it
+     * into a Graph for the boost GraphViz writer.
+     */
+    struct CompactGraph {
+        struct Edge {
+            uint32_t u, v;
+            EdgeProperties prop;
+        };
+
+        std::vector<uint32_t> ids;      // contig ID of each vertex
+        std::vector<Edge> edges;
+        std::vector<size_t> offsets;
+        std::vector<uint32_t> adj;      // edge indices
+        std::vector<char> removed;
+
+        size_t numVertices() const { return ids.size(); }
+        size_t degree(uint32_t v) const { return offsets[v + 1] - offsets[v]; }
+        bool hasEdge(size_t e) const { return !removed[edges[e].u] && !removed[edges[e].v]; }
+    };
+
 }
 
 #endif
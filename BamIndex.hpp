@@ -0,0 +1,258 @@
+/* Reader of BAM index files (.bai and .csi), to find where the
+ * alignments of a region of a coordinate-sorted BAM file start.
+ *
+ * Both formats map each reference to a binning index: bin b holds the
+ * chunks of the file, as pairs of BGZF virtual offsets, of alignments
+ * that fit in b. A BAI file also has a linear index of the first
+ * alignment in each 16 kbp window; a CSI file stores that offset per bin.
+ *
+ * Layout reference: SAMv1 specification, section 5, and the CSIv1
+ * specification.
+ */
+
+#ifndef ARCS_BAMINDEX_H
+#define ARCS_BAMINDEX_H 1
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "BamReader.hpp"
+
+class BamIndex
+{
+public:
+    /* A chunk of the BAM file, [beg, end) in virtual offsets */
+    struct Chunk {
+        uint64_t beg, end;
+    };
+
+    BamIndex() : m_minShift(14), m_depth(5), m_isBai(false), m_ok(false) {}
+
+    /*
+     * Read the index of the BAM file at bamPath: bamPath.bai,
+     * bamPath.csi, or the .bai beside it without .bam. Returns false
+     * if none exists or it is malformed.
+     */
+    bool load(const std::string& bamPath)
+    {
+        std::string base = bamPath;
+        if (base.size() > 4 && base.compare(base.size() - 4, 4, ".bam") == 0)
+            base.resize(base.size() - 4);
+        const std::string paths[] = { bamPath + ".bai", bamPath + ".csi", base + ".bai" };
+        for (size_t i = 0; i < 3 && !m_ok; ++i)
+            m_ok = read(paths[i]);
+        return m_ok;
+    }
+
+    bool good() const { return m_ok; }
+
+    /*
+     * The virtual offset from which to read the alignments of reference
+     * tid that start in [beg, end), 0-based. Alignments before the
+     * region may come first. Returns false if the region has none.
+     */
+    bool offset(int32_t tid, int64_t beg, int64_t end, uint64_t& voffset) const
+    {
+        if (!m_ok || tid < 0 || tid >= static_cast<int32_t>(m_refs.size()) || beg >= end)
+            return false;
+        const Ref& ref = m_refs[tid];
+        uint64_t minOffset = minOffsetOf(ref, beg);
+
+        bool found = false;
+        std::vector<uint32_t> bins;
+        regionBins(beg, end, bins);
+        for (size_t i = 0; i < bins.size(); ++i) {
+            std::vector<Bin>::const_iterator b = findBin(ref, bins[i]);
+            if (b == ref.bins.end())
+                continue;
+            for (size_t c = 0; c < b->chunks.size(); ++c) {
+                if (b->chunks[c].end <= minOffset)
+                    continue;
+                uint64_t start = std::max(b->chunks[c].beg, minOffset);
+                if (!found || start < voffset)
+                    voffset = start;
+                found = true;
+            }
+        }
+        return found;
+    }
+
+private:
+    struct Bin {
+        uint32_t bin;
+        uint64_t loffset;   // CSI only
+        std::vector<Chunk> chunks;
+        bool operator<(const Bin& o) const { return bin < o.bin; }
+    };
+
+    struct Ref {
+        std::vector<Bin> bins;          // sorted by bin number
+        std::vector<uint64_t> linear;   // BAI only
+    };
+
+    /* Bin number of the first bin of level l */
+    static uint32_t firstBin(int l)
+    {
+        return ((1u << (3 * l)) - 1) / 7;
+    }
+
+    static std::vector<Bin>::const_iterator findBin(const Ref& ref, uint32_t bin)
+    {
+        Bin key;
+        key.bin = bin;
+        std::vector<Bin>::const_iterator it = std::lower_bound(ref.bins.begin(), ref.bins.end(), key);
+        return it != ref.bins.end() && it->bin == bin ? it : ref.bins.end();
+    }
+
+    /* Bins that may hold alignments overlapping [beg, end) */
+    void regionBins(int64_t beg, int64_t end, std::vector<uint32_t>& bins) const
+    {
+        --end;
+        int s = m_minShift + m_depth * 3;
+        for (int l = 0; l <= m_depth; ++l, s -= 3) {
+            for (int64_t b = firstBin(l) + (beg >> s); b <= firstBin(l) + (end >> s); ++b)
+                bins.push_back(static_cast<uint32_t>(b));
+        }
+    }
+
+    /* Offset before which no alignment overlaps position beg */
+    uint64_t minOffsetOf(const Ref& ref, int64_t beg) const
+    {
+        if (m_isBai) {
+            if (ref.linear.empty())
+                return 0;
+            size_t w = std::min(static_cast<size_t>(beg >> 14), ref.linear.size() - 1);
+            return ref.linear[w];
+        }
+        /* The leaf bin of beg or, failing that, the nearest bin to its left or above */
+        uint32_t bin = firstBin(m_depth) + static_cast<uint32_t>(beg >> m_minShift);
+        for (;;) {
+            std::vector<Bin>::const_iterator b = findBin(ref, bin);
+            if (b != ref.bins.end())
+                return b->loffset;
+            if (bin == 0)
+                return 0;
+            uint32_t parent = (bin - 1) >> 3;
+            uint32_t first = (parent << 3) + 1;
+            bin = bin > first ? bin - 1 : parent;
+        }
+    }
+
+    bool readBytes(gzFile fp, void* buf, size_t len)
+    {
+        return len == 0 || gzread(fp, buf, len) == static_cast<int>(len);
+    }
+
+    bool readInt32(gzFile fp, int32_t& v)
+    {
+        uint8_t b[4];
+        if (!readBytes(fp, b, 4))
+            return false;
+        v = static_cast<int32_t>(bamLe32(b));
+        return true;
+    }
+
+    bool readUint64(gzFile fp, uint64_t& v)
+    {
+        uint8_t b[8];
+        if (!readBytes(fp, b, 8))
+            return false;
+        v = static_cast<uint64_t>(bamLe32(b + 4)) << 32 | bamLe32(b);
+        return true;
+    }
+
+    /* Read a BAI (plain) or CSI (BGZF compressed) file; gzread handles both */
+    bool read(const std::string& path)
+    {
+        gzFile fp = gzopen(path.c_str(), "rb");
+        if (fp == NULL)
+            return false;
+        bool ok = readIndex(fp);
+        gzclose(fp);
+        if (!ok)
+            m_refs.clear();
+        return ok;
+    }
+
+    bool readIndex(gzFile fp)
+    {
+        char magic[4];
+        if (!readBytes(fp, magic, 4))
+            return false;
+        m_isBai = memcmp(magic, "BAI\1", 4) == 0;
+        if (!m_isBai) {
+            int32_t lAux;
+            if (memcmp(magic, "CSI\1", 4) != 0 || !readInt32(fp, m_minShift) || !readInt32(fp, m_depth)
+                    || !readInt32(fp, lAux) || m_minShift < 0 || m_depth < 0
+                    || m_minShift + 3 * m_depth > 62 || m_depth > 9 || lAux < 0)
+                return false;
+            char aux[4096];
+            for (int32_t n = 0; n < lAux; n += sizeof aux)
+                if (!readBytes(fp, aux, std::min<int32_t>(lAux - n, sizeof aux)))
+                    return false;
+        } else {
+            m_minShift = 14;
+            m_depth = 5;
+        }
+        /* The pseudo-bin holds statistics, not chunks */
+        uint32_t pseudoBin = firstBin(m_depth + 1) + 1;
+
+        /*
+         * The references, bins, chunks and intervals are added as they are
+         * read, so that a corrupt count fails at the end of the file rather
+         * than allocating it up front.
+         */
+        int32_t nRef;
+        if (!readInt32(fp, nRef) || nRef < 0)
+            return false;
+        for (int32_t r = 0; r < nRef; ++r) {
+            m_refs.push_back(Ref());
+            Ref& ref = m_refs.back();
+            int32_t nBin;
+            if (!readInt32(fp, nBin) || nBin < 0)
+                return false;
+            for (int32_t i = 0; i < nBin; ++i) {
+                Bin bin;
+                int32_t bn, nChunk;
+                if (!readInt32(fp, bn))
+                    return false;
+                bin.bin = static_cast<uint32_t>(bn);
+                bin.loffset = 0;
+                if ((!m_isBai && !readUint64(fp, bin.loffset)) || !readInt32(fp, nChunk) || nChunk < 0)
+                    return false;
+                for (int32_t c = 0; c < nChunk; ++c) {
+                    Chunk chunk;
+                    if (!readUint64(fp, chunk.beg) || !readUint64(fp, chunk.end))
+                        return false;
+                    bin.chunks.push_back(chunk);
+                }
+                if (bin.bin != pseudoBin)
+                    ref.bins.push_back(bin);
+            }
+            std::sort(ref.bins.begin(), ref.bins.end());
+            if (m_isBai) {
+                int32_t nIntv;
+                if (!readInt32(fp, nIntv) || nIntv < 0)
+                    return false;
+                for (int32_t i = 0; i < nIntv; ++i) {
+                    uint64_t loffset;
+                    if (!readUint64(fp, loffset))
+                        return false;
+                    ref.linear.push_back(loffset);
+                }
+            }
+        }
+        return true;
+    }
+
+    std::vector<Ref> m_refs;
+    int32_t m_minShift;
+    int32_t m_depth;
+    bool m_isBai;
+    bool m_ok;
+};
+
+#endif
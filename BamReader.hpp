@@ -0,0 +1,466 @@
+/* Minimal reader for the binary BAM alignment format.
+ *
+ * Only what ARCS needs is decoded: the reference dictionary from the
+ * header and, for each record, the fixed-size fields, read name, packed
+ * CIGAR and integer aux tags. BAM files are BGZF compressed: a series of
+ * gzip members of at most 64 KB each, whose compressed size is stored in
+ * the header, so blocks can be read without inflating them and then be
+ * inflated independently.
+ *
+ * Layout reference: SAMv1 specification, sections 4.1 and 4.2.
+ */
+
+#ifndef ARCS_BAMREADER_H
+#define ARCS_BAMREADER_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+/* Little-endian field decoding, independent of host byte order */
+static inline uint16_t bamLe16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t bamLe32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8)
+        | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/* Most uncompressed bytes in one BGZF block */
+enum { BGZF_MAX_BLOCK_SIZE = 65536 };
+
+/* CIGAR operation codes, in BAM order */
+enum { BAM_CMATCH = 0, BAM_CINS = 1, BAM_CDEL = 2, BAM_CREF_SKIP = 3,
+    BAM_CSOFT_CLIP = 4, BAM_CHARD_CLIP = 5, BAM_CPAD = 6, BAM_CEQUAL = 7,
+    BAM_CDIFF = 8 };
+
+/*
+ * One BAM alignment record. data holds the record as stored in the file
+ * (without the leading block_size) and is reused between records.
+ */
+class BamRecord
+{
+public:
+    std::vector<uint8_t> data;
+
+    int32_t refID() const { return static_cast<int32_t>(bamLe32(&data[0])); }
+    /* 0-based leftmost position */
+    int32_t pos() const { return static_cast<int32_t>(bamLe32(&data[4])); }
+    int mapq() const { return data[9]; }
+    int flag() const { return bamLe16(&data[14]); }
+    int nCigar() const { return bamLe16(&data[12]); }
+    int32_t seqLen() const { return static_cast<int32_t>(bamLe32(&data[16])); }
+
+    /* NUL-terminated read name and its length (without the NUL) */
+    const char* readName() const { return reinterpret_cast<const char*>(&data[32]); }
+    int readNameLen() const { return data[8] - 1; }
+
+    /* Packed CIGAR operation i: length << 4 | op */
+    uint32_t cigar(int i) const { return bamLe32(&data[32 + data[8] + 4 * i]); }
+
+    /*
+     * Find the integer aux tag named tag and store its value in value.
+     * Returns false if the tag is absent or not an integer, or if the
+     * aux data ends within a value.
+     */
+    bool auxInt(const char tag[2], int64_t& value) const
+    {
+        size_t i = auxOffset();
+        const size_t n = data.size();
+        while (i + 3 <= n) {
+            const uint8_t* p = &data[i];
+            char type = p[2];
+            bool match = p[0] == tag[0] && p[1] == tag[1];
+            i += 3;
+            size_t size;
+            switch (type) {
+                case 'A': case 'c': case 'C': size = 1; break;
+                case 's': case 'S': size = 2; break;
+                case 'i': case 'I': case 'f': size = 4; break;
+                case 'd': size = 8; break;
+                case 'Z': case 'H':
+                    if (match)
+                        return false;
+                    while (i < n && data[i] != 0)
+                        ++i;
+                    ++i;
+                    continue;
+                case 'B': {
+                    if (match || i + 5 > n)
+                        return false;
+                    char sub = data[i];
+                    uint64_t count = bamLe32(&data[i + 1]);
+                    uint64_t width = (sub == 'c' || sub == 'C') ? 1
+                        : (sub == 's' || sub == 'S') ? 2 : 4;
+                    if (width * count > n - i - 5)
+                        return false;
+                    i += 5 + width * count;
+                    continue;
+                }
+                default:
+                    return false;
+            }
+            if (i + size > n)
+                return false;
+            if (match) {
+                switch (type) {
+                    case 'c': value = static_cast<int8_t>(p[3]); return true;
+                    case 'C': value = p[3]; return true;
+                    case 's': value = static_cast<int16_t>(bamLe16(p + 3)); return true;
+                    case 'S': value = bamLe16(p + 3); return true;
+                    case 'i': value = static_cast<int32_t>(bamLe32(p + 3)); return true;
+                    case 'I': value = bamLe32(p + 3); return true;
+                    default: return false;
+                }
+            }
+            i += size;
+        }
+        return false;
+    }
+
+    /* Offset of the aux data, after the packed sequence and qualities */
+    size_t auxOffset() const
+    {
+        size_t l_seq = static_cast<uint32_t>(seqLen());
+        return 32 + data[8] + 4 * nCigar() + (l_seq + 1) / 2 + l_seq;
+    }
+};
+
+/*
+ * One BGZF block: the raw deflate payload as read from the file and,
+ * once inflated, its uncompressed contents.
+ */
+struct BgzfBlock
+{
+    std::vector<uint8_t> cdata;
+    std::vector<uint8_t> udata;
+    uint32_t crc;
+    uint32_t isize;
+
+    BgzfBlock() : crc(0), isize(0) {}
+
+    /*
+     * Inflate cdata into udata. Independent blocks can be inflated
+     * concurrently. Returns false if the block is corrupt.
+     */
+    bool inflate()
+    {
+        if (isize > BGZF_MAX_BLOCK_SIZE)
+            return false;
+        udata.resize(isize);
+        if (isize == 0)
+            return true;
+        z_stream zs;
+        memset(&zs, 0, sizeof zs);
+        if (inflateInit2(&zs, -15) != Z_OK)
+            return false;
+        zs.next_in = cdata.empty() ? NULL : &cdata[0];
+        zs.avail_in = cdata.size();
+        zs.next_out = &udata[0];
+        zs.avail_out = isize;
+        int ret = ::inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        return ret == Z_STREAM_END && zs.total_out == isize
+            && crc32(crc32(0L, Z_NULL, 0), &udata[0], isize) == crc;
+    }
+};
+
+/*
+ * Reader of a BAM file. The header is read on construction; check
+ * good() before reading records.
+ *
+ * Records can be read one at a time with next(), or in batches for
+ * a multithreaded pipeline: readBlocks() pulls compressed BGZF blocks
+ * from the file, the caller inflates them (in parallel) with
+ * BgzfBlock::inflate(), and splitRecords() cuts the inflated bytes into
+ * records in file order.
+ */
+class BamReader
+{
+public:
+    explicit BamReader(const std::string& path) : m_bufPos(0), m_ok(false)
+    {
+        m_fp = fopen(path.c_str(), "rb");
+        if (m_fp == NULL)
+            return;
+        m_ok = readHeader();
+    }
+
+    ~BamReader()
+    {
+        if (m_fp != NULL)
+            fclose(m_fp);
+    }
+
+    bool good() const { return m_ok; }
+
+    const std::string& headerText() const { return m_text; }
+    const std::vector<std::string>& refNames() const { return m_refNames; }
+    const std::vector<int32_t>& refLengths() const { return m_refLengths; }
+
+    /*
+     * Read the next record into rec. Returns false at the end of the file
+     * or on a truncated record (good() is then false).
+     */
+    bool next(BamRecord& rec)
+    {
+        if (!fill(4)) {
+            m_ok = m_bufPos == m_buf.size() && m_ok;
+            return false;
+        }
+        uint32_t blockSize = bamLe32(&m_buf[m_bufPos]);
+        if (blockSize < 32 || !fill(4 + blockSize)) {
+            m_ok = false;
+            return false;
+        }
+        const uint8_t* p = &m_buf[m_bufPos + 4];
+        rec.data.assign(p, p + blockSize);
+        m_bufPos += 4 + blockSize;
+        if (!checkRecord(rec)) {
+            m_ok = false;
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * Move to the BGZF virtual offset voffset, as found in a BAM index:
+     * the file offset of a block << 16 | the offset of a record in its
+     * inflated contents. Records are then read from there with next().
+     * Returns false, with good() false, if voffset is not in the file.
+     */
+    bool seek(uint64_t voffset)
+    {
+        m_buf.clear();
+        m_bufPos = 0;
+        BgzfBlock block;
+        if (fseeko(m_fp, static_cast<off_t>(voffset >> 16), SEEK_SET) != 0
+                || !readBlock(block) || !block.inflate()
+                || (voffset & 0xffff) > block.udata.size()) {
+            m_ok = false;
+            return false;
+        }
+        m_buf.swap(block.udata);
+        m_bufPos = voffset & 0xffff;
+        return true;
+    }
+
+    /*
+     * Read up to blocks.size() compressed blocks from the file into
+     * blocks. Returns the number of blocks read; 0 at the end of the file.
+     */
+    size_t readBlocks(std::vector<BgzfBlock>& blocks)
+    {
+        size_t n = 0;
+        while (n < blocks.size() && readBlock(blocks[n]))
+            ++n;
+        return n;
+    }
+
+    /*
+     * Append the inflated contents of the first nBlocks blocks to the
+     * bytes left over from the previous call, and cut them into
+     * records. Records are stored in recs, which is grown as needed and
+     * whose buffers are reused; a record split across the last block is
+     * kept for the next call. Returns the number of records stored.
+     */
+    size_t splitRecords(const std::vector<BgzfBlock>& blocks, size_t nBlocks, std::vector<BamRecord>& recs)
+    {
+        compact();
+        for (size_t b = 0; b < nBlocks; ++b)
+            m_buf.insert(m_buf.end(), blocks[b].udata.begin(), blocks[b].udata.end());
+
+        size_t n = 0;
+        while (m_buf.size() - m_bufPos >= 4) {
+            uint32_t blockSize = bamLe32(&m_buf[m_bufPos]);
+            if (blockSize < 32) {
+                m_ok = false;
+                break;
+            }
+            if (m_buf.size() - m_bufPos - 4 < blockSize)
+                break;
+            if (n == recs.size())
+                recs.resize(n + n / 2 + 1024);
+            const uint8_t* p = &m_buf[m_bufPos + 4];
+            recs[n].data.assign(p, p + blockSize);
+            m_bufPos += 4 + blockSize;
+            if (!checkRecord(recs[n])) {
+                m_ok = false;
+                break;
+            }
+            ++n;
+        }
+        /* Bytes left at the end of the file are a truncated record */
+        if (nBlocks == 0 && m_bufPos != m_buf.size())
+            m_ok = false;
+        return n;
+    }
+
+    /* True if the file at path starts with the BAM magic number */
+    static bool isBam(const std::string& path)
+    {
+        return magic(path) == "BAM\1";
+    }
+
+    /* True if the file at path starts with the CRAM magic number */
+    static bool isCram(const std::string& path)
+    {
+        return magic(path) == "CRAM";
+    }
+
+private:
+    static std::string magic(const std::string& path)
+    {
+        char buf[4];
+        gzFile fp = gzopen(path.c_str(), "r");
+        if (fp == NULL)
+            return "";
+        int n = gzread(fp, buf, 4);
+        gzclose(fp);
+        return n == 4 ? std::string(buf, 4) : "";
+    }
+
+    static bool checkRecord(const BamRecord& rec)
+    {
+        return rec.data[8] != 0
+            && 32u + rec.data[8] + 4u * rec.nCigar() <= rec.data.size()
+            && rec.seqLen() >= 0 && rec.auxOffset() <= rec.data.size();
+    }
+
+    /*
+     * Read one compressed block. Returns false at the end of the file
+     * or, with good() false, if the block header is malformed.
+     */
+    bool readBlock(BgzfBlock& block)
+    {
+        uint8_t header[18];
+        size_t n = fread(header, 1, sizeof header, m_fp);
+        if (n == 0)
+            return false;
+        /* gzip member with FEXTRA holding the 6 byte BC subfield */
+        if (n != sizeof header || header[0] != 31 || header[1] != 139
+                || header[2] != 8 || (header[3] & 4) == 0
+                || bamLe16(&header[10]) != 6
+                || header[12] != 'B' || header[13] != 'C'
+                || bamLe16(&header[14]) != 2) {
+            m_ok = false;
+            return false;
+        }
+        size_t bsize = bamLe16(&header[16]) + 1;
+        if (bsize < sizeof header + 8) {
+            m_ok = false;
+            return false;
+        }
+        block.cdata.resize(bsize - sizeof header - 8);
+        uint8_t trailer[8];
+        if ((!block.cdata.empty()
+                    && fread(&block.cdata[0], 1, block.cdata.size(), m_fp) != block.cdata.size())
+                || fread(trailer, 1, 8, m_fp) != 8) {
+            m_ok = false;
+            return false;
+        }
+        block.crc = bamLe32(trailer);
+        block.isize = bamLe32(trailer + 4);
+        if (block.isize > BGZF_MAX_BLOCK_SIZE) {
+            m_ok = false;
+            return false;
+        }
+        return true;
+    }
+
+    /* Drop the bytes already consumed from the front of m_buf */
+    void compact()
+    {
+        m_buf.erase(m_buf.begin(), m_buf.begin() + m_bufPos);
+        m_bufPos = 0;
+    }
+
+    /* Inflate blocks one at a time until len unconsumed bytes are buffered */
+    bool fill(size_t len)
+    {
+        if (m_buf.size() - m_bufPos >= len)
+            return true;
+        compact();
+        BgzfBlock block;
+        while (m_buf.size() < len) {
+            if (!readBlock(block))
+                return false;
+            if (!block.inflate()) {
+                m_ok = false;
+                return false;
+            }
+            m_buf.insert(m_buf.end(), block.udata.begin(), block.udata.end());
+        }
+        return true;
+    }
+
+    bool readFully(void* buf, size_t len)
+    {
+        if (!fill(len))
+            return false;
+        memcpy(buf, &m_buf[m_bufPos], len);
+        m_bufPos += len;
+        return true;
+    }
+
+    /*
+     * Read a string of len bytes, a length field of the header, a block
+     * at a time, so that a corrupt length fails at the end of the file
+     * rather than allocating it up front.
+     */
+    bool readString(std::string& s, uint32_t len)
+    {
+        s.clear();
+        while (s.size() < len) {
+            size_t n = std::min<size_t>(len - s.size(), BGZF_MAX_BLOCK_SIZE);
+            if (!fill(n))
+                return false;
+            s.append(reinterpret_cast<const char*>(&m_buf[m_bufPos]), n);
+            m_bufPos += n;
+        }
+        return true;
+    }
+
+    /* The references are added as they are read, so that nothing is sized by n_ref or l_name alone */
+    bool readHeader()
+    {
+        uint8_t buf[4];
+        if (!readFully(buf, 4) || memcmp(buf, "BAM\1", 4) != 0)
+            return false;
+        if (!readFully(buf, 4) || !readString(m_text, bamLe32(buf)))
+            return false;
+        if (!readFully(buf, 4))
+            return false;
+        uint32_t nRef = bamLe32(buf);
+        std::string name;
+        for (uint32_t i = 0; i < nRef; ++i) {
+            if (!readFully(buf, 4))
+                return false;
+            uint32_t l_name = bamLe32(buf);
+            if (l_name == 0 || !readString(name, l_name))
+                return false;
+            name.resize(l_name - 1);
+            if (!readFully(buf, 4))
+                return false;
+            m_refNames.push_back(name);
+            m_refLengths.push_back(static_cast<int32_t>(bamLe32(buf)));
+        }
+        return true;
+    }
+
+    FILE* m_fp;
+    /* Inflated bytes; those before m_bufPos have been consumed */
+    std::vector<uint8_t> m_buf;
+    size_t m_bufPos;
+    bool m_ok;
+    std::string m_text;
+    std::vector<std::string> m_refNames;
+    std::vector<int32_t> m_refLengths;
+};
+
+#endif
@@ -0,0 +1,106 @@
+/* Writer of BGZF compressed files, the container of BAM; used by
+ * arcs-bench and arcs-test to write BAM files.
+ */
+
+#ifndef ARCS_BGZFWRITER_H
+#define ARCS_BGZFWRITER_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+/*
+ * Writes BGZF blocks of at most BGZF_BLOCK_DATA bytes, as in a BAM file.
+ */
+class BgzfWriter {
+  public:
+    static const size_t BGZF_BLOCK_DATA = 0xff00;
+
+    explicit BgzfWriter(const std::string& path) : m_out(fopen(path.c_str(), "wb")), m_offset(0), m_ok(m_out != NULL) {
+        m_buf.reserve(BGZF_BLOCK_DATA);
+    }
+
+    ~BgzfWriter() { close(); }
+
+    /* Write the buffered data as a block of its own, so the next write starts a new block */
+    void endBlock() {
+        if (m_out != NULL && !m_buf.empty())
+            flush();
+    }
+
+    void write(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        while (len > 0) {
+            size_t n = std::min(len, BGZF_BLOCK_DATA - m_buf.size());
+            m_buf.insert(m_buf.end(), p, p + n);
+            p += n;
+            len -= n;
+            if (m_buf.size() == BGZF_BLOCK_DATA)
+                flush();
+        }
+    }
+
+    /* The virtual offset of the next byte written: block file offset << 16 | offset in the block */
+    uint64_t tell() const {
+        return m_offset << 16 | m_buf.size();
+    }
+
+    void write32(uint32_t v) {
+        uint8_t b[4] = { uint8_t(v), uint8_t(v >> 8), uint8_t(v >> 16), uint8_t(v >> 24) };
+        write(b, 4);
+    }
+
+    /* Write the last block and the empty end-of-file block. Returns false on error. */
+    bool close() {
+        if (m_out == NULL)
+            return m_ok;
+        if (!m_buf.empty())
+            flush();
+        flush();
+        m_ok = fclose(m_out) == 0 && m_ok;
+        m_out = NULL;
+        return m_ok;
+    }
+
+  private:
+    /* Compress the buffered data as one block; an empty buffer makes the EOF block */
+    void flush() {
+        std::vector<uint8_t> block(18 + compressBound(m_buf.size()) + 8);
+        z_stream zs;
+        memset(&zs, 0, sizeof zs);
+        m_ok = m_ok && deflateInit2(&zs, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!m_ok)
+            return;
+        zs.next_in = m_buf.empty() ? NULL : &m_buf[0];
+        zs.avail_in = m_buf.size();
+        zs.next_out = &block[18];
+        zs.avail_out = block.size() - 26;
+        m_ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+        size_t clen = zs.total_out;
+        deflateEnd(&zs);
+
+        static const uint8_t header[16] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0 };
+        memcpy(&block[0], header, sizeof header);
+        size_t bsize = 18 + clen + 8;
+        block[16] = uint8_t((bsize - 1) & 0xff);
+        block[17] = uint8_t((bsize - 1) >> 8);
+        uint32_t crc = crc32(crc32(0L, Z_NULL, 0), m_buf.empty() ? NULL : &m_buf[0], m_buf.size());
+        uint32_t trailer[2] = { crc, static_cast<uint32_t>(m_buf.size()) };
+        for (int i = 0; i < 8; ++i)
+            block[18 + clen + i] = uint8_t(trailer[i / 4] >> (8 * (i % 4)));
+        m_ok = m_ok && bsize <= 65536 && fwrite(&block[0], 1, bsize, m_out) == bsize;
+        m_offset += bsize;
+        m_buf.clear();
+    }
+
+    FILE* m_out;
+    std::vector<uint8_t> m_buf;
+    uint64_t m_offset;
+    bool m_ok;
+};
+
+#endif
@@ -0,0 +1,278 @@
+/* Binary snapshot of the barcode counts gathered while reading the
+ * alignments, so that runs with different pairing and graph options
+ * (-c, -l, -m, -r, -d) can skip reading the contigs and BAM files.
+ *
+ * The file is written in host byte order and read back with mmap.
+ * After the header come the following arrays, each starting on an
+ * 8-byte boundary:
+ *   int32_t  lengths[nContigs]          contig lengths, by contig ID
+ *   uint64_t nameOffsets[nContigs + 1]  contig names, as offsets into names
+ *   char     names[namesSize]
+ *   uint64_t barcodes[nBarcodes]        every barcode seen, sorted
+ *   int32_t  mult[nBarcodes]            index multiplicity of each barcode
+ *   uint64_t endOffsets[nBarcodes + 1]  end counts of each barcode, as offsets into ends
+ *   EndCount ends[nEnds]                sorted by contig ID within a barcode
+ */
+
+#ifndef ARCS_INDEXFILE_H
+#define ARCS_INDEXFILE_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Arcs_work.h"
+#include "kseq.hpp"
+#include "SpillFile.hpp"
+
+namespace ARCS {
+
+    static const char INDEX_FILE_MAGIC[8] = { 'A', 'R', 'C', 'S', 'I', 'D', 'X', '\0' };
+    static const uint32_t INDEX_FILE_VERSION = 1;
+
+    struct IndexFileHeader {
+        char magic[8];
+        uint32_t version;
+        /* Options of the run that read the alignments */
+        int32_t seq_id;
+        int32_t min_size;
+        int32_t end_length;
+        uint64_t nContigs;
+        uint64_t namesSize;
+        uint64_t nBarcodes;
+        uint64_t nEnds;
+    };
+
+    /* Bytes of padding to bring size to a multiple of 8 */
+    static inline size_t indexFilePadding(size_t size) {
+        return (8 - size % 8) % 8;
+    }
+
+    /* fwrite size bytes of data, returning false on error */
+    static inline bool writeIndexBytes(FILE* out, const void* data, size_t size) {
+        return size == 0 || fwrite(data, 1, size, out) == size;
+    }
+
+    /* Write the padding that follows an array of size bytes */
+    static inline bool writeIndexPadding(FILE* out, size_t size) {
+        static const char zeros[8] = { 0 };
+        return writeIndexBytes(out, zeros, indexFilePadding(size));
+    }
+
+    /* Write an array of n items and its padding */
+    template<typename T>
+    static bool writeIndexArray(FILE* out, const T* data, size_t n) {
+        return writeIndexBytes(out, data, n * sizeof(T)) && writeIndexPadding(out, n * sizeof(T));
+    }
+
+    /* Append the rest of in, from its start, to out. Returns false on error. */
+    static inline bool appendIndexFile(FILE* out, FILE* in) {
+        char buf[1 << 16];
+        if (fflush(in) != 0 || fseek(in, 0, SEEK_SET) != 0)
+            return false;
+        size_t n;
+        while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+            if (!writeIndexBytes(out, buf, n))
+                return false;
+        return !ferror(in);
+    }
+
+    /*
+     * Writes an index file one barcode at a time, in increasing order
+     * of barcode. The arrays that follow the barcodes are kept in
+     * temporary files (see SpillFile.hpp) until the number of barcodes
+     * is known, and the header is written last.
+     */
+    class IndexFileWriter {
+      public:
+        IndexFileWriter(const std::string& path, const ContigTable& contigs, const IndexFileHeader& options)
+            : m_hdr(options), m_nameOffsets(contigs.size() + 1, 0) {
+            m_out = fopen(path.c_str(), "wb");
+            m_mult = createSpillFile(path);
+            m_endOffsets = createSpillFile(path);
+            m_ends = createSpillFile(path);
+
+            for (size_t i = 0; i < contigs.size(); ++i)
+                m_nameOffsets[i + 1] = m_nameOffsets[i] + contigs.names[i].size();
+            memcpy(m_hdr.magic, INDEX_FILE_MAGIC, sizeof m_hdr.magic);
+            m_hdr.version = INDEX_FILE_VERSION;
+            m_hdr.nContigs = contigs.size();
+            m_hdr.namesSize = m_nameOffsets.back();
+            m_hdr.nBarcodes = 0;
+            m_hdr.nEnds = 0;
+
+            m_ok = m_out != NULL && m_mult != NULL && m_endOffsets != NULL && m_ends != NULL
+                && writeIndexArray(m_out, &m_hdr, 1)
+                && writeIndexArray(m_out, contigs.lengths.data(), contigs.size())
+                && writeIndexArray(m_out, m_nameOffsets.data(), m_nameOffsets.size());
+            for (size_t i = 0; m_ok && i < contigs.size(); ++i)
+                m_ok = writeIndexBytes(m_out, contigs.names[i].data(), contigs.names[i].size());
+            m_ok = m_ok && writeIndexPadding(m_out, m_hdr.namesSize)
+                && writeIndexBytes(m_endOffsets, &m_hdr.nEnds, sizeof m_hdr.nEnds);
+        }
+
+        ~IndexFileWriter() {
+            FILE* files[] = { m_out, m_mult, m_endOffsets, m_ends };
+            for (size_t i = 0; i < 4; ++i)
+                if (files[i] != NULL)
+                    fclose(files[i]);
+        }
+
+        /* Add barcode b, with multiplicity mult and the end counts begin to end */
+        void add(Barcode b, int32_t mult, const EndCount* begin, const EndCount* end) {
+            if (!m_ok)
+                return;
+            m_hdr.nBarcodes++;
+            m_hdr.nEnds += end - begin;
+            m_ok = writeIndexBytes(m_out, &b, sizeof b)
+                && writeIndexBytes(m_mult, &mult, sizeof mult)
+                && writeIndexBytes(m_endOffsets, &m_hdr.nEnds, sizeof m_hdr.nEnds)
+                && writeIndexBytes(m_ends, begin, (end - begin) * sizeof(EndCount));
+        }
+
+        /* Finish the file. Returns false if anything could not be written. */
+        bool close() {
+            m_ok = m_ok && writeIndexPadding(m_out, m_hdr.nBarcodes * sizeof(Barcode))
+                && appendIndexFile(m_out, m_mult)
+                && writeIndexPadding(m_out, m_hdr.nBarcodes * sizeof(int32_t))
+                && appendIndexFile(m_out, m_endOffsets)
+                && writeIndexPadding(m_out, (m_hdr.nBarcodes + 1) * sizeof(uint64_t))
+                && appendIndexFile(m_out, m_ends)
+                && writeIndexPadding(m_out, m_hdr.nEnds * sizeof(EndCount))
+                && fseek(m_out, 0, SEEK_SET) == 0
+                && writeIndexBytes(m_out, &m_hdr, sizeof m_hdr);
+            if (m_out != NULL)
+                m_ok = fclose(m_out) == 0 && m_ok;
+            m_out = NULL;
+            return m_ok;
+        }
+
+      private:
+        IndexFileHeader m_hdr;
+        std::vector<uint64_t> m_nameOffsets;
+        FILE* m_out;
+        FILE* m_mult;
+        FILE* m_endOffsets;
+        FILE* m_ends;
+        bool m_ok;
+
+        IndexFileWriter(const IndexFileWriter&);
+        IndexFileWriter& operator=(const IndexFileWriter&);
+    };
+
+    /*
+     * Write the contig table, the end counts of imap and the
+     * multiplicities of indexMultMap to path. Returns false on error.
+     */
+    static inline bool saveIndex(const std::string& path, const IndexMap& imap, const IndexMultMap& indexMultMap,
+            const ContigTable& contigs, const IndexFileHeader& options) {
+
+        /* Every barcode with a multiplicity or end counts, sorted */
+        std::vector<Barcode> barcodes;
+        barcodes.reserve(indexMultMap.size());
+        for (IndexMultMap::const_iterator it = indexMultMap.begin(); it != indexMultMap.end(); ++it)
+            barcodes.push_back(it->first);
+        for (size_t i = 0; i < imap.size(); ++i)
+            if (indexMultMap.find(imap.barcodes[i]) == indexMultMap.end())
+                barcodes.push_back(imap.barcodes[i]);
+        std::sort(barcodes.begin(), barcodes.end());
+
+        IndexFileWriter out(path, contigs, options);
+        for (size_t i = 0; i < barcodes.size(); ++i) {
+            IndexMultMap::const_iterator m = indexMultMap.find(barcodes[i]);
+            google::dense_hash_map<Barcode, uint32_t, KmerHash>::const_iterator s = imap.slots.find(barcodes[i]);
+            const ScafMap* ends = s == imap.slots.end() ? NULL : &imap.ends[s->second];
+            out.add(barcodes[i], m == indexMultMap.end() ? 0 : m->second,
+                ends == NULL ? NULL : ends->data(), ends == NULL ? NULL : ends->data() + ends->size());
+        }
+        return out.close();
+    }
+
+    /*
+     * A snapshot written by saveIndex, mapped into memory. Barcode i
+     * has multiplicity multiplicity(i) and the end counts begin(i) to end(i).
+     */
+    class IndexFile {
+      public:
+        explicit IndexFile(const std::string& path) : m_map(path.c_str()), m_hdr(NULL), m_truncated(false) {
+            if (!m_map.good() || m_map.size() < sizeof(IndexFileHeader))
+                return;
+            const IndexFileHeader* hdr = reinterpret_cast<const IndexFileHeader*>(m_map.data());
+            if (memcmp(hdr->magic, INDEX_FILE_MAGIC, sizeof hdr->magic) != 0 || hdr->version != INDEX_FILE_VERSION)
+                return;
+
+            size_t pos = sizeof(IndexFileHeader) + indexFilePadding(sizeof(IndexFileHeader));
+            m_lengths = section<int32_t>(pos, hdr->nContigs);
+            m_nameOffsets = section<uint64_t>(pos, hdr->nContigs + 1);
+            m_names = section<char>(pos, hdr->namesSize);
+            m_barcodes = section<uint64_t>(pos, hdr->nBarcodes);
+            m_mult = section<int32_t>(pos, hdr->nBarcodes);
+            m_endOffsets = section<uint64_t>(pos, hdr->nBarcodes + 1);
+            m_ends = section<EndCount>(pos, hdr->nEnds);
+            if (m_truncated || !validOffsets(m_nameOffsets, hdr->nContigs, hdr->namesSize)
+                    || !validOffsets(m_endOffsets, hdr->nBarcodes, hdr->nEnds))
+                return;
+            m_hdr = hdr;
+        }
+
+        /* True if the file was mapped and has a valid header */
+        bool good() const { return m_hdr != NULL; }
+        const IndexFileHeader& header() const { return *m_hdr; }
+
+        size_t size() const { return m_hdr->nBarcodes; }
+        Barcode barcode(size_t i) const { return m_barcodes[i]; }
+        int multiplicity(size_t i) const { return m_mult[i]; }
+        const EndCount* begin(size_t i) const { return m_ends + m_endOffsets[i]; }
+        const EndCount* end(size_t i) const { return m_ends + m_endOffsets[i + 1]; }
+
+        /* Add the contigs of the file to an empty contig table */
+        void loadContigs(ContigTable& contigs) const {
+            for (size_t i = 0; i < m_hdr->nContigs; ++i)
+                contigs.add(std::string(m_names + m_nameOffsets[i], m_nameOffsets[i + 1] - m_nameOffsets[i]), m_lengths[i]);
+        }
+
+      private:
+        /*
+         * Whether the n + 1 offsets start at 0, never decrease and end
+         * at total, so that every item they delimit lies within total
+         */
+        static bool validOffsets(const uint64_t* offsets, uint64_t n, uint64_t total) {
+            if (offsets[0] != 0 || offsets[n] != total)
+                return false;
+            for (uint64_t i = 0; i < n; ++i)
+                if (offsets[i] > offsets[i + 1])
+                    return false;
+            return true;
+        }
+
+        /* The array of n items at pos, advancing pos past it */
+        template<typename T>
+        const T* section(size_t& pos, uint64_t n) {
+            if (m_truncated || pos > m_map.size() || n > (m_map.size() - pos) / sizeof(T)) {
+                m_truncated = true;
+                return NULL;
+            }
+            const T* s = reinterpret_cast<const T*>(m_map.data() + pos);
+            pos += n * sizeof(T);
+            pos += indexFilePadding(pos);
+            return s;
+        }
+
+        MappedFile m_map;
+        const IndexFileHeader* m_hdr;
+        const int32_t* m_lengths;
+        const uint64_t* m_nameOffsets;
+        const char* m_names;
+        const uint64_t* m_barcodes;
+        const int32_t* m_mult;
+        const uint64_t* m_endOffsets;
+        const EndCount* m_ends;
+        bool m_truncated;
+
+        IndexFile(const IndexFile&);
+        IndexFile& operator=(const IndexFile&);
+    };
+}
+
+#endif
@@ -0,0 +1,222 @@
+/* Run metrics: the wall time, CPU time and memory of each stage of a
+ * run, and counters of the records, pairs, barcodes and edges seen,
+ * written as JSON to <base name>_metrics.json by runArcs.
+ *
+ * Times are taken from a monotonic clock and from getrusage. The peak
+ * RSS of a stage is that of the whole process when the stage ends, so
+ * it never decreases from one stage to the next. In sweep mode the graph
+ * counters are summed over all the graphs.
+ */
+
+#ifndef ARCS_METRICS_H
+#define ARCS_METRICS_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ARCS {
+
+    /* Peak resident set size of this process so far, in bytes */
+    static inline size_t peakRSS() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return static_cast<size_t>(usage.ru_maxrss) * 1024;
+    }
+
+    /* Current resident set size of this process, in bytes, or 0 if unknown */
+    static inline size_t currentRSS() {
+        long pages = 0, resident = 0;
+        FILE* f = fopen("/proc/self/statm", "r");
+        if (f == NULL)
+            return 0;
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+        return static_cast<size_t>(resident) * sysconf(_SC_PAGESIZE);
+    }
+
+    /* Wall and CPU time of the process at one point */
+    struct UsageSample {
+        std::chrono::steady_clock::time_point wall;
+        double user, sys;
+
+        static UsageSample now() {
+            UsageSample s;
+            s.wall = std::chrono::steady_clock::now();
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            s.user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+            s.sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+            return s;
+        }
+    };
+
+    /* Resources used from one UsageSample to another */
+    struct StageMetrics {
+        std::string name;
+        double wall, user, sys;
+        size_t peakRSS, rss;
+
+        StageMetrics(const std::string& name, const UsageSample& start, const UsageSample& end)
+            : name(name), wall(std::chrono::duration<double>(end.wall - start.wall).count()),
+            user(end.user - start.user), sys(end.sys - start.sys),
+            peakRSS(ARCS::peakRSS()), rss(currentRSS()) {}
+    };
+
+    /* JSON string literal of s */
+    static inline std::string jsonString(const std::string& s) {
+        std::string out = "\"";
+        for (size_t i = 0; i < s.size(); ++i) {
+            unsigned char c = s[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof buf, "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+
+    /*
+     * The stages and counters of a run. Stages follow one another:
+     * beginStage ends the current stage, if any. Counters keep the
+     * order in which they were first added. Not thread-safe.
+     */
+    class Metrics {
+      public:
+        Metrics() : m_start(UsageSample::now()), m_inStage(false) {}
+
+        void beginStage(const std::string& name) {
+            endStage();
+            m_stageName = name;
+            m_stageStart = UsageSample::now();
+            m_inStage = true;
+        }
+
+        void endStage() {
+            if (m_inStage)
+                m_stages.push_back(StageMetrics(m_stageName, m_stageStart, UsageSample::now()));
+            m_inStage = false;
+        }
+
+        /* Add n to the named counter */
+        void add(const std::string& name, uint64_t n) {
+            for (size_t i = 0; i < m_counters.size(); ++i) {
+                if (m_counters[i].first == name) {
+                    m_counters[i].second += n;
+                    return;
+                }
+            }
+            m_counters.push_back(std::make_pair(name, n));
+        }
+
+        /* Value of the named counter, 0 if it was never added to */
+        uint64_t counter(const std::string& name) const {
+            for (size_t i = 0; i < m_counters.size(); ++i)
+                if (m_counters[i].first == name)
+                    return m_counters[i].second;
+            return 0;
+        }
+
+        /*
+         * End the current stage and write the run, its stages and
+         * counters, with the given top-level fields, as JSON to path.
+         * Returns false on error.
+         */
+        bool write(const std::string& path, const std::vector<std::pair<std::string, std::string>>& fields) {
+            endStage();
+            FILE* out = fopen(path.c_str(), "w");
+            if (out == NULL)
+                return false;
+            fprintf(out, "{\n");
+            for (size_t i = 0; i < fields.size(); ++i)
+                fprintf(out, "  %s: %s,\n", jsonString(fields[i].first).c_str(), fields[i].second.c_str());
+            fprintf(out, "  \"total\": ");
+            writeStage(out, StageMetrics("total", m_start, UsageSample::now()));
+            fprintf(out, ",\n  \"stages\": [");
+            for (size_t i = 0; i < m_stages.size(); ++i) {
+                fprintf(out, "%s\n    ", i > 0 ? "," : "");
+                writeStage(out, m_stages[i]);
+            }
+            fprintf(out, "%s],\n  \"counters\": {", m_stages.empty() ? "" : "\n  ");
+            for (size_t i = 0; i < m_counters.size(); ++i)
+                fprintf(out, "%s\n    %s: %llu", i > 0 ? "," : "", jsonString(m_counters[i].first).c_str(),
+                    static_cast<unsigned long long>(m_counters[i].second));
+            fprintf(out, "%s}\n}\n", m_counters.empty() ? "" : "\n  ");
+            bool ok = !ferror(out);
+            return fclose(out) == 0 && ok;
+        }
+
+      private:
+        static void writeStage(FILE* out, const StageMetrics& s) {
+            fprintf(out, "{\"name\": %s, \"wall_seconds\": %.6f, \"user_seconds\": %.6f, \"system_seconds\": %.6f,"
+                " \"peak_rss_bytes\": %zu, \"rss_bytes\": %zu}",
+                jsonString(s.name).c_str(), s.wall, s.user, s.sys, s.peakRSS, s.rss);
+        }
+
+        UsageSample m_start;
+        std::vector<StageMetrics> m_stages;
+        std::vector<std::pair<std::string, uint64_t>> m_counters;
+        std::string m_stageName;
+        UsageSample m_stageStart;
+        bool m_inStage;
+    };
+
+    /*
+     * Counts the records read by any number of threads and, every
+     * interval seconds, prints a line with the count and rate to stdout.
+     */
+    class ProgressMeter {
+      public:
+        ProgressMeter() : m_interval(0), m_count(0), m_next(0) {}
+
+        /* Start counting the records of what from 0, reporting every interval seconds; 0 for never */
+        void start(const std::string& what, double interval) {
+            m_what = what;
+            m_interval = static_cast<int64_t>(interval * 1e9);
+            m_start = std::chrono::steady_clock::now();
+            m_count = 0;
+            m_next = m_interval;
+        }
+
+        /* Add n records. Thread-safe. */
+        void add(uint64_t n) {
+            uint64_t count = m_count += n;
+            if (m_interval <= 0)
+                return;
+            int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_start).count();
+            int64_t next = m_next;
+            /* One thread reports each interval */
+            if (elapsed < next || !m_next.compare_exchange_strong(next, elapsed + m_interval))
+                return;
+            double secs = elapsed / 1e9;
+            char line[128];
+            snprintf(line, sizeof line, "%s: %llu records in %.1f s, %.0f records/s\n", m_what.c_str(),
+                static_cast<unsigned long long>(count), secs, count / secs);
+            fputs(line, stdout);
+            fflush(stdout);
+        }
+
+      private:
+        std::string m_what;
+        int64_t m_interval;
+        std::chrono::steady_clock::time_point m_start;
+        std::atomic<uint64_t> m_count;
+        std::atomic<int64_t> m_next;
+    };
+}
+
+#endif
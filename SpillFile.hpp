@@ -0,0 +1,206 @@
+/* Sorted runs of fixed-size records spilled to temporary files, for
+ * counting barcodes and contig pairs in bounded memory (--mem-limit).
+ *
+ * Counts are gathered in the usual hash tables until those reach their
+ * share of the memory limit. They are then written out sorted, as one
+ * run, and the tables are emptied. Once all the input has been counted,
+ * RunMerger reads the runs back in a single k-way merge, in key order,
+ * and the caller adds up the records with equal keys.
+ *
+ * The temporary files are unlinked as soon as they are created, so
+ * they disappear when they are closed or the program exits.
+ */
+
+#ifndef ARCS_SPILLFILE_H
+#define ARCS_SPILLFILE_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+#include "Arcs_work.h"
+
+namespace ARCS {
+
+    /* BarcodeRecord: the EndCount of a barcode and contig, or with contig
+     * NO_CONTIG the multiplicity of the barcode in head. Sorted by barcode,
+     * then contig, so the multiplicity comes after the end counts. */
+    struct BarcodeRecord {
+        Barcode barcode;
+        uint32_t contig;
+        int32_t head;
+        int32_t tail;
+
+        bool sameKey(const BarcodeRecord& o) const { return barcode == o.barcode && contig == o.contig; }
+        bool operator<(const BarcodeRecord& o) const {
+            return barcode < o.barcode || (barcode == o.barcode && contig < o.contig);
+        }
+        bool operator>(const BarcodeRecord& o) const { return o < *this; }
+    };
+
+    /* PairRecord: the link counts of a PairMap key. Sorted by key. */
+    struct PairRecord {
+        uint64_t key;
+        PairCounts counts;
+
+        bool sameKey(const PairRecord& o) const { return key == o.key; }
+        bool operator<(const PairRecord& o) const { return key < o.key; }
+        bool operator>(const PairRecord& o) const { return o.key < key; }
+    };
+
+    /* Number of records buffered by a RecordWriter */
+    static const size_t SPILL_WRITE_RECORDS = 1 << 16;
+
+    /*
+     * Create an unlinked temporary file next to prefix (a path prefix,
+     * such as the base name of the output), open for writing and reading.
+     * Returns NULL on error.
+     */
+    static inline FILE* createSpillFile(const std::string& prefix) {
+        std::vector<char> path(prefix.begin(), prefix.end());
+        const char suffix[] = ".spill.XXXXXX";
+        path.insert(path.end(), suffix, suffix + sizeof suffix);
+        int fd = mkstemp(path.data());
+        if (fd < 0)
+            return NULL;
+        unlink(path.data());
+        FILE* f = fdopen(fd, "w+b");
+        if (f == NULL)
+            close(fd);
+        return f;
+    }
+
+    /* Buffered writer of records to a file */
+    template<typename Record>
+    class RecordWriter {
+      public:
+        explicit RecordWriter(FILE* out) : m_out(out), m_ok(out != NULL) {
+            m_buf.reserve(SPILL_WRITE_RECORDS);
+        }
+
+        void push(const Record& r) {
+            m_buf.push_back(r);
+            if (m_buf.size() == SPILL_WRITE_RECORDS)
+                flush();
+        }
+
+        /* Write the buffered records. Returns false if any write failed. */
+        bool flush() {
+            if (m_ok && !m_buf.empty())
+                m_ok = fwrite(m_buf.data(), sizeof(Record), m_buf.size(), m_out) == m_buf.size();
+            m_buf.clear();
+            return m_ok;
+        }
+
+      private:
+        FILE* m_out;
+        std::vector<Record> m_buf;
+        bool m_ok;
+    };
+
+    /*
+     * The runs of one kind of record written so far, each in its own
+     * temporary file. Creating runs is not thread-safe.
+     */
+    template<typename Record>
+    class SortedRuns {
+      public:
+        SortedRuns() {}
+        ~SortedRuns() {
+            for (size_t i = 0; i < m_files.size(); ++i)
+                fclose(m_files[i]);
+        }
+
+        /* Start a new run, returning the file to write it to, or NULL on error */
+        FILE* create(const std::string& prefix) {
+            FILE* f = createSpillFile(prefix);
+            if (f != NULL)
+                m_files.push_back(f);
+            return f;
+        }
+
+        size_t size() const { return m_files.size(); }
+        bool empty() const { return m_files.empty(); }
+        FILE* file(size_t i) const { return m_files[i]; }
+
+      private:
+        std::vector<FILE*> m_files;
+
+        SortedRuns(const SortedRuns&);
+        SortedRuns& operator=(const SortedRuns&);
+    };
+
+    /*
+     * k-way merge of the runs of a SortedRuns, reading each run from its
+     * start with a buffer of bufRecords records. Records with equal keys
+     * are returned one after the other, in no particular run order.
+     */
+    template<typename Record>
+    class RunMerger {
+      public:
+        RunMerger(const SortedRuns<Record>& runs, size_t bufRecords)
+            : m_runs(runs.size()), m_ok(true) {
+            for (size_t i = 0; i < runs.size(); ++i) {
+                Run& run = m_runs[i];
+                run.file = runs.file(i);
+                run.buf.resize(std::max(bufRecords, size_t(1)));
+                run.pos = run.len = 0;
+                m_ok = fflush(run.file) == 0 && fseek(run.file, 0, SEEK_SET) == 0 && m_ok;
+                Record r;
+                if (read(i, r))
+                    m_heap.push(Entry(r, i));
+            }
+        }
+
+        /* Store the next record in r. Returns false once all runs are read. */
+        bool next(Record& r) {
+            if (m_heap.empty())
+                return false;
+            Entry top = m_heap.top();
+            m_heap.pop();
+            r = top.first;
+            Record n;
+            if (read(top.second, n))
+                m_heap.push(Entry(n, top.second));
+            return true;
+        }
+
+        /* False if a run could not be read back in full */
+        bool good() const { return m_ok; }
+
+      private:
+        struct Run {
+            FILE* file;
+            std::vector<Record> buf;
+            size_t pos, len;
+        };
+        typedef std::pair<Record, size_t> Entry;
+        struct EntryGreater {
+            bool operator()(const Entry& a, const Entry& b) const { return a.first > b.first; }
+        };
+
+        bool read(size_t i, Record& r) {
+            Run& run = m_runs[i];
+            if (run.pos == run.len) {
+                run.len = fread(run.buf.data(), sizeof(Record), run.buf.size(), run.file);
+                run.pos = 0;
+                if (run.len == 0) {
+                    m_ok = m_ok && feof(run.file) && !ferror(run.file);
+                    return false;
+                }
+            }
+            r = run.buf[run.pos++];
+            return true;
+        }
+
+        std::vector<Run> m_runs;
+        std::priority_queue<Entry, std::vector<Entry>, EntryGreater> m_heap;
+        bool m_ok;
+    };
+}
+
+#endif
@@ -38,9 +38,16 @@
 #define HAVE_BZIP2 1
 
 #include <ctype.h>
+#include <string.h>
 #include <string>
 #include <cstdlib>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #if HAVE_ZLIB
 #include <zlib.h>
@@ -76,6 +83,67 @@ public:
     }
 };
 
+/*Read-only memory mapping of a whole regular file, advised for sequential access*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const char* path)
+    {
+        this->data_ = NULL;
+        this->size_ = 0;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                this->data_ = (char*)p;
+                this->size_ = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (this->data_ != NULL)
+            munmap(this->data_, this->size_);
+    }
+
+    bool good() const { return this->data_ != NULL; }
+    const char *data() const { return this->data_; }
+    size_t size() const { return this->size_; }
+
+    /*True if the mapped data starts with the gzip magic number*/
+    bool isGzip() const
+    {
+        return this->size_ >= 2 && (unsigned char)this->data_[0] == 0x1f
+            && (unsigned char)this->data_[1] == 0x8b;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    char *data_;
+    size_t size_;
+};
+
+/*Read functor of a kstream scanning a MappedFile in place: the whole
+  file is already in the buffer, so there is never more to read*/
+class FunctorMmap
+{
+public:
+    size_t operator()(const MappedFile*, void*, size_t)
+    {
+        return 0;
+    }
+};
+
 class kseq
 {
 public:
@@ -89,23 +157,71 @@ public:
 };
 
 
+/*Lookup tables for the delimiter scans of kstream::getuntil*/
+struct kstream_ctype
+{
+    unsigned char space[256];    /*isspace()*/
+    unsigned char nonblank[256]; /*isspace() && != ' '*/
+    unsigned char seqchar[256];  /*SEQ_SKIP, SEQ_BASE or SEQ_STOP*/
+
+    /*Classes of the bytes of a sequence: skipped, kept, or the start
+      of the next record or of the quality ('>', '@' or '+')*/
+    enum { SEQ_SKIP = 0, SEQ_BASE = 1, SEQ_STOP = 2 };
+
+    kstream_ctype()
+    {
+        for (int c = 0; c < 256; ++c)
+        {
+            this->space[c] = isspace(c) ? 1 : 0;
+            this->nonblank[c] = isspace(c) && c != ' ' ? 1 : 0;
+            this->seqchar[c] = c == '>' || c == '@' || c == '+' ? SEQ_STOP
+                : isgraph(c) ? SEQ_BASE : SEQ_SKIP;
+        }
+    }
+
+    static const kstream_ctype& get()
+    {
+        static const kstream_ctype table;
+        return table;
+    }
+};
+
+/*Default size of the kstream read buffer*/
+static const size_t KSTREAM_BUFSIZE = 1 << 20;
+
 template<class ret_t, class ReadFunction>
 class kstream
 {
 public:
-    kstream(ret_t f, ReadFunction rf)
+    kstream(ret_t f, ReadFunction rf, size_t bufsize = KSTREAM_BUFSIZE)
     {
         this->f = f;
-        this->buf = (char*)malloc(4096);
+        this->bufsize = bufsize > 0 ? bufsize : KSTREAM_BUFSIZE;
+        this->buf = (char*)malloc(this->bufsize);
+        this->owns_buf = 1;
         this->is_eof = 0;
         this->begin = 0;
         this->end = 0;
         this->readfunc = rf;
     }
 
+    /*Scan len bytes at data (e.g. a MappedFile) in place, without copying*/
+    kstream(const char *data, size_t len)
+    {
+        this->f = ret_t();
+        this->bufsize = len;
+        this->buf = const_cast<char*>(data);
+        this->owns_buf = 0;
+        this->is_eof = 1;
+        this->begin = 0;
+        this->end = len;
+        this->readfunc = ReadFunction();
+    }
+
     ~kstream()
     {
-        free(buf);
+        if (this->owns_buf)
+            free(buf);
     }
 
     int read(kseq& seq)
@@ -126,12 +242,30 @@ public:
             return -1;
         if (c != '\n')
             this->getuntil( '\n', seq.comment, 0);
-        while ((c = this->getc()) != -1 && c != '>' && c != '+' && c != '@')
+
+        /*Append runs of printable characters up to the next '>', '@' or
+          '+', wherever it is in the line, as the character loop did*/
+        const unsigned char *seqchar = kstream_ctype::get().seqchar;
+        for (c = 0; c == 0;)
         {
-            if (isgraph(c))
+            if (!this->available())
+            {
+                c = -1;
+                break;
+            }
+            const char *p = this->buf + this->begin;
+            size_t len = this->end - this->begin, i = 0;
+            while (i < len && c == 0)
             {
-                seq.seq += (char)c;
+                size_t j = i;
+                while (j < len && seqchar[(unsigned char)p[j]] == kstream_ctype::SEQ_BASE)
+                    ++j;
+                seq.seq.append(p + i, j - i);
+                if (j < len && seqchar[(unsigned char)p[j]] == kstream_ctype::SEQ_STOP)
+                    c = (unsigned char)p[j];
+                i = j < len ? j + 1 : len;
             }
+            this->begin += i;
         }
         if (c == '>' || c == '@')
             seq.last_char = c;
@@ -140,14 +274,28 @@ public:
             return (int)seq.seq.length();
 
 
-        while ((c = this->getc()) != -1 && c != '\n');
-
-        if (c == -1)
+        if (this->skip_line() == -1)
             return -2;
-        while ((c = this->getc()) != -1 && seq.qual.length() < seq.seq.length()) {
-            if (c >= 33 && c <= 127)
-                seq.qual += (char)c;
+
+        /*Take printable characters until the quality is as long as the
+          sequence, then consume the one character after it*/
+        bool at_eof = false;
+        while (seq.qual.length() < seq.seq.length())
+        {
+            if (!this->available())
+            {
+                at_eof = true;
+                break;
+            }
+            while (this->begin < this->end && seq.qual.length() < seq.seq.length())
+            {
+                c = (unsigned char)this->buf[this->begin++];
+                if (c >= 33 && c <= 127)
+                    seq.qual += (char)c;
+            }
         }
+        if (!at_eof)
+            this->getc();
         seq.last_char = 0;
         if (seq.seq.length() != seq.qual.length())
             return -2;
@@ -157,18 +305,71 @@ public:
 private:
     int getc()
     {
-        if (this->is_eof && this->begin >= this->end)
+        if (!this->available())
             return -1;
-        if (this->begin >= this->end)
+        return (int)this->buf[this->begin++];
+    }
+
+    /*True if there is unread data, refilling the buffer if needed*/
+    bool available()
+    {
+        if (this->begin < this->end)
+            return true;
+        if (this->is_eof)
+            return false;
+        this->fill();
+        return this->end > 0;
+    }
+
+    /*Skip past the next newline; returns '\n' or -1 at the end of input*/
+    int skip_line()
+    {
+        while (this->available())
         {
-            this->begin = 0;
-            this->end = this->readfunc(this->f, this->buf, 4096);
-            if (this->end < 4096)
-                this->is_eof = 1;
-            if (this->end == 0)
-                return -1;
+            const char *p = this->buf + this->begin;
+            const char *nl = (const char*)memchr(p, '\n', this->end - this->begin);
+            if (nl != NULL)
+            {
+                this->begin += nl - p + 1;
+                return '\n';
+            }
+            this->begin = this->end;
         }
-        return (int)this->buf[this->begin++];
+        return -1;
+    }
+
+    /*Index of the first byte of buf[from, to) set in table, or to*/
+    size_t find_in(size_t from, size_t to, const unsigned char *table)
+    {
+        size_t i = from;
+#ifdef __SSE2__
+        /*Whitespace is ' ' or '\t'..'\r'; test 16 bytes at a time and
+          let the table decide which of the candidates count*/
+        const __m128i blank = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i span = _mm_set1_epi8('\r' - '\t');
+        for (; i + 16 <= to; i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(this->buf + i));
+            /*v - '\t' <= '\r' - '\t' as unsigned bytes*/
+            __m128i d = _mm_sub_epi8(v, tab);
+            __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(d, span), d);
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, blank), in_range));
+            while (mask != 0)
+            {
+                int bit = __builtin_ctz(mask);
+                if (table[(unsigned char)this->buf[i + bit]])
+                    return i + bit;
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < to; ++i)
+        {
+            if (table[(unsigned char)this->buf[i]])
+                break;
+        }
+        return i;
     }
 
     int getuntil(int delimiter, std::string &str, int *dret)
@@ -183,15 +384,12 @@ private:
             return -1;
         for (;;)
         {
-            int i;
+            size_t i;
             if (this->begin >= this->end)
             {
                 if (!this->is_eof)
                 {
-                    this->begin = 0;
-                    this->end = this->readfunc(this->f, this->buf, 4096);
-                    if (this->end < 4096)
-                        this->is_eof = 1;
+                    this->fill();
                     if (this->end == 0)
                         break;
                 }
@@ -200,27 +398,14 @@ private:
             }
             if (delimiter > 1)
             {
-                for (i = this->begin; i < this->end; ++i)
-                {
-                    if (this->buf[i] == delimiter)
-                        break;
-                }
+                const char *p = (const char*)memchr(this->buf + this->begin,
+                        delimiter, this->end - this->begin);
+                i = p != NULL ? p - this->buf : this->end;
             }
             else if (delimiter == 0)
-            {
-                for (i = this->begin; i < this->end; ++i)
-                {
-                    if (isspace(this->buf[i]))
-                        break;
-                }
-            }
+                i = this->find_in(this->begin, this->end, kstream_ctype::get().space);
             else if (delimiter == 1)
-            {
-                for (i = this->begin; i < this->end; ++i){
-                    if (isspace(this->buf[i]) && this->buf[i] != ' ')
-                        break;
-                }
-            }
+                i = this->find_in(this->begin, this->end, kstream_ctype::get().nonblank);
             else i = 0;
 
             str.append(this->buf + this->begin, i - this->begin);
@@ -235,9 +420,22 @@ private:
         return (int)str.length();
     }
 
+    /*Refill the buffer from the read function. Only a read returning
+      nothing marks the end of the input: pipes return short reads*/
+    void fill()
+    {
+        this->begin = 0;
+        long n = (long)this->readfunc(this->f, this->buf, this->bufsize);
+        this->end = n > 0 ? (size_t)n : 0;
+        if (this->end == 0)
+            this->is_eof = 1;
+    }
+
     char *buf;
-    int begin;
-    int end;
+    size_t bufsize;
+    int owns_buf;
+    size_t begin;
+    size_t end;
     int is_eof;
     ret_t f;
     ReadFunction readfunc;